@@ -0,0 +1,101 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "crnlibencoder.h"
+#include "imagehelper.h"
+#include "spraymakerexception.h"
+
+#include <crnlib/crn_dxt_image.h>
+#include <crnlib/crn_threading.h>
+
+#include <cstring>
+
+struct CrnlibEncoder::Context
+{
+    // Helper threads stay alive between images
+    crnlib::task_pool taskPool;
+    bool hasTaskPool = false;
+};
+
+CrnlibEncoder::CrnlibEncoder(SpraymakerModel::ImageFormat format, crnlib::pixel_format crnFormat,
+                             int helperThreads,
+                             ProgressCallback progressCallback, void* progressCallbackData,
+                             const std::atomic<bool>* cancelled)
+    : format(format)
+    , crnFormat(crnFormat)
+    , helperThreads(helperThreads)
+    , progressCallback(progressCallback)
+    , progressCallbackData(progressCallbackData)
+    , cancelled(cancelled)
+{}
+
+CrnlibEncoder::~CrnlibEncoder() = default;
+
+std::unique_ptr<CrnlibEncoder::Context> CrnlibEncoder::acquireContext() const
+{
+    {
+        std::scoped_lock lock(contextMutex);
+        if (contexts.empty() == false)
+        {
+            auto context = std::move(contexts.back());
+            contexts.pop_back();
+            return context;
+        }
+    }
+
+    auto context = std::make_unique<Context>();
+    if (helperThreads > 0)
+        context->hasTaskPool = context->taskPool.init(helperThreads);
+    return context;
+}
+
+void CrnlibEncoder::releaseContext(std::unique_ptr<Context> context) const
+{
+    std::scoped_lock lock(contextMutex);
+    contexts.push_back(std::move(context));
+}
+
+bool CrnlibEncoder::supports(SpraymakerModel::ImageFormat format) const
+{
+    return format == this->format && ImageHelper::isDxt(format);
+}
+
+bool CrnlibEncoder::encode(const uchar* pixels, int width, int height, uchar* output, size_t size) const
+{
+    auto context = acquireContext();
+
+    auto params = crnlib::dxt_image::pack_params();
+    params.m_pProgress_callback = progressCallback;
+    params.m_pProgress_callback_user_data_ptr = progressCallbackData;
+    params.m_num_helper_threads = helperThreads;
+    params.m_pTask_pool = context->hasTaskPool ? &context->taskPool : nullptr;
+
+    // Aliases the pixels, nothing is copied
+    crnlib::image_u8 image((crnlib::color_quad_u8*)pixels, width, height);
+
+    crnlib::dxt_image dxtImage;
+    const bool converted = dxtImage.init(crnlib::pixel_format_helpers::get_dxt_format(crnFormat), image, params);
+
+    if (converted)
+    {
+        const auto& dataVec = dxtImage.get_element_vec();
+        memcpy(output, dataVec.get_ptr(), std::min(size, dataVec.size() * sizeof(crnlib::dxt_image::element)));
+    }
+
+    releaseContext(std::move(context));
+
+    if (converted == false)
+    {
+        // crnlib was stopped by the progress callback
+        if (cancelled != nullptr && *cancelled)
+            return false;
+
+        throw SpraymakerException(QObject::tr("crnlib failed to compress the image."));
+    }
+
+    return true;
+}
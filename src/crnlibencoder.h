@@ -0,0 +1,55 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRNLIBENCODER_H
+#define CRNLIBENCODER_H
+
+#include "imageencoder.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// ========== CrnlibEncoder ==========
+
+// Encodes DXT formats through crnlib
+class CrnlibEncoder : public ImageEncoder
+{
+public:
+    // Returning false from the progress callback aborts the encode
+    using ProgressCallback = bool (*)(uint percentage_complete, void* pUser_data_ptr);
+
+    CrnlibEncoder(SpraymakerModel::ImageFormat format, crnlib::pixel_format crnFormat,
+                  int helperThreads,
+                  ProgressCallback progressCallback, void* progressCallbackData,
+                  const std::atomic<bool>* cancelled);
+    ~CrnlibEncoder();
+
+    bool supports(SpraymakerModel::ImageFormat format) const override;
+    bool encode(const uchar* pixels, int width, int height, uchar* output, size_t size) const override;
+
+private:
+    SpraymakerModel::ImageFormat format;
+    crnlib::pixel_format crnFormat;
+    int helperThreads;
+
+    ProgressCallback progressCallback;
+    void* progressCallbackData;
+    const std::atomic<bool>* cancelled;
+
+    // State reused between encodes instead of being rebuilt for every image.
+    // Each encode borrows one, so there are only ever as many as concurrent encodes.
+    struct Context;
+    mutable std::mutex contextMutex;
+    mutable std::vector<std::unique_ptr<Context>> contexts;
+
+    std::unique_ptr<Context> acquireContext() const;
+    void releaseContext(std::unique_ptr<Context> context) const;
+};
+
+#endif // CRNLIBENCODER_H
@@ -0,0 +1,672 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "dxtencoder.h"
+#include "imagehelper.h"
+
+#include <algorithm>
+#include <array>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DXTENCODER_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// ========== Vec4 ==========
+
+// Four floats, kept in an SSE2 register where the target has one
+class Vec4
+{
+public:
+#ifdef DXTENCODER_SSE2
+    Vec4() : v(_mm_setzero_ps()) {}
+    explicit Vec4(float s) : v(_mm_set1_ps(s)) {}
+    Vec4(float x, float y, float z, float w) : v(_mm_setr_ps(x, y, z, w)) {}
+
+    float x() const { return _mm_cvtss_f32(v); }
+    std::array<float, 4> toArray() const { std::array<float, 4> a; _mm_storeu_ps(a.data(), v); return a; }
+
+    Vec4 splatX() const { return Vec4(_mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0))); }
+    Vec4 splatY() const { return Vec4(_mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1))); }
+    Vec4 splatZ() const { return Vec4(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2))); }
+    Vec4 splatW() const { return Vec4(_mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3))); }
+
+    Vec4& operator+=(Vec4 o) { v = _mm_add_ps(v, o.v); return *this; }
+    friend Vec4 operator+(Vec4 a, Vec4 b) { return Vec4(_mm_add_ps(a.v, b.v)); }
+    friend Vec4 operator-(Vec4 a, Vec4 b) { return Vec4(_mm_sub_ps(a.v, b.v)); }
+    friend Vec4 operator*(Vec4 a, Vec4 b) { return Vec4(_mm_mul_ps(a.v, b.v)); }
+
+    friend Vec4 min(Vec4 a, Vec4 b) { return Vec4(_mm_min_ps(a.v, b.v)); }
+    friend Vec4 max(Vec4 a, Vec4 b) { return Vec4(_mm_max_ps(a.v, b.v)); }
+    friend Vec4 reciprocal(Vec4 a) { return Vec4(_mm_div_ps(_mm_set1_ps(1.0f), a.v)); }
+    friend Vec4 truncate(Vec4 a) { return Vec4(_mm_cvtepi32_ps(_mm_cvttps_epi32(a.v))); }
+
+    // { sum(a), sum(b), sum(c), sum(d) }
+    friend Vec4 horizontalSums(Vec4 a, Vec4 b, Vec4 c, Vec4 d)
+    {
+        _MM_TRANSPOSE4_PS(a.v, b.v, c.v, d.v);
+        return Vec4(_mm_add_ps(_mm_add_ps(a.v, b.v), _mm_add_ps(c.v, d.v)));
+    }
+
+private:
+    explicit Vec4(__m128 v) : v(v) {}
+    __m128 v;
+#else
+    Vec4() : v{0, 0, 0, 0} {}
+    explicit Vec4(float s) : v{s, s, s, s} {}
+    Vec4(float x, float y, float z, float w) : v{x, y, z, w} {}
+
+    float x() const { return v[0]; }
+    std::array<float, 4> toArray() const { return v; }
+
+    Vec4 splatX() const { return Vec4(v[0]); }
+    Vec4 splatY() const { return Vec4(v[1]); }
+    Vec4 splatZ() const { return Vec4(v[2]); }
+    Vec4 splatW() const { return Vec4(v[3]); }
+
+    Vec4& operator+=(Vec4 o) { for(int i = 0; i < 4; i++) v[i] += o.v[i]; return *this; }
+    friend Vec4 operator+(Vec4 a, Vec4 b) { return a += b; }
+    friend Vec4 operator-(Vec4 a, Vec4 b) { for(int i = 0; i < 4; i++) a.v[i] -= b.v[i]; return a; }
+    friend Vec4 operator*(Vec4 a, Vec4 b) { for(int i = 0; i < 4; i++) a.v[i] *= b.v[i]; return a; }
+
+    friend Vec4 min(Vec4 a, Vec4 b) { for(int i = 0; i < 4; i++) a.v[i] = std::min(a.v[i], b.v[i]); return a; }
+    friend Vec4 max(Vec4 a, Vec4 b) { for(int i = 0; i < 4; i++) a.v[i] = std::max(a.v[i], b.v[i]); return a; }
+    friend Vec4 reciprocal(Vec4 a) { for(int i = 0; i < 4; i++) a.v[i] = 1.0f / a.v[i]; return a; }
+    friend Vec4 truncate(Vec4 a) { for(int i = 0; i < 4; i++) a.v[i] = (float)(int)a.v[i]; return a; }
+
+    friend Vec4 horizontalSums(Vec4 a, Vec4 b, Vec4 c, Vec4 d)
+    {
+        auto sum = [](const Vec4& s){ return s.v[0] + s.v[1] + s.v[2] + s.v[3]; };
+        return Vec4(sum(a), sum(b), sum(c), sum(d));
+    }
+
+private:
+    std::array<float, 4> v;
+#endif
+};
+
+Vec4 multiplyAdd(Vec4 a, Vec4 b, Vec4 c)
+{ return a*b + c; }
+
+// c - a*b
+Vec4 negativeMultiplySubtract(Vec4 a, Vec4 b, Vec4 c)
+{ return c - a*b; }
+
+// ========== Colour blocks ==========
+
+// Squared errors are weighted by perceived luminance
+const Vec4 metric(0.2126f, 0.7152f, 0.0722f, 0.0f);
+
+const Vec4 zero(0.0f);
+const Vec4 half(0.5f);
+const Vec4 one(1.0f);
+const Vec4 grid(31.0f, 63.0f, 31.0f, 0.0f);
+const Vec4 gridReciprocal(1.0f/31.0f, 1.0f/63.0f, 1.0f/31.0f, 0.0f);
+
+// The distinct opaque colours of a block
+struct ColourSet
+{
+    int count = 0;
+    Vec4 points[16];
+    float weights[16];
+    int remap[16]; // Pixel -> point, -1 for transparent pixels
+    bool transparent = false;
+
+    ColourSet(const uchar* rgba, bool oneBitAlpha)
+    {
+        uint keys[16];
+
+        for(int i = 0; i < 16; i++)
+        {
+            const uchar* pixel = rgba + i*4;
+
+            if (oneBitAlpha && pixel[3] < 128)
+            {
+                remap[i] = -1;
+                transparent = true;
+                continue;
+            }
+
+            const uint key = pixel[0] | (pixel[1] << 8) | (pixel[2] << 16);
+            const auto existing = std::find(keys, keys + count, key) - keys;
+
+            if (existing < count)
+            {
+                weights[existing] += 1.0f;
+                remap[i] = existing;
+                continue;
+            }
+
+            keys[count] = key;
+            points[count] = Vec4(pixel[0] / 255.0f, pixel[1] / 255.0f, pixel[2] / 255.0f, 0.0f);
+            weights[count] = 1.0f;
+            remap[i] = count;
+            count++;
+        }
+    }
+};
+
+float dot3(const std::array<float, 4>& a, const std::array<float, 4>& b)
+{ return a[0]*b[0] + a[1]*b[1] + a[2]*b[2]; }
+
+std::array<float, 4> getPrincipalAxis(const ColourSet& set)
+{
+    float total = 0.0f;
+    Vec4 centroid;
+    for(int i = 0; i < set.count; i++)
+    {
+        centroid += set.points[i] * Vec4(set.weights[i]);
+        total += set.weights[i];
+    }
+    centroid = centroid * Vec4(1.0f / total);
+
+    // Weighted covariance, upper triangle
+    float cov[6] = {};
+    for(int i = 0; i < set.count; i++)
+    {
+        const auto a = (set.points[i] - centroid).toArray();
+        const auto w = set.weights[i];
+        cov[0] += a[0]*a[0]*w;
+        cov[1] += a[0]*a[1]*w;
+        cov[2] += a[0]*a[2]*w;
+        cov[3] += a[1]*a[1]*w;
+        cov[4] += a[1]*a[2]*w;
+        cov[5] += a[2]*a[2]*w;
+    }
+
+    // Power iteration converges on the eigenvector with the largest eigenvalue
+    std::array<float, 4> axis = {1.0f, 1.0f, 1.0f, 0.0f};
+    for(int iteration = 0; iteration < 8; iteration++)
+    {
+        std::array<float, 4> next = {
+            cov[0]*axis[0] + cov[1]*axis[1] + cov[2]*axis[2],
+            cov[1]*axis[0] + cov[3]*axis[1] + cov[4]*axis[2],
+            cov[2]*axis[0] + cov[4]*axis[1] + cov[5]*axis[2],
+            0.0f,
+        };
+
+        const float largest = std::max({std::abs(next[0]), std::abs(next[1]), std::abs(next[2])});
+        if (largest <= FLT_EPSILON)
+            break;
+
+        for(int c = 0; c < 3; c++)
+            axis[c] = next[c] / largest;
+    }
+
+    return axis;
+}
+
+// Snaps a colour to the nearest representable RGB565 value
+Vec4 quantize(Vec4 colour)
+{
+    colour = min(one, max(zero, colour));
+    return truncate(multiplyAdd(grid, colour, half)) * gridReciprocal;
+}
+
+ushort pack565(Vec4 colour)
+{
+    const auto c = truncate(multiplyAdd(grid, min(one, max(zero, colour)), half)).toArray();
+    return ((int)c[0] << 11) | ((int)c[1] << 5) | (int)c[2];
+}
+
+struct Endpoints
+{
+    Vec4 start;
+    Vec4 end;
+};
+
+// Picks the nearest palette entry for every point, returns the total weighted error
+float assignIndices(const ColourSet& set, Endpoints endpoints, bool threeColour, uchar indices[16])
+{
+    const auto& [start, end] = endpoints;
+
+    Vec4 codes[4];
+    codes[0] = start;
+    codes[1] = end;
+
+    int codeCount;
+    if (threeColour)
+    {
+        codes[2] = (start + end) * half;
+        codes[3] = codes[2]; // Reserved for transparency, never picked
+        codeCount = 3;
+    }
+    else
+    {
+        codes[2] = (start * Vec4(2.0f) + end) * Vec4(1.0f/3.0f);
+        codes[3] = (start + end * Vec4(2.0f)) * Vec4(1.0f/3.0f);
+        codeCount = 4;
+    }
+
+    uchar pointIndices[16];
+    float error = 0.0f;
+
+    for(int i = 0; i < set.count; i++)
+    {
+        const auto p = set.points[i];
+        const auto d0 = p - codes[0];
+        const auto d1 = p - codes[1];
+        const auto d2 = p - codes[2];
+        const auto d3 = p - codes[3];
+
+        const auto distances = horizontalSums(d0*d0*metric, d1*d1*metric,
+                                              d2*d2*metric, d3*d3*metric).toArray();
+
+        int best = 0;
+        for(int code = 1; code < codeCount; code++)
+        {
+            if (distances[code] < distances[best])
+                best = code;
+        }
+
+        pointIndices[i] = best;
+        error += distances[best] * set.weights[i];
+    }
+
+    for(int i = 0; i < 16; i++)
+        indices[i] = set.remap[i] < 0 ? 3 : pointIndices[set.remap[i]];
+
+    return error;
+}
+
+Endpoints rangeFit(const ColourSet& set, const std::array<float, 4>& axis)
+{
+    int minIndex = 0;
+    int maxIndex = 0;
+    float minDot = FLT_MAX;
+    float maxDot = -FLT_MAX;
+
+    for(int i = 0; i < set.count; i++)
+    {
+        const float d = dot3(set.points[i].toArray(), axis);
+        if (d < minDot) { minDot = d; minIndex = i; }
+        if (d > maxDot) { maxDot = d; maxIndex = i; }
+    }
+
+    return Endpoints{
+        .start = quantize(set.points[minIndex]),
+        .end   = quantize(set.points[maxIndex]),
+    };
+}
+
+// Tries every split of the points, ordered along the axis, into contiguous clusters which
+// map to the palette entries, and solves each split for its least squares endpoints.
+// Returns false if no split had a solution, which happens with a single colour.
+bool clusterFit(const ColourSet& set, const std::array<float, 4>& axis, bool threeColour, Endpoints& result)
+{
+    const int count = set.count;
+
+    int order[16];
+    float dots[16];
+    for(int i = 0; i < count; i++)
+    {
+        order[i] = i;
+        dots[i] = dot3(set.points[i].toArray(), axis);
+    }
+    std::stable_sort(order, order + count, [&](int a, int b){ return dots[a] < dots[b]; });
+
+    // x, y, z = weighted colour, w = weight
+    Vec4 pointsWeights[16];
+    Vec4 totals;
+    for(int i = 0; i < count; i++)
+    {
+        const auto w = set.weights[order[i]];
+        pointsWeights[i] = set.points[order[i]] * Vec4(w) + Vec4(0.0f, 0.0f, 0.0f, w);
+        totals += pointsWeights[i];
+    }
+
+    const Vec4 two(2.0f);
+    Vec4 bestError(FLT_MAX);
+    bool found = false;
+
+    // Least squares endpoints for a split, and its error minus the constant sum of x^2
+    auto solve = [&](Vec4 alphaxSum, Vec4 betaxSum, Vec4 alpha2Sum, Vec4 beta2Sum, Vec4 alphabetaSum){
+        const auto denominator = negativeMultiplySubtract(alphabetaSum, alphabetaSum, alpha2Sum*beta2Sum);
+        if (denominator.x() <= FLT_EPSILON)
+            return;
+
+        const auto factor = reciprocal(denominator);
+        auto a = negativeMultiplySubtract(betaxSum, alphabetaSum, alphaxSum*beta2Sum) * factor;
+        auto b = negativeMultiplySubtract(alphaxSum, alphabetaSum, betaxSum*alpha2Sum) * factor;
+
+        a = quantize(a);
+        b = quantize(b);
+
+        const auto e1 = multiplyAdd(a*a, alpha2Sum, b*b*beta2Sum);
+        const auto e2 = negativeMultiplySubtract(a, alphaxSum, a*b*alphabetaSum);
+        const auto e3 = negativeMultiplySubtract(b, betaxSum, e2);
+        const auto e4 = multiplyAdd(two, e3, e1) * metric;
+        const auto error = e4.splatX() + e4.splatY() + e4.splatZ();
+
+        if (error.x() < bestError.x())
+        {
+            bestError = error;
+            result = Endpoints{ .start = a, .end = b };
+            found = true;
+        }
+    };
+
+    if (threeColour)
+    {
+        // start, midpoint, end
+        const Vec4 halfHalf2(0.5f, 0.5f, 0.5f, 0.25f);
+
+        Vec4 part0;
+        for(int i = 0; i < count; i++)
+        {
+            Vec4 part1;
+            for(int j = i;;)
+            {
+                const auto part2 = totals - part1 - part0;
+
+                const auto alphaxSum = multiplyAdd(part1, halfHalf2, part0);
+                const auto betaxSum  = multiplyAdd(part1, halfHalf2, part2);
+                const auto alphabetaSum = (part1 * halfHalf2).splatW();
+
+                solve(alphaxSum, betaxSum, alphaxSum.splatW(), betaxSum.splatW(), alphabetaSum);
+
+                if (j == count)
+                    break;
+                part1 += pointsWeights[j];
+                j++;
+            }
+            part0 += pointsWeights[i];
+        }
+    }
+    else
+    {
+        // start, one third, two thirds, end
+        const Vec4 oneThirdOneThird2(1.0f/3.0f, 1.0f/3.0f, 1.0f/3.0f, 1.0f/9.0f);
+        const Vec4 twoThirdsTwoThirds2(2.0f/3.0f, 2.0f/3.0f, 2.0f/3.0f, 4.0f/9.0f);
+        const Vec4 twoNinths(2.0f/9.0f);
+
+        Vec4 part0;
+        for(int i = 0; i < count; i++)
+        {
+            Vec4 part1;
+            for(int j = i;;)
+            {
+                Vec4 part2 = j == 0 ? pointsWeights[0] : Vec4();
+                for(int k = j == 0 ? 1 : j;;)
+                {
+                    const auto part3 = totals - part2 - part1 - part0;
+
+                    const auto alphaxSum = multiplyAdd(part2, oneThirdOneThird2,
+                                                       multiplyAdd(part1, twoThirdsTwoThirds2, part0));
+                    const auto betaxSum  = multiplyAdd(part1, oneThirdOneThird2,
+                                                       multiplyAdd(part2, twoThirdsTwoThirds2, part3));
+                    const auto alphabetaSum = twoNinths * (part1 + part2).splatW();
+
+                    solve(alphaxSum, betaxSum, alphaxSum.splatW(), betaxSum.splatW(), alphabetaSum);
+
+                    if (k == count)
+                        break;
+                    part2 += pointsWeights[k];
+                    k++;
+                }
+
+                if (j == count)
+                    break;
+                part1 += pointsWeights[j];
+                j++;
+            }
+            part0 += pointsWeights[i];
+        }
+    }
+
+    return found;
+}
+
+void writeColourBlock(Endpoints endpoints, const uchar indices[16], bool threeColour, uchar* block)
+{
+    ushort a = pack565(endpoints.start);
+    ushort b = pack565(endpoints.end);
+    uchar remapped[16];
+    std::copy(indices, indices + 16, remapped);
+
+    // color0 > color1 selects the four colour palette, color0 <= color1 the three colour one
+    if (threeColour)
+    {
+        if (a > b)
+        {
+            std::swap(a, b);
+            for(auto& index : remapped)
+                if (index < 2)
+                    index ^= 1;
+        }
+    }
+    else if (a < b)
+    {
+        std::swap(a, b);
+        for(auto& index : remapped)
+            index ^= 1;
+    }
+    else if (a == b)
+    {
+        // Decodes as three colours, but every entry except transparency is the same colour
+        std::fill(remapped, remapped + 16, 0);
+    }
+
+    uint packed = 0;
+    for(int i = 0; i < 16; i++)
+        packed |= (uint)remapped[i] << (i*2);
+
+    block[0] = a & 0xff;
+    block[1] = a >> 8;
+    block[2] = b & 0xff;
+    block[3] = b >> 8;
+    block[4] = packed & 0xff;
+    block[5] = (packed >> 8) & 0xff;
+    block[6] = (packed >> 16) & 0xff;
+    block[7] = packed >> 24;
+}
+
+void encodeColourBlock(const uchar* rgba, bool oneBitAlpha, DxtEncoder::Fit fit, uchar* block)
+{
+    const ColourSet set(rgba, oneBitAlpha);
+    const bool threeColour = set.transparent;
+    uchar indices[16];
+
+    if (set.count == 0)
+    {
+        std::fill(indices, indices + 16, 3);
+        writeColourBlock(Endpoints{}, indices, true, block);
+        return;
+    }
+
+    const auto axis = getPrincipalAxis(set);
+
+    auto best = rangeFit(set, axis);
+    float bestError = assignIndices(set, best, threeColour, indices);
+
+    Endpoints clustered;
+    if (fit == DxtEncoder::Fit::CLUSTER && set.count > 1 && clusterFit(set, axis, threeColour, clustered))
+    {
+        uchar clusteredIndices[16];
+        const float error = assignIndices(set, clustered, threeColour, clusteredIndices);
+
+        if (error < bestError)
+        {
+            best = clustered;
+            std::copy(clusteredIndices, clusteredIndices + 16, indices);
+        }
+    }
+
+    writeColourBlock(best, indices, threeColour, block);
+}
+
+// ========== Alpha blocks ==========
+
+void writeAlphaBlockDxt3(const uchar* rgba, uchar* block)
+{
+    for(int i = 0; i < 8; i++)
+    {
+        const int low  = (rgba[(i*2    )*4 + 3] * 15 + 127) / 255;
+        const int high = (rgba[(i*2 + 1)*4 + 3] * 15 + 127) / 255;
+        block[i] = low | (high << 4);
+    }
+}
+
+int fitAlpha(const uchar alpha[16], const int codes[8], uchar indices[16])
+{
+    int error = 0;
+    for(int i = 0; i < 16; i++)
+    {
+        int best = 0;
+        int bestDistance = INT_MAX;
+        for(int code = 0; code < 8; code++)
+        {
+            const int distance = (alpha[i] - codes[code]) * (alpha[i] - codes[code]);
+            if (distance < bestDistance)
+            {
+                bestDistance = distance;
+                best = code;
+            }
+        }
+        indices[i] = best;
+        error += bestDistance;
+    }
+    return error;
+}
+
+void writeAlphaBlockDxt5(const uchar* rgba, bool tryBothModes, uchar* block)
+{
+    uchar alpha[16];
+    int low = 255, high = 0;
+    int low6 = 255, high6 = 0;
+
+    for(int i = 0; i < 16; i++)
+    {
+        alpha[i] = rgba[i*4 + 3];
+        low  = std::min(low,  (int)alpha[i]);
+        high = std::max(high, (int)alpha[i]);
+
+        // The six value palette has 0 and 255 for free
+        if (alpha[i] != 0 && alpha[i] != 255)
+        {
+            low6  = std::min(low6,  (int)alpha[i]);
+            high6 = std::max(high6, (int)alpha[i]);
+        }
+    }
+
+    // alpha0 > alpha1: eight interpolated values
+    int codes[8] = { high, low };
+    for(int i = 2; i < 8; i++)
+        codes[i] = ((8 - i)*high + (i - 1)*low) / 7;
+
+    uchar indices[16];
+    int alpha0 = high, alpha1 = low;
+    int error = fitAlpha(alpha, codes, indices);
+
+    // alpha0 <= alpha1: six interpolated values plus 0 and 255
+    if (tryBothModes)
+    {
+        if (low6 > high6)
+            low6 = high6 = 0;
+
+        int codes6[8] = { low6, high6 };
+        for(int i = 2; i < 6; i++)
+            codes6[i] = ((6 - i)*low6 + (i - 1)*high6) / 5;
+        codes6[6] = 0;
+        codes6[7] = 255;
+
+        uchar indices6[16];
+        int error6 = fitAlpha(alpha, codes6, indices6);
+
+        if (error6 < error)
+        {
+            alpha0 = low6;
+            alpha1 = high6;
+            std::copy(indices6, indices6 + 16, indices);
+        }
+    }
+
+    block[0] = alpha0;
+    block[1] = alpha1;
+
+    quint64 packed = 0;
+    for(int i = 0; i < 16; i++)
+        packed |= (quint64)indices[i] << (i*3);
+
+    for(int i = 0; i < 6; i++)
+        block[2 + i] = (packed >> (i*8)) & 0xff;
+}
+
+} // namespace
+
+DxtEncoder::DxtEncoder(SpraymakerModel::ImageFormat format, Fit fit)
+    : format(format)
+    , fit(fit)
+{}
+
+bool DxtEncoder::supports(SpraymakerModel::ImageFormat format) const
+{
+    return format == this->format && ImageHelper::isDxt(format);
+}
+
+void DxtEncoder::encodeBlock(const uchar* rgba, uchar* block) const
+{
+    switch(format)
+    {
+    case SpraymakerModel::ImageFormat::DXT1:
+        encodeColourBlock(rgba, false, fit, block);
+        break;
+    case SpraymakerModel::ImageFormat::DXT1A:
+        encodeColourBlock(rgba, true, fit, block);
+        break;
+    case SpraymakerModel::ImageFormat::DXT3:
+        writeAlphaBlockDxt3(rgba, block);
+        encodeColourBlock(rgba, false, fit, block + 8);
+        break;
+    case SpraymakerModel::ImageFormat::DXT5:
+        writeAlphaBlockDxt5(rgba, fit == Fit::CLUSTER, block);
+        encodeColourBlock(rgba, false, fit, block + 8);
+        break;
+    default:
+        break;
+    }
+}
+
+bool DxtEncoder::encode(const uchar* pixels, int width, int height, uchar* output, size_t size) const
+{
+    const int blockSize = ImageHelper::getImageDataSize(format, 4, 4, 1, 1);
+    const int blocksWide = (width  + 3) / 4;
+    const int blocksHigh = (height + 3) / 4;
+
+    uchar rgba[16*4];
+
+    for(int by = 0; by < blocksHigh; by++)
+    {
+        for(int bx = 0; bx < blocksWide; bx++)
+        {
+            const size_t offset = ((size_t)by*blocksWide + bx) * blockSize;
+            if (offset + blockSize > size)
+                return true;
+
+            // Blocks hanging off the edge of small mipmaps repeat the last row and column
+            for(int y = 0; y < 4; y++)
+            {
+                const int sy = std::min(by*4 + y, height - 1);
+                for(int x = 0; x < 4; x++)
+                {
+                    const int sx = std::min(bx*4 + x, width - 1);
+                    memcpy(rgba + (y*4 + x)*4, pixels + ((size_t)sy*width + sx)*4, 4);
+                }
+            }
+
+            encodeBlock(rgba, output + offset);
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,40 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DXTENCODER_H
+#define DXTENCODER_H
+
+#include "imageencoder.h"
+
+// ========== DxtEncoder ==========
+
+// Built-in DXT1/DXT1A/DXT3/DXT5 block compressor.
+// Range fit picks the endpoints from the extremes along the colours' principal axis,
+// which is fast enough for drafts. Cluster fit additionally searches every ordered
+// split of the block's colours into palette entries and keeps whichever is better.
+class DxtEncoder : public ImageEncoder
+{
+public:
+    enum class Fit {
+        RANGE,
+        CLUSTER,
+    };
+
+    DxtEncoder(SpraymakerModel::ImageFormat format, Fit fit);
+
+    bool supports(SpraymakerModel::ImageFormat format) const override;
+    bool encode(const uchar* pixels, int width, int height, uchar* output, size_t size) const override;
+
+    // Encodes one 4x4 block of RGBA8888 pixels, writing 8 or 16 bytes
+    void encodeBlock(const uchar* rgba, uchar* block) const;
+
+private:
+    SpraymakerModel::ImageFormat format;
+    Fit fit;
+};
+
+#endif // DXTENCODER_H
@@ -0,0 +1,134 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "edgeprojections.h"
+
+#include <algorithm>
+
+EdgeProjections::EdgeProjections(const void* pixels, uint width, uint height)
+    : width(width)
+    , height(height)
+    , rows(height)
+    , columns(width)
+    , topRows(height)
+    , bottomRows(height)
+    , leftColumns(width)
+    , rightColumns(width)
+{
+    auto ptr = (const uchar*)pixels;
+    auto getPixel = [ptr, width](uint x, uint y) {
+        const uchar* p = ptr + ((size_t)y*width + x)*4;
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint)p[3] << 24);
+    };
+
+    topLeft    = getPixel(0, 0);
+    topRight   = getPixel(width - 1, 0);
+    bottomLeft = getPixel(0, height - 1);
+
+    auto compare = [](Difference& difference, uint pixel, uint corner) {
+        if (pixel == corner)
+            return;
+
+        difference.differs = true;
+        if ((pixel & 0xffffff) != (corner & 0xffffff))
+            difference.colourAlpha = std::max<short>(difference.colourAlpha, pixel >> 24);
+    };
+
+    for(uint y = 0; y < height; y++)
+    {
+        auto& row = rows[y];
+        for(uint x = 0; x < width; x++)
+        {
+            const uint pixel = getPixel(x, y);
+            const uchar alpha = pixel >> 24;
+
+            row.minAlpha = std::min(row.minAlpha, alpha);
+            row.maxAlpha = std::max(row.maxAlpha, alpha);
+            columns[x].minAlpha = std::min(columns[x].minAlpha, alpha);
+            columns[x].maxAlpha = std::max(columns[x].maxAlpha, alpha);
+
+            compare(topRows[y],      pixel, topLeft);
+            compare(bottomRows[y],   pixel, bottomLeft);
+            compare(leftColumns[x],  pixel, topLeft);
+            compare(rightColumns[x], pixel, topRight);
+        }
+    }
+}
+
+bool EdgeProjections::differs(const Line& line, const Difference& difference, uint corner,
+                              ImageHelper::PixelAlphaMode pixelAlphaMode, int alphaThreshold) const
+{
+    switch(pixelAlphaMode)
+    {
+    case ImageHelper::PixelAlphaMode::FULL:
+        return difference.differs;
+    case ImageHelper::PixelAlphaMode::THRESHOLD:
+        // A corner below the threshold is turned off, so anything turned on differs.
+        // Otherwise anything turned off differs, as does anything turned on with another colour.
+        if ((int)(corner >> 24) < alphaThreshold)
+            return line.maxAlpha >= alphaThreshold;
+        return line.minAlpha < alphaThreshold || difference.colourAlpha >= alphaThreshold;
+    case ImageHelper::PixelAlphaMode::NONE:
+    default:
+        return difference.colourAlpha >= 0;
+    }
+}
+
+const ImageHelper::BoundingBox EdgeProjections::getBorders(ImageHelper::PixelAlphaMode pixelAlphaMode,
+                                                           uint alphaThreshold) const
+{
+    // -1 turns every pixel on, the same as 0, which the checks below rely on
+    const int threshold = std::clamp((int)alphaThreshold, 0, 256);
+
+    uint left = 0;
+    for(uint x = 0; x < width; x++)
+    {
+        if (differs(columns[x], leftColumns[x], topLeft, pixelAlphaMode, threshold))
+        {
+            left = x;
+            break;
+        }
+    }
+
+    uint right = width - 1;
+    for(uint x = width; x > 0; x--)
+    {
+        if (differs(columns[x - 1], rightColumns[x - 1], topRight, pixelAlphaMode, threshold))
+        {
+            right = x - 1;
+            break;
+        }
+    }
+
+    uint top = 0;
+    for(uint y = 0; y < height; y++)
+    {
+        if (differs(rows[y], topRows[y], topLeft, pixelAlphaMode, threshold))
+        {
+            top = y;
+            break;
+        }
+    }
+
+    uint bottom = height - 1;
+    for(uint y = height; y > 0; y--)
+    {
+        if (differs(rows[y - 1], bottomRows[y - 1], bottomLeft, pixelAlphaMode, threshold))
+        {
+            bottom = y - 1;
+            break;
+        }
+    }
+
+    return ImageHelper::makeBoundingBox(left, right, top, bottom, width, height);
+}
+
+uint EdgeProjections::getWidth() const
+{ return width; }
+
+uint EdgeProjections::getHeight() const
+{ return height; }
@@ -0,0 +1,70 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef EDGEPROJECTIONS_H
+#define EDGEPROJECTIONS_H
+
+#include "imagehelper.h"
+
+#include <vector>
+
+// ========== EdgeProjections ==========
+
+// Summary of an RGBA8888 image built in one pass, from which the autocrop borders for any
+// PixelAlphaMode and alpha threshold can be found in O(width + height).
+// Every row and column keeps its alpha range, and how it differs from the corner that
+// ImageHelper::getImageBorders compares that edge against.
+class EdgeProjections
+{
+public:
+    EdgeProjections(const void* pixels, uint width, uint height);
+
+    // Same result as ImageHelper::getImageBorders on the original pixels
+    const ImageHelper::BoundingBox getBorders(ImageHelper::PixelAlphaMode pixelAlphaMode,
+                                              uint alphaThreshold) const;
+
+    uint getWidth() const;
+    uint getHeight() const;
+
+private:
+    struct Line
+    {
+        uchar minAlpha = 255;
+        uchar maxAlpha = 0;
+    };
+
+    // One row or column against one corner pixel
+    struct Difference
+    {
+        // Highest alpha among pixels whose colour differs from the corner's, -1 if none do
+        short colourAlpha = -1;
+        // Whether any pixel differs from the corner, alpha included
+        bool differs = false;
+    };
+
+    bool differs(const Line& line, const Difference& difference, uint corner,
+                 ImageHelper::PixelAlphaMode pixelAlphaMode, int alphaThreshold) const;
+
+    uint width;
+    uint height;
+
+    uint topLeft;
+    uint topRight;
+    uint bottomLeft;
+
+    std::vector<Line> rows;
+    std::vector<Line> columns;
+
+    // Top and left edges start from the top left corner, right from the top right,
+    // bottom from the bottom left
+    std::vector<Difference> topRows;
+    std::vector<Difference> bottomRows;
+    std::vector<Difference> leftColumns;
+    std::vector<Difference> rightColumns;
+};
+
+#endif // EDGEPROJECTIONS_H
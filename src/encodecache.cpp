@@ -0,0 +1,99 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "encodecache.h"
+
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include <algorithm>
+#include <vector>
+
+EncodeCache::EncodeCache(QString directory)
+    : directory(directory)
+{}
+
+QString EncodeCache::getDefaultDirectory()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/encoded";
+}
+
+QString EncodeCache::getPath(const QByteArray& key) const
+{
+    // Spread entries over subdirectories so no single directory gets huge
+    const auto hex = QString::fromLatin1(key.toHex());
+    return directory + "/" + hex.left(2) + "/" + hex;
+}
+
+bool EncodeCache::load(const QByteArray& key, uchar* data, size_t size) const
+{
+    QFile file(getPath(key));
+
+    if (file.open(QIODevice::ReadOnly) == false)
+        return false;
+
+    if (file.size() != (qint64)size)
+        return false;
+
+    if (file.read((char*)data, size) != (qint64)size)
+        return false;
+
+    // Entries are pruned by modification time, so mark this one as recently used
+    file.close();
+    if (file.open(QIODevice::ReadWrite))
+        file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+
+    return true;
+}
+
+void EncodeCache::store(const QByteArray& key, const uchar* data, size_t size) const
+{
+    const auto path = getPath(key);
+
+    if (QDir().mkpath(QFileInfo(path).path()) == false)
+        return;
+
+    // A failed store only costs a future cache miss, so errors are ignored
+    QSaveFile file(path);
+    if (file.open(QIODevice::WriteOnly) == false)
+        return;
+
+    file.write((const char*)data, size);
+    file.commit();
+}
+
+void EncodeCache::prune(qint64 maxBytes) const
+{
+    std::vector<QFileInfo> entries;
+    qint64 totalBytes = 0;
+
+    QDirIterator it(directory, QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext())
+    {
+        entries.push_back(it.nextFileInfo());
+        totalBytes += entries.back().size();
+    }
+
+    if (totalBytes <= maxBytes)
+        return;
+
+    std::ranges::sort(entries, {}, [](const QFileInfo& entry){ return entry.lastModified(); });
+
+    for(const auto& entry : entries)
+    {
+        if (totalBytes <= maxBytes)
+            break;
+
+        if (QFile::remove(entry.filePath()))
+            totalBytes -= entry.size();
+    }
+}
@@ -0,0 +1,38 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENCODECACHE_H
+#define ENCODECACHE_H
+
+#include <QByteArray>
+#include <QString>
+
+// ========== EncodeCache ==========
+
+// On-disk store of encoded (mipmap, frame) payloads, addressed by a hash of
+// everything that went into encoding them. Safe to use from several threads.
+class EncodeCache
+{
+public:
+    EncodeCache(QString directory);
+
+    static QString getDefaultDirectory();
+
+    // Copies a cached payload of exactly size bytes into data
+    bool load(const QByteArray& key, uchar* data, size_t size) const;
+    void store(const QByteArray& key, const uchar* data, size_t size) const;
+
+    // Removes the least recently used payloads until the cache fits maxBytes
+    void prune(qint64 maxBytes) const;
+
+private:
+    QString directory;
+
+    QString getPath(const QByteArray& key) const;
+};
+
+#endif // ENCODECACHE_H
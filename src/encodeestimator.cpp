@@ -0,0 +1,168 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "encodeestimator.h"
+#include "settings.h"
+
+#include <QMetaEnum>
+#include <QObject>
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <unordered_set>
+
+EncodeEstimator::EncodeEstimator(const SprayEncoder::Parameters& parameters)
+{
+    const int threads = parameters.threads > 0 ? parameters.threads
+                                               : std::max(1U, std::thread::hardware_concurrency());
+
+    // Throughput is kept per format, and per encoder for DXT since they differ by orders of magnitude
+    QString formatKey = QMetaEnum::fromType<SpraymakerModel::ImageFormat>().valueToKey((int)parameters.format);
+    if (ImageHelper::isDxt(parameters.format))
+    {
+        formatKey += QString("_") + QMetaEnum::fromType<SpraymakerModel::EncoderBackend>()
+                                        .valueToKey((int)parameters.encoderBackend);
+    }
+
+    for(int stage = 0; stage < stageCount; stage++)
+        keys[stage] = formatKey + "/" + SprayEncoder::getStageName((SprayEncoder::Stage)stage);
+
+    // ========== Workload ==========
+    // Autocrop scans every source image once, unless its edges were projected when it was loaded
+    const int crop = (int)SprayEncoder::Stage::CROP;
+    if (parameters.autocropMode != SpraymakerModel::AutocropMode::NONE)
+    {
+        std::unordered_set<const VipsImage*> sources;
+        for(int mipmap = 0; mipmap < parameters.mipmaps; mipmap++)
+        {
+            for(int frame = 0; frame < parameters.frames; frame++)
+            {
+                const bool projected = mipmap < parameters.edgeProjections.size()
+                                    && frame < parameters.edgeProjections[mipmap].size()
+                                    && parameters.edgeProjections[mipmap][frame];
+                const auto& img = parameters.images[mipmap][frame];
+                if (projected == false && sources.insert(img.get_image()).second)
+                    pixels[crop] += (double)img.width() * img.height();
+            }
+        }
+        parallelism[crop] = std::clamp((int)sources.size(), 1, threads);
+    }
+
+    // Every cell is rendered and encoded, uncompressed formats are only converted
+    const int resize = (int)SprayEncoder::Stage::RESIZE;
+    const int encode = (int)(ImageHelper::isDxt(parameters.format) ? SprayEncoder::Stage::ENCODE
+                                                                    : SprayEncoder::Stage::CONVERT);
+    for(int mipmap = 0; mipmap < parameters.mipmaps; mipmap++)
+    {
+        const double mipPixels = (double)std::max(1, parameters.width >> mipmap)
+                                        * std::max(1, parameters.height >> mipmap);
+        pixels[resize] += mipPixels * parameters.frames;
+        pixels[encode] += mipPixels * parameters.frames;
+    }
+
+    // One worker per chain, and chains only span mipmaps when they're resampled from each other,
+    // which formats with more than 8 bits per channel never are
+    cells = parameters.mipmaps * parameters.frames;
+    const bool resampled = parameters.mipmapFilter != SpraymakerModel::MipmapFilter::SOURCE
+                        && ImageHelper::isHighBitDepth(parameters.format) == false;
+    const int chains = resampled ? parameters.frames : cells;
+    parallelism[resize] = std::clamp(chains, 1, threads);
+    parallelism[encode] = std::clamp(chains, 1, threads);
+    // ========== / Workload ==========
+
+    for(int stage = 0; stage < stageCount; stage++)
+    {
+        if (pixels[stage] <= 0)
+            continue;
+
+        throughputs[stage] = Settings::getInstance()->getThroughput(keys[stage]);
+        if (throughputs[stage] <= 0)
+            throughputs[stage] = getDefaultThroughput(parameters, (SprayEncoder::Stage)stage);
+    }
+}
+
+double EncodeEstimator::getEstimatedSeconds() const
+{
+    double seconds = 0;
+    for(int stage = 0; stage < stageCount; stage++)
+    {
+        if (pixels[stage] > 0)
+            seconds += pixels[stage] / throughputs[stage] / parallelism[stage];
+    }
+    return seconds;
+}
+
+double EncodeEstimator::getRemainingSeconds(double elapsedSeconds, int cellsFinished) const
+{
+    const double predicted = std::max(0.0, getEstimatedSeconds() - elapsedSeconds);
+    if (cellsFinished <= 0 || cells <= 0)
+        return predicted;
+
+    const double progress = std::min(1.0, (double)cellsFinished / cells);
+    const double extrapolated = elapsedSeconds * (1 - progress) / progress;
+
+    return (1 - progress) * predicted + progress * extrapolated;
+}
+
+void EncodeEstimator::record(const SprayEncoder::Result& result) const
+{
+    if (result.cancelled)
+        return;
+
+    for(int stage = 0; stage < stageCount; stage++)
+    {
+        const auto& time = result.stages[stage];
+
+        // Only the stages estimates are made from, with enough work to say anything about the machine
+        if (pixels[stage] <= 0 || time.pixels == 0 || time.seconds < 0.01)
+            continue;
+
+        // Half the old value, so one unusual save doesn't throw the next estimate off entirely
+        const double measured = time.pixels / time.seconds;
+        const double previous = Settings::getInstance()->getThroughput(keys[stage]);
+        Settings::getInstance()->setThroughput(keys[stage], previous > 0 ? (previous + measured) / 2 : measured);
+    }
+}
+
+QString EncodeEstimator::formatSeconds(double seconds)
+{
+    const int rounded = std::max(1, (int)std::lround(seconds));
+    if (rounded < 60)
+        return QObject::tr("%1 s").arg(rounded);
+    if (rounded < 3600)
+        return QObject::tr("%1 min %2 s").arg(rounded / 60).arg(rounded % 60);
+    return QObject::tr("%1 h %2 min").arg(rounded / 3600).arg(rounded % 3600 / 60);
+}
+
+double EncodeEstimator::getDefaultThroughput(const SprayEncoder::Parameters& parameters, SprayEncoder::Stage stage)
+{
+    // Rough numbers for one thread of a desktop CPU, replaced by the first save
+    switch(stage)
+    {
+    case SprayEncoder::Stage::CROP:
+        return 200e6;
+    case SprayEncoder::Stage::RESIZE:
+        return 20e6;
+    case SprayEncoder::Stage::CONVERT:
+        return 100e6;
+    case SprayEncoder::Stage::ENCODE:
+    default:
+        break;
+    }
+
+    switch(parameters.encoderBackend)
+    {
+    case SpraymakerModel::EncoderBackend::RANGE_FIT:
+        return 40e6;
+    case SpraymakerModel::EncoderBackend::CLUSTER_FIT:
+        return 4e6;
+    case SpraymakerModel::EncoderBackend::CRNLIB:
+    default:
+        return 1e6;
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENCODEESTIMATOR_H
+#define ENCODEESTIMATOR_H
+
+#include "sprayencoder.h"
+
+#include <QString>
+
+#include <array>
+
+// ========== EncodeEstimator ==========
+
+// Predicts how long a spray takes to encode on this machine, from the throughput of every
+// stage measured by earlier saves and kept in Settings. Formats which were never saved
+// fall back to rough defaults.
+class EncodeEstimator
+{
+public:
+    explicit EncodeEstimator(const SprayEncoder::Parameters& parameters);
+
+    // Wall time of the whole encode, assuming nothing is cached
+    double getEstimatedSeconds() const;
+
+    // Moves from the prediction towards extrapolating the progress so far, as the encode progresses
+    double getRemainingSeconds(double elapsedSeconds, int cellsFinished) const;
+
+    // Averages the throughput measured by a finished encode into Settings.
+    // Only call this from the thread Settings lives on.
+    void record(const SprayEncoder::Result& result) const;
+
+    // e.g. "45 s", "3 min 20 s"
+    static QString formatSeconds(double seconds);
+
+private:
+    static constexpr int stageCount = (int)SprayEncoder::Stage::_COUNT;
+
+    int cells = 0;
+    std::array<QString, stageCount> keys;
+    std::array<double, stageCount> pixels = {};
+    // Worker threads each stage is spread over
+    std::array<int, stageCount> parallelism = {};
+    // Pixels per second of one worker thread
+    std::array<double, stageCount> throughputs = {};
+
+    static double getDefaultThroughput(const SprayEncoder::Parameters& parameters, SprayEncoder::Stage stage);
+};
+
+#endif // ENCODEESTIMATOR_H
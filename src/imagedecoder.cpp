@@ -0,0 +1,484 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "imagedecoder.h"
+#include "imagehelper.h"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IMAGEDECODER_SSE2
+#include <emmintrin.h>
+#endif
+
+// Pixels are handled as little-endian 32-bit values, r in the low byte and a in the high
+// byte, like PixelConverter's lanes.
+
+namespace {
+
+uint pack(uint r, uint g, uint b, uint a)
+{ return r | (g << 8) | (b << 16) | (a << 24); }
+
+uint expand4(uint v) { return v * 17; }
+uint expand5(uint v) { return (v << 3) | (v >> 2); }
+uint expand6(uint v) { return (v << 2) | (v >> 4); }
+
+uint read16(const uchar* p) { return p[0] | (p[1] << 8); }
+
+// The inverses of PixelConverter's kernels, one pixel at a time
+using PixelDecoder = uint (*)(const uchar* p);
+
+PixelDecoder getPixelDecoder(SpraymakerModel::ImageFormat format)
+{
+    switch(format)
+    {
+    case SpraymakerModel::ImageFormat::RGBA8888:
+        return [](const uchar* p){ return pack(p[0], p[1], p[2], p[3]); };
+    case SpraymakerModel::ImageFormat::RGB888:
+        return [](const uchar* p){ return pack(p[0], p[1], p[2], 255); };
+    case SpraymakerModel::ImageFormat::BGRA8888:
+        return [](const uchar* p){ return pack(p[2], p[1], p[0], p[3]); };
+    case SpraymakerModel::ImageFormat::BGRX8888:
+        return [](const uchar* p){ return pack(p[2], p[1], p[0], 255); };
+    case SpraymakerModel::ImageFormat::BGR888:
+        return [](const uchar* p){ return pack(p[2], p[1], p[0], 255); };
+    case SpraymakerModel::ImageFormat::ABGR8888:
+        return [](const uchar* p){ return pack(p[3], p[2], p[1], p[0]); };
+    case SpraymakerModel::ImageFormat::I8:
+        return [](const uchar* p){ return pack(p[0], p[0], p[0], 255); };
+    case SpraymakerModel::ImageFormat::IA88:
+        return [](const uchar* p){ return pack(p[0], p[0], p[0], p[1]); };
+    case SpraymakerModel::ImageFormat::BGRA4444:
+        return [](const uchar* p){
+            const uint v = read16(p);
+            return pack(expand4((v >> 8) & 0xf), expand4((v >> 4) & 0xf), expand4(v & 0xf), expand4(v >> 12));
+        };
+    case SpraymakerModel::ImageFormat::BGRA5551:
+        return [](const uchar* p){
+            const uint v = read16(p);
+            return pack(expand5((v >> 10) & 0x1f), expand5((v >> 5) & 0x1f), expand5(v & 0x1f),
+                        (v & 0x8000) ? 255 : 0);
+        };
+    case SpraymakerModel::ImageFormat::BGRX5551:
+        return [](const uchar* p){
+            const uint v = read16(p);
+            return pack(expand5((v >> 10) & 0x1f), expand5((v >> 5) & 0x1f), expand5(v & 0x1f), 255);
+        };
+    case SpraymakerModel::ImageFormat::BGR565:
+        return [](const uchar* p){
+            const uint v = read16(p);
+            return pack(expand5(v >> 11), expand6((v >> 5) & 0x3f), expand5(v & 0x1f), 255);
+        };
+    case SpraymakerModel::ImageFormat::RGB565:
+        return [](const uchar* p){
+            const uint v = read16(p);
+            return pack(expand5(v & 0x1f), expand6((v >> 5) & 0x3f), expand5(v >> 11), 255);
+        };
+    // Pure blue is the transparent colour
+    case SpraymakerModel::ImageFormat::BGR888_BLUESCREEN:
+        return [](const uchar* p){
+            return (p[0] == 255 && p[1] == 0 && p[2] == 0) ? 0U : pack(p[2], p[1], p[0], 255);
+        };
+    case SpraymakerModel::ImageFormat::RGB888_BLUESCREEN:
+        return [](const uchar* p){
+            return (p[0] == 0 && p[1] == 0 && p[2] == 255) ? 0U : pack(p[0], p[1], p[2], 255);
+        };
+    default:
+        return nullptr;
+    }
+}
+
+// Fewer pixels than this per thread take longer to start a thread for than to decode
+constexpr size_t minPixelsPerThread = 64*1024;
+
+} // namespace
+
+bool ImageDecoder::canDecode(SpraymakerModel::ImageFormat format)
+{
+    return ImageHelper::isDxt(format) || getPixelDecoder(format) != nullptr;
+}
+
+bool ImageDecoder::decode(SpraymakerModel::ImageFormat format, const uchar* data,
+                          int width, int height, uchar* rgba)
+{
+    if (ImageHelper::isDxt(format))
+    {
+        decodeDxt(format, data, width, height, rgba);
+        return true;
+    }
+
+    const auto decodePixel = getPixelDecoder(format);
+    if (decodePixel == nullptr)
+        return false;
+
+    const size_t pixelSize = ImageHelper::getImageDataSize(format, 1, 1, 1, 1);
+    const size_t count = (size_t)width * height;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        const uint pixel = decodePixel(data + i*pixelSize);
+        std::memcpy(rgba + i*4, &pixel, 4);
+    }
+
+    return true;
+}
+
+bool ImageDecoder::decodeParallel(SpraymakerModel::ImageFormat format, const uchar* data,
+                                  int width, int height, uchar* rgba, int threads)
+{
+    if (canDecode(format) == false)
+        return false;
+
+    // Bands are split on block rows for DXT, so every band starts at a block
+    const int unitRows = ImageHelper::isDxt(format) ? 4 : 1;
+    const int units = (height + unitRows - 1) / unitRows;
+    const size_t unitSize = ImageHelper::getImageDataSize(format, width, unitRows, 1, 1);
+    const size_t pixels = (size_t)width * height;
+    const int bands = (int)std::clamp<size_t>(std::min<size_t>(std::max(1, threads), pixels / minPixelsPerThread),
+                                              1, std::max(1, units));
+
+    if (bands == 1)
+        return decode(format, data, width, height, rgba);
+
+    auto decodeBand = [=](int band){
+        const int first = units * band / bands;
+        const int last = units * (band + 1) / bands;
+        const int top = first * unitRows;
+        const int rows = std::min(height, last * unitRows) - top;
+        decode(format, data + first * unitSize, width, rows, rgba + (size_t)top * width * 4);
+    };
+
+    {
+        std::vector<std::jthread> workers;
+        for(int band = 1; band < bands; band++)
+            workers.emplace_back(decodeBand, band);
+        decodeBand(0);
+    }
+
+    return true;
+}
+
+// ========== DXT ==========
+// Reference: https://learn.microsoft.com/en-us/windows/win32/direct3d10/d3d10-graphics-programming-guide-resources-block-compression
+
+#ifdef IMAGEDECODER_SSE2
+namespace {
+
+// Four blocks side by side are decoded at once, every 32-bit lane holds one block's value.
+// The results match the scalar decoder exactly.
+
+// a where mask is set, b elsewhere
+__m128i select(__m128i mask, __m128i a, __m128i b)
+{ return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b)); }
+
+// Lanes hold 0 or -1 from one bit of the lane, bit is the lowest one
+template<int bit>
+__m128i bitMask(__m128i v)
+{ return _mm_srai_epi32(_mm_slli_epi32(v, 31 - bit), 31); }
+
+// Exact x / 3, x / 5 and x / 7 of lanes up to 16 bits, for the values interpolation makes
+__m128i div3(__m128i v) { return _mm_mulhi_epu16(v, _mm_set1_epi32(21846)); }
+__m128i div5(__m128i v) { return _mm_mulhi_epu16(v, _mm_set1_epi32(13108)); }
+__m128i div7(__m128i v) { return _mm_mulhi_epu16(v, _mm_set1_epi32(9363)); }
+
+__m128i mul(__m128i v, int factor)
+{ return _mm_mullo_epi16(v, _mm_set1_epi32(factor)); }
+
+__m128i packColour(__m128i r, __m128i g, __m128i b)
+{ return _mm_or_si128(r, _mm_or_si128(_mm_slli_epi32(g, 8), _mm_slli_epi32(b, 16))); }
+
+// 565 colours in the low 16 bits of every lane -> 8-bit channels
+void expand565(__m128i c, __m128i& r, __m128i& g, __m128i& b)
+{
+    const auto mask5 = _mm_set1_epi32(0x1f);
+    const auto mask6 = _mm_set1_epi32(0x3f);
+
+    r = _mm_and_si128(_mm_srli_epi32(c, 11), mask5);
+    g = _mm_and_si128(_mm_srli_epi32(c, 5), mask6);
+    b = _mm_and_si128(c, mask5);
+
+    r = _mm_or_si128(_mm_slli_epi32(r, 3), _mm_srli_epi32(r, 2));
+    g = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 4));
+    b = _mm_or_si128(_mm_slli_epi32(b, 3), _mm_srli_epi32(b, 2));
+}
+
+// The four colours of every block, see ImageDecoder::decodeColourBlock()
+void decodeColourPalettes(__m128i colours, bool isDxt1, bool hasTransparency, __m128i palette[4])
+{
+    const auto opaque = _mm_set1_epi32((int)0xff000000);
+
+    const auto c0 = _mm_and_si128(colours, _mm_set1_epi32(0xffff));
+    const auto c1 = _mm_srli_epi32(colours, 16);
+
+    __m128i r0, g0, b0, r1, g1, b1;
+    expand565(c0, r0, g0, b0);
+    expand565(c1, r1, g1, b1);
+
+    auto twoThirds = [](__m128i x0, __m128i x1){ return div3(_mm_add_epi32(_mm_add_epi32(x0, x0), x1)); };
+    auto half = [](__m128i x0, __m128i x1){ return _mm_srli_epi32(_mm_add_epi32(x0, x1), 1); };
+
+    const auto fourColours = isDxt1 ? _mm_cmpgt_epi32(c0, c1) : _mm_set1_epi32(-1);
+
+    palette[0] = _mm_or_si128(packColour(r0, g0, b0), opaque);
+    palette[1] = _mm_or_si128(packColour(r1, g1, b1), opaque);
+    palette[2] = _mm_or_si128(select(fourColours,
+                                     packColour(twoThirds(r0, r1), twoThirds(g0, g1), twoThirds(b0, b1)),
+                                     packColour(half(r0, r1), half(g0, g1), half(b0, b1))),
+                              opaque);
+    palette[3] = select(fourColours,
+                        _mm_or_si128(packColour(twoThirds(r1, r0), twoThirds(g1, g0), twoThirds(b1, b0)), opaque),
+                        hasTransparency ? _mm_setzero_si128() : opaque);
+}
+
+// The eight alpha values of every block, already shifted into the alpha byte
+void decodeAlphaPalettes(__m128i alphaLow, __m128i palette[8])
+{
+    const auto a0 = _mm_and_si128(alphaLow, _mm_set1_epi32(0xff));
+    const auto a1 = _mm_and_si128(_mm_srli_epi32(alphaLow, 8), _mm_set1_epi32(0xff));
+    const auto eightAlphas = _mm_cmpgt_epi32(a0, a1);
+
+    palette[0] = a0;
+    palette[1] = a1;
+    for(int i = 1; i < 5; i++)
+    {
+        palette[i + 1] = select(eightAlphas,
+                                div7(_mm_add_epi32(mul(a0, 7 - i), mul(a1, i))),
+                                div5(_mm_add_epi32(mul(a0, 5 - i), mul(a1, i))));
+    }
+    palette[6] = select(eightAlphas, div7(_mm_add_epi32(mul(a0, 2), mul(a1, 5))), _mm_setzero_si128());
+    palette[7] = select(eightAlphas, div7(_mm_add_epi32(a0, mul(a1, 6))), _mm_set1_epi32(255));
+
+    for(int i = 0; i < 8; i++)
+        palette[i] = _mm_slli_epi32(palette[i], 24);
+}
+
+// Entry 0 to 3 of palette by the lowest two bits of every lane of indices
+__m128i lookup4(const __m128i palette[4], __m128i indices)
+{
+    const auto bit0 = bitMask<0>(indices);
+    const auto bit1 = bitMask<1>(indices);
+
+    const auto low  = _mm_xor_si128(palette[0], _mm_and_si128(_mm_xor_si128(palette[0], palette[1]), bit0));
+    const auto high = _mm_xor_si128(palette[2], _mm_and_si128(_mm_xor_si128(palette[2], palette[3]), bit0));
+    return _mm_xor_si128(low, _mm_and_si128(_mm_xor_si128(low, high), bit1));
+}
+
+// Entry 0 to 7 of palette by the lowest three bits of every lane of indices
+__m128i lookup8(const __m128i palette[8], __m128i indices)
+{
+    const auto bit2 = bitMask<2>(indices);
+    const auto low = lookup4(palette, indices);
+    const auto high = lookup4(palette + 4, indices);
+    return _mm_xor_si128(low, _mm_and_si128(_mm_xor_si128(low, high), bit2));
+}
+
+// Four blocks of format at data, written to four 4x4 areas side by side starting at rgba
+void decodeDxtBlocks(SpraymakerModel::ImageFormat format, const uchar* data, uchar* rgba, size_t stride)
+{
+    const bool isDxt1 = format == SpraymakerModel::ImageFormat::DXT1
+                     || format == SpraymakerModel::ImageFormat::DXT1A;
+
+    // One block per lane
+    __m128i colours, colourIndices;
+    __m128i alphaLow = _mm_setzero_si128();
+    __m128i alphaHigh = _mm_setzero_si128();
+    if (isDxt1)
+    {
+        const auto first = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)data));
+        const auto second = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(data + 16)));
+        colours = _mm_castps_si128(_mm_shuffle_ps(first, second, _MM_SHUFFLE(2, 0, 2, 0)));
+        colourIndices = _mm_castps_si128(_mm_shuffle_ps(first, second, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+    else
+    {
+        auto block0 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)data));
+        auto block1 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(data + 16)));
+        auto block2 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(data + 32)));
+        auto block3 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(data + 48)));
+        _MM_TRANSPOSE4_PS(block0, block1, block2, block3);
+        alphaLow = _mm_castps_si128(block0);
+        alphaHigh = _mm_castps_si128(block1);
+        colours = _mm_castps_si128(block2);
+        colourIndices = _mm_castps_si128(block3);
+    }
+
+    __m128i colourPalette[4];
+    decodeColourPalettes(colours, isDxt1, format == SpraymakerModel::ImageFormat::DXT1A, colourPalette);
+
+    // Alpha replaces the colours' opaque alpha byte
+    const auto colourMask = _mm_set1_epi32(0xffffff);
+    __m128i alphaPalette[8];
+    __m128i alphaIndices[2] = {alphaLow, alphaHigh};
+    if (format == SpraymakerModel::ImageFormat::DXT5)
+    {
+        decodeAlphaPalettes(alphaLow, alphaPalette);
+        // 24 bits of 3-bit indices each for pixels 0 to 7 and 8 to 15
+        alphaIndices[0] = _mm_or_si128(_mm_srli_epi32(alphaLow, 16),
+                                       _mm_slli_epi32(_mm_and_si128(alphaHigh, _mm_set1_epi32(0xff)), 16));
+        alphaIndices[1] = _mm_srli_epi32(alphaHigh, 8);
+    }
+    // DXT3 has 4 bits each for pixels 0 to 7 and 8 to 15 already
+
+    for(int y = 0; y < 4; y++)
+    {
+        // pixels[x] holds pixel (x, y) of every block
+        __m128 pixels[4];
+        for(int x = 0; x < 4; x++)
+        {
+            auto pixel = lookup4(colourPalette, colourIndices);
+            colourIndices = _mm_srli_epi32(colourIndices, 2);
+
+            auto& indices = alphaIndices[y / 2];
+            if (format == SpraymakerModel::ImageFormat::DXT5)
+            {
+                pixel = _mm_or_si128(_mm_and_si128(pixel, colourMask), lookup8(alphaPalette, indices));
+                indices = _mm_srli_epi32(indices, 3);
+            }
+            else if (format == SpraymakerModel::ImageFormat::DXT3)
+            {
+                const auto alpha = _mm_and_si128(indices, _mm_set1_epi32(0xf));
+                const auto expanded = _mm_slli_epi32(_mm_or_si128(alpha, _mm_slli_epi32(alpha, 4)), 24);
+                pixel = _mm_or_si128(_mm_and_si128(pixel, colourMask), expanded);
+                indices = _mm_srli_epi32(indices, 4);
+            }
+
+            pixels[x] = _mm_castsi128_ps(pixel);
+        }
+
+        // -> one row of every block
+        _MM_TRANSPOSE4_PS(pixels[0], pixels[1], pixels[2], pixels[3]);
+        for(int block = 0; block < 4; block++)
+            _mm_storeu_ps((float*)(rgba + y*stride + block*16), pixels[block]);
+    }
+}
+
+} // namespace
+#endif
+
+void ImageDecoder::decodeDxt(SpraymakerModel::ImageFormat format, const uchar* data,
+                             int width, int height, uchar* rgba)
+{
+    const bool hasAlphaBlock = format == SpraymakerModel::ImageFormat::DXT3
+                            || format == SpraymakerModel::ImageFormat::DXT5;
+    const size_t blockSize = hasAlphaBlock ? 16 : 8;
+
+    uint pixels[16];
+
+    for(int blockY = 0; blockY < height; blockY += 4)
+    {
+        int blockX = 0;
+
+#ifdef IMAGEDECODER_SSE2
+        // Four whole blocks at a time, the ones over the edges are left to the scalar decoder
+        if (blockY + 4 <= height)
+        {
+            for(; blockX + 16 <= width; blockX += 16, data += blockSize*4)
+                decodeDxtBlocks(format, data, rgba + ((size_t)blockY*width + blockX)*4, (size_t)width*4);
+        }
+#endif
+
+        for(; blockX < width; blockX += 4, data += blockSize)
+        {
+            switch(format)
+            {
+            case SpraymakerModel::ImageFormat::DXT1:
+                decodeColourBlock(data, true, false, pixels);
+                break;
+            case SpraymakerModel::ImageFormat::DXT1A:
+                decodeColourBlock(data, true, true, pixels);
+                break;
+            case SpraymakerModel::ImageFormat::DXT3:
+                decodeColourBlock(data + 8, false, false, pixels);
+                decodeExplicitAlphaBlock(data, pixels);
+                break;
+            case SpraymakerModel::ImageFormat::DXT5:
+            default:
+                decodeColourBlock(data + 8, false, false, pixels);
+                decodeInterpolatedAlphaBlock(data, pixels);
+                break;
+            }
+
+            // Blocks hanging over the edge of the image only write what's inside it
+            const int columns = std::min(4, width - blockX);
+            const int rows = std::min(4, height - blockY);
+            for(int y = 0; y < rows; y++)
+                std::memcpy(rgba + ((size_t)(blockY + y)*width + blockX)*4, pixels + y*4, columns*4);
+        }
+    }
+}
+
+void ImageDecoder::decodeColourBlock(const uchar* block, bool isDxt1, bool hasTransparency, uint* pixels)
+{
+    const uint c0 = read16(block);
+    const uint c1 = read16(block + 2);
+    const uint indices = block[4] | (block[5] << 8) | (block[6] << 16) | ((uint)block[7] << 24);
+
+    uint r[2], g[2], b[2];
+    r[0] = expand5(c0 >> 11); g[0] = expand6((c0 >> 5) & 0x3f); b[0] = expand5(c0 & 0x1f);
+    r[1] = expand5(c1 >> 11); g[1] = expand6((c1 >> 5) & 0x3f); b[1] = expand5(c1 & 0x1f);
+
+    uint palette[4];
+    palette[0] = pack(r[0], g[0], b[0], 255);
+    palette[1] = pack(r[1], g[1], b[1], 255);
+
+    // DXT1 blocks with c0 <= c1 have three colours and black, which is transparent for DXT1A.
+    // DXT3 and DXT5 always use four colours.
+    if (c0 > c1 || isDxt1 == false)
+    {
+        palette[2] = pack((2*r[0] + r[1]) / 3, (2*g[0] + g[1]) / 3, (2*b[0] + b[1]) / 3, 255);
+        palette[3] = pack((r[0] + 2*r[1]) / 3, (g[0] + 2*g[1]) / 3, (b[0] + 2*b[1]) / 3, 255);
+    }
+    else
+    {
+        palette[2] = pack((r[0] + r[1]) / 2, (g[0] + g[1]) / 2, (b[0] + b[1]) / 2, 255);
+        palette[3] = hasTransparency ? 0 : pack(0, 0, 0, 255);
+    }
+
+    for(int i = 0; i < 16; i++)
+        pixels[i] = palette[(indices >> (i*2)) & 3];
+}
+
+void ImageDecoder::decodeExplicitAlphaBlock(const uchar* block, uint* pixels)
+{
+    for(int i = 0; i < 16; i++)
+    {
+        const uint alpha = (block[i / 2] >> ((i & 1) * 4)) & 0xf;
+        pixels[i] = (pixels[i] & 0xffffff) | (expand4(alpha) << 24);
+    }
+}
+
+void ImageDecoder::decodeInterpolatedAlphaBlock(const uchar* block, uint* pixels)
+{
+    const uint a0 = block[0];
+    const uint a1 = block[1];
+
+    uint palette[8] = {a0, a1};
+    if (a0 > a1)
+    {
+        for(uint i = 1; i < 7; i++)
+            palette[i + 1] = ((7 - i)*a0 + i*a1) / 7;
+    }
+    else
+    {
+        for(uint i = 1; i < 5; i++)
+            palette[i + 1] = ((5 - i)*a0 + i*a1) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+
+    // 48 bits of 3-bit indices
+    quint64 indices = 0;
+    for(int i = 0; i < 6; i++)
+        indices |= (quint64)block[2 + i] << (i*8);
+
+    for(int i = 0; i < 16; i++)
+        pixels[i] = (pixels[i] & 0xffffff) | (palette[(indices >> (i*3)) & 7] << 24);
+}
+// ========== / DXT ==========
@@ -0,0 +1,41 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef IMAGEDECODER_H
+#define IMAGEDECODER_H
+
+#include "spraymakermodel.h"
+
+// ========== ImageDecoder ==========
+
+// Encoded VTF image data -> RGBA8888, the way the game shows it.
+// Transparent pixels of 1-bit alpha formats decode to transparent black.
+class ImageDecoder
+{
+public:
+    // False for formats without a decoder: A8, 16-bit, float and normal map formats,
+    // whose look depends on how the game uses them
+    static bool canDecode(SpraymakerModel::ImageFormat format);
+
+    // width x height pixels of data, as written by the encoders
+    static bool decode(SpraymakerModel::ImageFormat format, const uchar* data,
+                       int width, int height, uchar* rgba);
+
+    // decode() of a whole mipmap with its rows split between up to threads threads.
+    // Images too small to be worth it are decoded on the calling thread.
+    static bool decodeParallel(SpraymakerModel::ImageFormat format, const uchar* data,
+                               int width, int height, uchar* rgba, int threads);
+
+private:
+    static void decodeDxt(SpraymakerModel::ImageFormat format, const uchar* data,
+                          int width, int height, uchar* rgba);
+    static void decodeColourBlock(const uchar* block, bool isDxt1, bool hasTransparency, uint* pixels);
+    static void decodeExplicitAlphaBlock(const uchar* block, uint* pixels);
+    static void decodeInterpolatedAlphaBlock(const uchar* block, uint* pixels);
+};
+
+#endif // IMAGEDECODER_H
@@ -0,0 +1,29 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef IMAGEENCODER_H
+#define IMAGEENCODER_H
+
+#include "spraymakermodel.h"
+
+// ========== ImageEncoder ==========
+
+// Encoder backend turning one RGBA8888 image into the data of one (mipmap, frame) of a VTF.
+// One instance is shared by every worker thread, so encode() must be thread-safe.
+class ImageEncoder
+{
+public:
+    virtual ~ImageEncoder() = default;
+
+    virtual bool supports(SpraymakerModel::ImageFormat format) const = 0;
+
+    // Writes exactly size bytes to output.
+    // Returns false if the encode was aborted, throws SpraymakerException on errors.
+    virtual bool encode(const uchar* pixels, int width, int height, uchar* output, size_t size) const = 0;
+};
+
+#endif // IMAGEENCODER_H
@@ -6,9 +6,19 @@
  */
 
 #include "imagehelper.h"
+#include "pixelconverter.h"
 #include "spraymakerexception.h"
 #include <crnlib/crn_color.h>
 
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IMAGEHELPER_SSE2
+#include <emmintrin.h>
+#endif
+
 uint ImageHelper::getPixelArtBoxSize(const vips::VImage img)
 {
     // TODO: Detect pixel art not aligned on the edges.
@@ -70,112 +80,186 @@ uint ImageHelper::getPixelArtBoxSize(const vips::VImage img)
     return blockSize;
 }
 
-const ImageHelper::BoundingBox ImageHelper::getImageBorders(
-    const void* pixels, uint width, uint height,
-    PixelAlphaMode pixelAlphaMode, uint alphaThreshold)
+namespace {
+
+// ========== Bounding box kernels ==========
+
+// What a pixel will look like after encoding, so pixels that end up identical are not
+// counted as content. Pixels are little-endian 32-bit lanes, r in the low byte.
+template<ImageHelper::PixelAlphaMode Mode>
+struct BorderScan
 {
-    auto ptr = (const uchar*)pixels;
+    static uint lane(uint x, int alphaThreshold)
+    {
+        if constexpr (Mode == ImageHelper::PixelAlphaMode::FULL)
+            return x;
+        else if constexpr (Mode == ImageHelper::PixelAlphaMode::THRESHOLD)
+            // Below the threshold the pixel will be turned off, above it turned on
+            return (int)(x >> 24) < alphaThreshold ? 0 : x | 0xff000000;
+        else
+            return x & 0xffffff;
+    }
+#ifdef IMAGEHELPER_SSE2
+    static __m128i lanes(__m128i x, __m128i alphaThreshold)
+    {
+        if constexpr (Mode == ImageHelper::PixelAlphaMode::FULL)
+            return x;
+        else if constexpr (Mode == ImageHelper::PixelAlphaMode::THRESHOLD)
+        {
+            const auto transparent = _mm_cmplt_epi32(_mm_srli_epi32(x, 24), alphaThreshold);
+            return _mm_andnot_si128(transparent, _mm_or_si128(x, _mm_set1_epi32(0xff000000)));
+        }
+        else
+            return _mm_and_si128(x, _mm_set1_epi32(0xffffff));
+    }
 
-    auto getEffectivePixel = [](const uchar* ptr, uint x, uint y, uint width,
-                                ImageHelper::PixelAlphaMode pixelAlphaMode, int alphaThreshold) {
-        const uchar* pixelPtr = (uchar*)ptr + (x*4 + y*width*4);
-        uint check = (pixelPtr[0] << 0 )
-                   | (pixelPtr[1] << 8 )
-                   | (pixelPtr[2] << 16);
+    // One bit per pixel for 8 pixels, set where the pixel matches
+    static uint matches(const uchar* ptr, __m128i match, __m128i alphaThreshold)
+    {
+        const auto a = lanes(_mm_loadu_si128((const __m128i*)ptr), alphaThreshold);
+        const auto b = lanes(_mm_loadu_si128((const __m128i*)(ptr + 16)), alphaThreshold);
+        return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, match)))
+             | _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(b, match))) << 4;
+    }
+#endif
+
+    static uint at(const uchar* row, uint x, int alphaThreshold)
+    {
+        const uchar* p = row + x*4;
+        return lane(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint)p[3] << 24), alphaThreshold);
+    }
 
-        switch(pixelAlphaMode)
+    // First pixel in [begin, end) that differs from match, end if there is none
+    static uint findFirst(const uchar* row, uint begin, uint end, uint match, int alphaThreshold)
+    {
+        uint x = begin;
+#ifdef IMAGEHELPER_SSE2
+        const auto matchLanes = _mm_set1_epi32(match);
+        const auto threshold = _mm_set1_epi32(alphaThreshold);
+        for(; x + 8 <= end; x += 8)
         {
-        case ImageHelper::PixelAlphaMode::FULL:
-            check |= pixelPtr[3] << 24;
-            break;
-        case ImageHelper::PixelAlphaMode::THRESHOLD:
-            if (pixelPtr[3] < alphaThreshold)
-                // Below alpha threshold, pixel will be turned off
-                check  = 0;
-            else
-                // Above alpha thredhold, pixel will be turned on
-                check |= 0xff000000;
-            break;
-        case ImageHelper::PixelAlphaMode::NONE:
-        default:
-            break;
+            const uint mask = matches(row + x*4, matchLanes, threshold);
+            if (mask != 0xff)
+                return x + std::countr_zero(~mask);
         }
-        return check;
-    };
+#endif
+        for(; x < end; x++)
+        {
+            if (at(row, x, alphaThreshold) != match)
+                return x;
+        }
+        return end;
+    }
 
-    auto leftEdge = [getEffectivePixel](const uchar* ptr, uint width, uint height,
-                                        ImageHelper::PixelAlphaMode pixelAlphaMode, uint alphaThreshold){
-        const uint startPixel = getEffectivePixel(ptr, 0, 0, width,
-                                                  pixelAlphaMode, alphaThreshold);
-        for(uint x = 0; x < width; x++)
+    // Last pixel in [begin, end) that differs from match, -1 if there is none
+    static int findLast(const uchar* row, uint begin, uint end, uint match, int alphaThreshold)
+    {
+        uint x = end;
+#ifdef IMAGEHELPER_SSE2
+        const auto matchLanes = _mm_set1_epi32(match);
+        const auto threshold = _mm_set1_epi32(alphaThreshold);
+        for(; x >= begin + 8; x -= 8)
         {
-            for(uint y = 0; y < height; y++)
-            {
-                const uint pixel = getEffectivePixel(ptr, x, y, width,
-                                                     pixelAlphaMode, alphaThreshold);
-                if (pixel != startPixel)
-                    return x;
-            }
+            const uint mask = matches(row + (x - 8)*4, matchLanes, threshold);
+            if (mask != 0xff)
+                return x - 8 + std::bit_width(~mask & 0xff) - 1;
         }
-        return 0U;
-    };
+#endif
+        for(; x > begin; x--)
+        {
+            if (at(row, x - 1, alphaThreshold) != match)
+                return x - 1;
+        }
+        return -1;
+    }
+
+    // Same result as checking the four edges column by column, but row-major and
+    // only looking at the pixels that can still move an edge
+    static ImageHelper::BoundingBox getBorders(const uchar* ptr, uint width, uint height,
+                                               int alphaThreshold)
+    {
+        const size_t stride = (size_t)width * 4;
+        auto row = [=](uint y){ return ptr + y*stride; };
+
+        // Each edge compares against the corner it starts from
+        const uint topLeft    = at(row(0), 0, alphaThreshold);
+        const uint topRight   = at(row(0), width - 1, alphaThreshold);
+        const uint bottomLeft = at(row(height - 1), 0, alphaThreshold);
 
-    auto rightEdge = [getEffectivePixel](const uchar* ptr, uint width, uint height,
-                                         ImageHelper::PixelAlphaMode pixelAlphaMode, uint alphaThreshold){
-        const uint startPixel = getEffectivePixel(ptr, width - 1, 0, width,
-                                                  pixelAlphaMode, alphaThreshold);
-        for(uint x = 0; x < width; x++)
+        uint top = height;
+        uint left = width;
+        for(uint y = 0; y < height && left > 0; y++)
         {
-            for(uint y = 0; y < height; y++)
+            const uint x = findFirst(row(y), 0, left, topLeft, alphaThreshold);
+            if (x < left)
             {
-                const uint pixel = getEffectivePixel(ptr, width - 1 - x, y, width,
-                                                     pixelAlphaMode, alphaThreshold);
-                if (pixel != startPixel)
-                    return width - 1 - x;
+                left = x;
+                if (top == height)
+                    top = y;
             }
         }
-        return width - 1;
-    };
+        if (top == height) top = 0;
+        if (left == width) left = 0;
 
-    auto topEdge = [getEffectivePixel](const uchar* ptr, uint width, uint height,
-                                       ImageHelper::PixelAlphaMode pixelAlphaMode, uint alphaThreshold){
-        const uint startPixel = getEffectivePixel(ptr, 0, 0, width,
-                                                  pixelAlphaMode, alphaThreshold);
-        for(uint y = 0; y < height; y++)
+        int right = -1;
+        for(uint y = 0; y < height && right < (int)width - 1; y++)
         {
-            for(uint x = 0; x < width; x++)
-            {
-                const uint pixel = getEffectivePixel(ptr, x, y, width,
-                                                     pixelAlphaMode, alphaThreshold);
-                if (pixel != startPixel)
-                    return y;
-            }
+            const int x = findLast(row(y), right + 1, width, topRight, alphaThreshold);
+            if (x > right)
+                right = x;
         }
-        return 0U;
-    };
+        if (right < 0) right = width - 1;
 
-    auto bottomEdge = [getEffectivePixel](const uchar* ptr, uint width, uint height,
-                                          ImageHelper::PixelAlphaMode pixelAlphaMode, uint alphaThreshold){
-        const uint startPixel = getEffectivePixel(ptr, 0, height - 1, width,
-                                                  pixelAlphaMode, alphaThreshold);
-        for(uint y = 0; y < height; y++)
+        uint bottom = height - 1;
+        for(uint y = height; y > 0; y--)
         {
-            for(uint x = 0; x < width; x++)
+            if (findFirst(row(y - 1), 0, width, bottomLeft, alphaThreshold) < width)
             {
-                const uint pixel = getEffectivePixel(ptr, x, height - 1 - y, width,
-                                                     pixelAlphaMode, alphaThreshold);
-                if (pixel != startPixel)
-                    return height - 1 - y;
+                bottom = y - 1;
+                break;
             }
         }
-        return height - 1;
-    };
 
-    auto left   = leftEdge  (ptr, width, height, pixelAlphaMode, alphaThreshold);
-    auto right  = rightEdge (ptr, width, height, pixelAlphaMode, alphaThreshold);
-    auto top    = topEdge   (ptr, width, height, pixelAlphaMode, alphaThreshold);
-    auto bottom = bottomEdge(ptr, width, height, pixelAlphaMode, alphaThreshold);
+        return ImageHelper::BoundingBox{
+            .left = left,
+            .right = (uint)right,
+            .top = top,
+            .bottom = bottom,
+        };
+    }
+};
+
+} // namespace
+
+const ImageHelper::BoundingBox ImageHelper::getImageBorders(
+    const void* pixels, uint width, uint height,
+    PixelAlphaMode pixelAlphaMode, uint alphaThreshold)
+{
+    auto ptr = (const uchar*)pixels;
+    // The setting goes down to -1, which has to stay below every alpha instead of wrapping
+    const int threshold = std::clamp((int)alphaThreshold, -1, 256);
 
+    BoundingBox borders;
+    switch(pixelAlphaMode)
+    {
+    case PixelAlphaMode::FULL:
+        borders = BorderScan<PixelAlphaMode::FULL>::getBorders(ptr, width, height, threshold);
+        break;
+    case PixelAlphaMode::THRESHOLD:
+        borders = BorderScan<PixelAlphaMode::THRESHOLD>::getBorders(ptr, width, height, threshold);
+        break;
+    case PixelAlphaMode::NONE:
+    default:
+        borders = BorderScan<PixelAlphaMode::NONE>::getBorders(ptr, width, height, threshold);
+        break;
+    }
+
+    return makeBoundingBox(borders.left, borders.right, borders.top, borders.bottom, width, height);
+}
+
+const ImageHelper::BoundingBox ImageHelper::makeBoundingBox(uint left, uint right, uint top, uint bottom,
+                                                            uint width, uint height)
+{
     if (left > right)
     {
         left = 0;
@@ -290,6 +374,11 @@ bool ImageHelper::hasAlpha(SpraymakerModel::ImageFormat format)
     return hasOneBitAlpha(format) || hasMultiBitAlpha(format);
 }
 
+bool ImageHelper::isHighBitDepth(SpraymakerModel::ImageFormat format)
+{
+    return PixelConverter::getFloatKernel(format) != nullptr;
+}
+
 uint ImageHelper::bytesPerBlock(SpraymakerModel::ImageFormat format)
 {
     switch(format)
@@ -337,9 +426,11 @@ uint ImageHelper::bytesPerPixel(SpraymakerModel::ImageFormat format)
     case SpraymakerModel::ImageFormat::RGBA16161616:
     case SpraymakerModel::ImageFormat::RGBA16161616F:
         return 8;
-    case SpraymakerModel::ImageFormat::RGBA32323232F:
-    case SpraymakerModel::ImageFormat::RGB323232F:
     case SpraymakerModel::ImageFormat::R32F:
+        return 4;
+    case SpraymakerModel::ImageFormat::RGB323232F:
+        return 12;
+    case SpraymakerModel::ImageFormat::RGBA32323232F:
         return 16;
     default:
         return 0;
@@ -414,6 +505,27 @@ void ImageHelper::getMaxResForTargetSize(SpraymakerModel::ImageFormat format,
     }
 }
 
+void ImageHelper::getAutomaticResolution(SpraymakerModel::ImageFormat format,
+                                         uint &width, uint &height, uint mipmaps, uint frames,
+                                         uint size)
+{
+    uint step = 1;
+    bool square = false;
+    bool powerOf2 = false;
+
+    if (isDxt(format))
+    {
+        step = 4;
+        if (mipmaps != 1)
+        {
+            powerOf2 = true;
+            square = true; // Assuming 1024x512 is not a desired resolution
+        }
+    }
+
+    getMaxResForTargetSize(format, width, height, mipmaps, frames, size, step, square, powerOf2);
+}
+
 uint ImageHelper::getMaxMipmaps(uint width, uint height)
 {
     uint res = std::max(width, height);
@@ -422,313 +534,135 @@ uint ImageHelper::getMaxMipmaps(uint width, uint height)
     return mipmaps;
 }
 
-void ImageHelper::convertPixelFormat(crnlib::color_quad_u8* dataPtr, uchar* pos, int count,
-                                     crnlib::pixel_format srcFormat, SpraymakerModel::ImageFormat dstFormat,
-                                     int alphaThreshold)
+void ImageHelper::applyAlphaThreshold(uchar* rgba, size_t count, int alphaThreshold,
+                                      int backgroundRed, int backgroundGreen, int backgroundBlue)
 {
-    bool doR = false;
-    bool doG = false;
-    bool doB = false;
-    bool doA = false;
-    switch(srcFormat)
-    {
-    case crnlib::pixel_format::PIXEL_FMT_A8R8G8B8:
-        doR = true; doG = true; doB = true; doA = true;
-        break;
-    case crnlib::pixel_format::PIXEL_FMT_R8G8B8:
-        doR = true; doG = true; doB = true;
-        break;
-    case crnlib::pixel_format::PIXEL_FMT_A8L8:
-        doR = true; doA = true;
-        break;
-    case crnlib::pixel_format::PIXEL_FMT_L8:
-        doR = true;
-        break;
-    case crnlib::pixel_format::PIXEL_FMT_A8:
-        doA = true;
-        break;
-    default:
-        throw SpraymakerException(QObject::tr("Unsupported crnlib pixel format. This should never happen."));
-    }
+    // Background is packed once, the kernel walks the buffer in memory order
+    uint background = (backgroundRed   & 0xff) << 0
+                    | (backgroundGreen & 0xff) << 8
+                    | (backgroundBlue  & 0xff) << 16;
+    PixelConverter::thresholdAlpha(rgba, count, alphaThreshold, background);
+}
 
-    // Modify pixel bits for target output formats not directly supported by crnlib
-    // Reference: https://learn.microsoft.com/en-us/windows/uwp/gaming/complete-code-for-ddstextureloader
-    // The "X" formats don't set bits to 1, but this probably doesn't matter?
-    if (dstFormat == SpraymakerModel::ImageFormat::ABGR8888)
-    {
-        for(int i = 0; i < count; i++)
-        {
-            *pos = dataPtr->a;
-            pos++;
-            *pos = dataPtr->b;
-            pos++;
-            *pos = dataPtr->g;
-            pos++;
-            *pos = dataPtr->r;
-            pos++;
-            dataPtr++;
-        }
-    }
-    else if (dstFormat == SpraymakerModel::ImageFormat::BGR888)
-    {
-        for(int i = 0; i < count; i++)
-        {
-            *pos = dataPtr->b;
-            pos++;
-            *pos = dataPtr->g;
-            pos++;
-            *pos = dataPtr->r;
-            pos++;
-            dataPtr++;
-        }
-    }
-    else if (dstFormat == SpraymakerModel::ImageFormat::BGR888_BLUESCREEN)
-    {
-        // Assumption: input image has an alpha channel and the user wants this to be
-        // translated into the bluescreen format
-        for(int i = 0; i < count; i++)
+void ImageHelper::halveImage(const uchar* rgba, uint width, uint height, uchar* out)
+{
+    const uint outWidth  = std::max(1U, width  / 2);
+    const uint outHeight = std::max(1U, height / 2);
+    const size_t stride = (size_t)width * 4;
+
+    // Colours are weighted by alpha so transparent pixels don't bleed into their neighbours,
+    // fully transparent blocks fall back to a plain average
+    auto averagePixel = [](const uchar* p0, const uchar* p1, const uchar* p2, const uchar* p3, uchar* o) {
+        const int alpha = p0[3] + p1[3] + p2[3] + p3[3];
+        for(int c = 0; c < 3; c++)
         {
-            uchar r = dataPtr->r;
-            uchar g = dataPtr->g;
-            uchar b = dataPtr->b;
-
-            // Prevent unintentional bluescreen effect
-            if (r == 0 && g == 0 && b == 255)
-                b = 254;
-
-            // Convert alpha channel into bluescreen
-            if (dataPtr->a < alphaThreshold)
-            {
-                r = 0;
-                g = 0;
-                b = 255;
-            }
-
-            *pos = b;
-            pos++;
-            *pos = g;
-            pos++;
-            *pos = r;
-            pos++;
-            dataPtr++;
+            if (alpha == 0)
+                o[c] = (p0[c] + p1[c] + p2[c] + p3[c] + 2) >> 2;
+            else
+                o[c] = std::lrintf((float)(p0[c]*p0[3] + p1[c]*p1[3] + p2[c]*p2[3] + p3[c]*p3[3]) / alpha);
         }
-    }
-    else if (dstFormat == SpraymakerModel::ImageFormat::RGB888_BLUESCREEN)
-    {
-        // TF2: Not supported.
-        // Assumption: input image has an alpha channel and the user wants this to be
-        // translated into the bluescreen format
-        for(int i = 0; i < count; i++)
-        {
-            uchar r = dataPtr->r;
-            uchar g = dataPtr->g;
-            uchar b = dataPtr->b;
-
-            // Prevent unintentional bluescreen effect
-            if (r == 0 && g == 0 && b == 255)
-                b = 254;
-
-            // Convert alpha channel into bluescreen
-            if (dataPtr->a < alphaThreshold)
-            {
-                r = 0;
-                g = 0;
-                b = 255;
-            }
+        o[3] = (alpha + 2) >> 2;
+    };
 
-            *pos = r;
-            pos++;
-            *pos = g;
-            pos++;
-            *pos = b;
-            pos++;
-            dataPtr++;
-        }
-    }
-    else if (dstFormat == SpraymakerModel::ImageFormat::BGRA8888
-          || dstFormat == SpraymakerModel::ImageFormat::BGRX8888)
-    {
-        for(int i = 0; i < count; i++)
-        {
-            *pos = dataPtr->b;
-            pos++;
-            *pos = dataPtr->g;
-            pos++;
-            *pos = dataPtr->r;
-            pos++;
-            *pos = dataPtr->a;
-            pos++;
-            dataPtr++;
-        }
-    }
-    else if (dstFormat == SpraymakerModel::ImageFormat::BGRA4444)
-    {
-        // TODO: Even with max alpha the textures are slightly transparent
-        // Is that a bug, or just how this texture works with sprays?
-        for(int i = 0; i < count; i++)
-        {
-            ushort bgra4444 = ((dataPtr->r & 0b11110000) << 4)
-                            | ((dataPtr->g & 0b11110000) << 0)
-                            | ((dataPtr->b & 0b11110000) >> 4)
-                            | ((dataPtr->a & 0b11110000) << 8);
-            *pos = bgra4444;
-            pos++;
-            *pos = bgra4444 >> 8;
-            pos++;
-            dataPtr++;
-        }
-    }
-    else if (dstFormat == SpraymakerModel::ImageFormat::BGRA5551
-             || dstFormat == SpraymakerModel::ImageFormat::BGRX5551)
-    {
-        for(int i = 0; i < count; i++)
-        {
-            ushort bgra5551 = ((dataPtr->r & 0b11111000) << 7)
-                            | ((dataPtr->g & 0b11111000) << 2)
-                            | ((dataPtr->b & 0b11111000) >> 3)
-                            | ((dataPtr->a & 0b10000000) << 8);
-            *pos = bgra5551;
-            pos++;
-            *pos = bgra5551 >> 8;
-            pos++;
-            dataPtr++;
-        }
-    }
-    else if (dstFormat == SpraymakerModel::ImageFormat::BGR565)
-    {
-        for(int i = 0; i < count; i++)
-        {
-            ushort bgr565 = ((dataPtr->r & 0b11111000) << 8)
-                          | ((dataPtr->g & 0b11111100) << 3)
-                          | ((dataPtr->b & 0b11111000) >> 3);
-            *pos = bgr565;
-            pos++;
-            *pos = bgr565 >> 8;
-            pos++;
-            dataPtr++;
-        }
-    }
-    else if (dstFormat == SpraymakerModel::ImageFormat::RGB565)
-    {
-        // Note: not supported in TF2, other engines?
-        for(int i = 0; i < count; i++)
-        {
-            ushort rgb565 = ((dataPtr->r & 0b11111000) >> 3)
-                          | ((dataPtr->g & 0b11111100) << 3)
-                          | ((dataPtr->b & 0b11111000) << 8);
-            *pos = rgb565;
-            pos++;
-            *pos = rgb565 >> 8;
-            pos++;
-            dataPtr++;
-        }
-    }
-    else if (dstFormat == SpraymakerModel::ImageFormat::UV88)
+    for(uint y = 0; y < outHeight; y++)
     {
-        // TODO: This is probably wrong
-        // Note: In sprays blue is always max with this format
-        for(int i = 0; i < count; i++)
+        const uchar* row0 = rgba + std::min(y*2,     height - 1)*stride;
+        const uchar* row1 = rgba + std::min(y*2 + 1, height - 1)*stride;
+        uchar* o = out + (size_t)y*outWidth*4;
+        uint x = 0;
+
+#ifdef IMAGEHELPER_SSE2
+        // Two output pixels from a 4x2 block per step
+        const auto zero = _mm_setzero_si128();
+        const auto round = _mm_set1_epi32(2);
+        for(; x + 2 <= outWidth && x*2 + 4 <= width; x += 2)
         {
-            *pos = 0x7f * ((double)dataPtr->r / 255.0);
-            pos++;
-            *pos = 0x7f * ((double)dataPtr->g / 255.0);
-            pos++;
-            dataPtr++;
+            const auto top    = _mm_loadu_si128((const __m128i*)(row0 + x*8));
+            const auto bottom = _mm_loadu_si128((const __m128i*)(row1 + x*8));
+
+            // Per channel sums over one 2x2 block, plain and weighted by alpha
+            auto sums = [&](__m128i top16, __m128i bottom16, __m128i& plain, __m128i& weighted) {
+                auto alphas = [](__m128i v){ return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xff), 0xff); };
+                // c*a is at most 65025, which mullo gets exactly as an unsigned 16-bit value
+                const auto topWeighted    = _mm_mullo_epi16(top16,    alphas(top16));
+                const auto bottomWeighted = _mm_mullo_epi16(bottom16, alphas(bottom16));
+                auto widen = [&](__m128i v){ return _mm_add_epi32(_mm_unpacklo_epi16(v, zero), _mm_unpackhi_epi16(v, zero)); };
+                plain    = _mm_add_epi32(widen(top16), widen(bottom16));
+                weighted = _mm_add_epi32(widen(topWeighted), widen(bottomWeighted));
+            };
+
+            auto average = [&](__m128i plain, __m128i weighted) {
+                const auto alpha = _mm_shuffle_epi32(plain, 0xff);
+                const auto transparent = _mm_cmpeq_epi32(alpha, zero);
+                const auto colour = _mm_cvtps_epi32(_mm_div_ps(_mm_cvtepi32_ps(weighted),
+                                                               _mm_cvtepi32_ps(_mm_or_si128(alpha, _mm_and_si128(transparent, _mm_set1_epi32(1))))));
+                const auto plainAverage = _mm_srli_epi32(_mm_add_epi32(plain, round), 2);
+                auto result = _mm_or_si128(_mm_and_si128(transparent, plainAverage), _mm_andnot_si128(transparent, colour));
+                // Alpha itself is always a plain average
+                const auto alphaMask = _mm_set_epi32(-1, 0, 0, 0);
+                return _mm_or_si128(_mm_andnot_si128(alphaMask, result), _mm_and_si128(alphaMask, plainAverage));
+            };
+
+            __m128i plain0, weighted0, plain1, weighted1;
+            sums(_mm_unpacklo_epi8(top, zero), _mm_unpacklo_epi8(bottom, zero), plain0, weighted0);
+            sums(_mm_unpackhi_epi8(top, zero), _mm_unpackhi_epi8(bottom, zero), plain1, weighted1);
+
+            const auto packed = _mm_packs_epi32(average(plain0, weighted0), average(plain1, weighted1));
+            _mm_storel_epi64((__m128i*)(o + x*4), _mm_packus_epi16(packed, packed));
         }
-    }
-    else if (dstFormat == SpraymakerModel::ImageFormat::UVWQ8888
-             || dstFormat == SpraymakerModel::ImageFormat::UVLX8888)
-    {
-        // TODO: This is probably wrong
-        for(int i = 0; i < count; i++)
-        {
-            *pos = 0x7f * ((double)dataPtr->r / 255.0);
-            pos++;
-            *pos = 0x7f * ((double)dataPtr->g / 255.0);
-            pos++;
-            *pos = 0x7f * ((double)dataPtr->b / 255.0);
-            pos++;
-            *pos = 0x7f * ((double)dataPtr->a / 255.0);
-            pos++;
-            dataPtr++;
-        }
-    }
-    else if (dstFormat == SpraymakerModel::ImageFormat::RGBA16161616)
-    {
-        // TODO: This is faked
-        for(int i = 0; i < count; i++)
-        {
-            *pos =         0xffff * ((double)dataPtr->r / 255.0);
-            pos++;
-            *pos = ((uint)(0xffff * ((double)dataPtr->r / 255.0))) >> 8;
-            pos++;
-            *pos =         0xffff * ((double)dataPtr->g / 255.0);
-            pos++;
-            *pos = ((uint)(0xffff * ((double)dataPtr->g / 255.0))) >> 8;
-            pos++;
-            *pos =         0xffff * ((double)dataPtr->b / 255.0);
-            pos++;
-            *pos = ((uint)(0xffff * ((double)dataPtr->b / 255.0))) >> 8;
-            pos++;
-            *pos =         0xffff * ((double)dataPtr->a / 255.0);
-            pos++;
-            *pos = ((uint)(0xffff * ((double)dataPtr->a / 255.0))) >> 8;
-            pos++;
-            dataPtr++;
-        }
-    }
-    else if (dstFormat == SpraymakerModel::ImageFormat::RGBA32323232F)
-    {
-        // TODO: This is faked and also totally wrong
-        for(int i = 0; i < count; i++)
+#endif
+
+        for(; x < outWidth; x++)
         {
-            auto r = (float)(0xffffffff * ((double)dataPtr->r / 255.0));
-            auto g = (float)(0xffffffff * ((double)dataPtr->g / 255.0));
-            auto b = (float)(0xffffffff * ((double)dataPtr->b / 255.0));
-            auto a = (float)(0xffffffff * ((double)dataPtr->a / 255.0));
-            auto rf = reinterpret_cast<const uchar*>(&r);
-            auto gf = reinterpret_cast<const uchar*>(&g);
-            auto bf = reinterpret_cast<const uchar*>(&b);
-            auto af = reinterpret_cast<const uchar*>(&a);
-            for(int i = 0; i < 4; i++) { *pos = rf[i]; pos++; }
-            for(int i = 0; i < 4; i++) { *pos = gf[i]; pos++; }
-            for(int i = 0; i < 4; i++) { *pos = bf[i]; pos++; }
-            for(int i = 0; i < 4; i++) { *pos = af[i]; pos++; }
-            dataPtr++;
+            const uint x0 = std::min(x*2,     width - 1);
+            const uint x1 = std::min(x*2 + 1, width - 1);
+            averagePixel(row0 + x0*4, row0 + x1*4, row1 + x0*4, row1 + x1*4, o + x*4);
         }
     }
-    else if (dstFormat == SpraymakerModel::ImageFormat::RGB888
-          || dstFormat == SpraymakerModel::ImageFormat::RGBA8888
-          || dstFormat == SpraymakerModel::ImageFormat::A8
-          || dstFormat == SpraymakerModel::ImageFormat::I8
-          || dstFormat == SpraymakerModel::ImageFormat::IA88)
+}
+
+bool ImageHelper::getBandOrder(SpraymakerModel::ImageFormat format, std::vector<int>& bands)
+{
+    switch(format)
     {
-        // Uncompressed pixel output formats supported by crnlib directly:
-        // RGB888, RGBA8888, A8, I8, IA88
-        // Has a 4 byte pixel stride regardless of output format
-        for(int i = 0; i < count; i++)
-        {
-            if (doR)
-            {
-                *pos = dataPtr->r;
-                pos++;
-            }
-            if (doG)
-            {
-                *pos = dataPtr->g;
-                pos++;
-            }
-            if (doB)
-            {
-                *pos = dataPtr->b;
-                pos++;
-            }
-            if (doA)
-            {
-                *pos = dataPtr->a;
-                pos++;
-            }
-            dataPtr++;
-        }
+    case SpraymakerModel::ImageFormat::RGBA8888:
+        bands = {0, 1, 2, 3};
+        return true;
+    case SpraymakerModel::ImageFormat::BGRA8888:
+    case SpraymakerModel::ImageFormat::BGRX8888:
+        bands = {2, 1, 0, 3};
+        return true;
+    case SpraymakerModel::ImageFormat::ABGR8888:
+        bands = {3, 2, 1, 0};
+        return true;
+    case SpraymakerModel::ImageFormat::RGB888:
+        bands = {0, 1, 2};
+        return true;
+    case SpraymakerModel::ImageFormat::BGR888:
+        bands = {2, 1, 0};
+        return true;
+    case SpraymakerModel::ImageFormat::A8:
+        bands = {3};
+        return true;
+    default:
+        return false;
     }
 }
+
+void ImageHelper::convertPixelFormat(const uchar* rgba, uchar* pos, int count,
+                                     SpraymakerModel::ImageFormat dstFormat, int alphaThreshold)
+{
+    // Input is tightly packed RGBA8888, the layout vips renders sprays in.
+    // The format is only looked at once, the kernel then runs over the whole buffer.
+    auto kernel = PixelConverter::getKernel(dstFormat);
+    if (kernel != nullptr)
+        kernel(rgba, pos, count, alphaThreshold);
+}
+
+void ImageHelper::convertFloatPixelFormat(const float* rgba, uchar* pos, int count,
+                                          SpraymakerModel::ImageFormat dstFormat)
+{
+    auto kernel = PixelConverter::getFloatKernel(dstFormat);
+    if (kernel != nullptr)
+        kernel(rgba, pos, count);
+}
@@ -14,6 +14,8 @@
 #include <QString>
 #include <crnlib/crn_color.h>
 
+#include <vector>
+
 // ========== ImageHelper ==========
 
 class ImageHelper
@@ -61,21 +63,41 @@ public:
     static const BoundingBox getImageBorders(const void* pixels, uint width, uint height,
                                              PixelAlphaMode pixelAlphaMode,
                                              uint alphaThreshold);
+    // Turns the edges found for an image into its crop box, falling back to the whole
+    // image on an axis where they don't enclose anything
+    static const BoundingBox makeBoundingBox(uint left, uint right, uint top, uint bottom,
+                                             uint width, uint height);
 
     static uint getImageDataSize(SpraymakerModel::ImageFormat format,
                                  uint width, uint height, uint mipmaps, uint frames);
     static void getMaxResForTargetSize(SpraymakerModel::ImageFormat format,
                                        uint &width, uint &height, uint mipmaps, uint frames,
                                        uint size, uint step, bool square, bool powerOfTwo);
+    // getMaxResForTargetSize with the automatic resolution rules: DXT steps a block at a
+    // time, and is square and a power of two when it has mipmaps
+    static void getAutomaticResolution(SpraymakerModel::ImageFormat format,
+                                       uint &width, uint &height, uint mipmaps, uint frames,
+                                       uint size);
     static uint getMaxMipmaps(uint width, uint height);
     static bool isDxt(SpraymakerModel::ImageFormat format);
     static bool hasOneBitAlpha(SpraymakerModel::ImageFormat format);
     static bool hasMultiBitAlpha(SpraymakerModel::ImageFormat format);
     static bool hasAlpha(SpraymakerModel::ImageFormat format);
+    // More than 8 bits per channel, sprays in these are rendered as float RGBA instead of RGBA8888
+    static bool isHighBitDepth(SpraymakerModel::ImageFormat format);
     static uint getPixelArtBoxSize(const vips::VImage img);
-    static void convertPixelFormat(crnlib::color_quad<uchar, int>* dataPtr, uchar* pos, int count,
-                                   crnlib::pixel_format srcFormat, SpraymakerModel::ImageFormat dstFormat,
-                                   int alphaThreshold);
+    static void convertPixelFormat(const uchar* rgba, uchar* pos, int count,
+                                   SpraymakerModel::ImageFormat dstFormat, int alphaThreshold);
+    // Float RGBA, 0-1 -> dstFormat, only for isHighBitDepth() formats
+    static void convertFloatPixelFormat(const float* rgba, uchar* pos, int count,
+                                        SpraymakerModel::ImageFormat dstFormat);
+    // Flattens RGBA8888 in place for targets without multi-bit alpha
+    static void applyAlphaThreshold(uchar* rgba, size_t count, int alphaThreshold,
+                                    int backgroundRed, int backgroundGreen, int backgroundBlue);
+    // Alpha-weighted 2x2 box filter of RGBA8888, out is max(1, width/2) x max(1, height/2)
+    static void halveImage(const uchar* rgba, uint width, uint height, uchar* out);
+    // Formats whose pixels are just a selection of the bytes of RGBA8888, in output order
+    static bool getBandOrder(SpraymakerModel::ImageFormat format, std::vector<int>& bands);
 
 private:
     static uint sizeOfDxtImage(uint width, uint height,
@@ -8,6 +8,7 @@
 #include "imagemanager.h"
 #include "spraymakerexception.h"
 #include "imageloader_ffmpeg.h"
+#include "vtfreader.h"
 
 int ImageManager::previewResolution = 128;
 
@@ -15,6 +16,10 @@ const ImageInfo ImageManager::load(std::string file)
 {
     std::string errors;
 
+    // Neither of the others know VTF, and its errors say more than theirs would
+    if (VtfReader::isVtfFile(QString::fromStdString(file)))
+        return vtfLoad(file);
+
     // Attmept loading input with libvips
     try
     {
@@ -65,6 +70,18 @@ const PreviewInfo ImageManager::makePreview(const ImageInfo& imageInfo)
     return PreviewInfo(imageInfo.file, pixmaps);
 }
 
+const ImageInfo ImageManager::vtfLoad(std::string file)
+{
+    auto reader = std::make_shared<VtfReader>(QString::fromStdString(file));
+
+    // The largest mipmap of every frame, which are only decoded as they're used
+    auto images = std::vector<vips::VImage>();
+    for(int frame = 0; frame < reader->getFrames(); frame++)
+        images.push_back(reader->getImage(0, frame));
+
+    return ImageInfo(file, images);
+}
+
 const ImageInfo ImageManager::vipsLoad(std::string file)
 {
     auto image = vips::VImage::new_from_file(
@@ -76,6 +93,28 @@ const ImageInfo ImageManager::vipsLoad(std::string file)
 
     bool hasFrames = image.get_typeof("page-height") != 0 && image.get_typeof("n-pages") != 0;
 
+    // Sources with more than 8 bits per channel are also kept that way, for the formats which can store more than 8.
+    // Float sources stay float, as scRGB with alpha from 0 to 1, so values above 1 aren't clipped by RGB16.
+    vips::VImage native;
+    if (vips_band_format_isfloat(image.format()))
+    {
+        // Alpha goes from 0 to 1 in scRGB, and is given for 8 bits otherwise
+        const bool hasAlpha = vips_image_hasalpha(image.get_image());
+        const int colourBands = hasAlpha ? image.bands() - 1 : image.bands();
+        const double maxAlpha = image.interpretation() == VipsInterpretation::VIPS_INTERPRETATION_scRGB ? 1 : 255;
+
+        native = image.extract_band(0, vips::VImage::option()->set("n", colourBands))
+                     .colourspace(VipsInterpretation::VIPS_INTERPRETATION_scRGB);
+        native = hasAlpha ? native.bandjoin(image.extract_band(colourBands) / maxAlpha) : native.bandjoin(1.0);
+        native = native.cast(VipsBandFormat::VIPS_FORMAT_FLOAT);
+    }
+    else if (vips_band_format_is8bit(image.format()) == false)
+    {
+        native = image.colourspace(VipsInterpretation::VIPS_INTERPRETATION_RGB16);
+        if (native.bands() == 3)
+            native = native.bandjoin(65535);
+    }
+
     // Ensure RGBA pixel format
     image = image.colourspace(VipsInterpretation::VIPS_INTERPRETATION_sRGB);
     if (image.bands() == 3)
@@ -84,20 +123,26 @@ const ImageInfo ImageManager::vipsLoad(std::string file)
     if (hasFrames == false)
     {
         auto images = std::vector<vips::VImage>{image};
-        return ImageInfo(file, images);
+        auto nativeImages = std::vector<vips::VImage>();
+        if (native.is_null() == false)
+            nativeImages.push_back(native);
+        return ImageInfo(file, images, nativeImages);
     }
 
     auto width = image.width();
     auto pageHeight = image.get_int("page-height");
     auto frames = image.height() / pageHeight;
     auto images = std::vector<vips::VImage>();
+    auto nativeImages = std::vector<vips::VImage>();
 
     for(int frame = 0; frame < frames; frame++)
     {
         images.push_back(image.crop(0, frame * pageHeight, width, pageHeight));
+        if (native.is_null() == false)
+            nativeImages.push_back(native.crop(0, frame * pageHeight, width, pageHeight));
     }
 
-    return ImageInfo(file, images);
+    return ImageInfo(file, images, nativeImages);
 }
 
 const ImageInfo ImageManager::ffmpegLoad(std::string file)
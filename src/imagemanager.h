@@ -28,15 +28,20 @@ struct ImageInfo
     int frames;
     std::string file;
     std::vector<vips::VImage> image;
+    // The same frames as 16-bit RGBA when the file has more than 8 bits per channel, or as float RGBA
+    // when the file is float, otherwise empty
+    std::vector<vips::VImage> nativeImage;
 
 protected:
     ImageInfo(std::string file,
-              std::vector<vips::VImage> image)
+              std::vector<vips::VImage> image,
+              std::vector<vips::VImage> nativeImage = {})
         : width(image.front().width())
         , height(image.front().height())
         , frames(image.size())
         , file(file)
         , image(image)
+        , nativeImage(nativeImage)
     {}
 };
 
@@ -67,6 +72,7 @@ public slots:
     static const PreviewInfo makePreview(const ImageInfo& imageInfo);
 
 protected:
+    static const ImageInfo vtfLoad(std::string file);
     static const ImageInfo vipsLoad(std::string file);
     static const ImageInfo ffmpegLoad(std::string file);
 };
@@ -0,0 +1,304 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "imagemetrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IMAGEMETRICS_SSE2
+#include <emmintrin.h>
+#endif
+
+// Both images are premultiplied in a first pass, which also sums the squared errors.
+// A second pass collects per channel statistics of every 8x8 window for SSIM.
+
+namespace {
+
+constexpr int windowSize = 8;
+
+// SSIM's stabilising constants for 8-bit samples
+constexpr double c1 = (0.01*255) * (0.01*255);
+constexpr double c2 = (0.03*255) * (0.03*255);
+
+// round(x / 255) for x up to 255*255
+int div255(int x)
+{ return (x + 128 + ((x + 128) >> 8)) >> 8; }
+
+// Per channel sums of one window, r, g, b, a
+struct WindowSums
+{
+    uint x[4]  = {};
+    uint y[4]  = {};
+    uint xx[4] = {};
+    uint yy[4] = {};
+    uint xy[4] = {};
+};
+
+// ========== Premultiply ==========
+
+// One pixel: writes both premultiplied pixels and adds its errors
+void premultiplyPixel(const uchar* reference, const uchar* image, uchar* referenceOut, uchar* imageOut,
+                      ImageMetrics::Errors& errors)
+{
+    for(int c = 0; c < 3; c++)
+    {
+        referenceOut[c] = div255(reference[c] * reference[3]);
+        imageOut[c]     = div255(image[c] * image[3]);
+
+        const int error = std::abs(referenceOut[c] - imageOut[c]);
+        errors.colour += error*error;
+        errors.maxError = std::max(errors.maxError, error);
+    }
+
+    referenceOut[3] = reference[3];
+    imageOut[3]     = image[3];
+
+    const int error = std::abs(reference[3] - image[3]);
+    errors.alpha += error*error;
+    errors.maxError = std::max(errors.maxError, error);
+}
+
+void premultiply(const uchar* reference, const uchar* image, uchar* referenceOut, uchar* imageOut,
+                 size_t count, ImageMetrics::Errors& errors)
+{
+    size_t i = 0;
+
+#ifdef IMAGEMETRICS_SSE2
+    const auto zero = _mm_setzero_si128();
+    const auto alphaMask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+
+    // Two pixels as 16-bit lanes, r g b a r g b a
+    auto premultiplyLanes = [&](__m128i v){
+        auto alpha = _mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3));
+        alpha = _mm_shufflehi_epi16(alpha, _MM_SHUFFLE(3, 3, 3, 3));
+        auto p = _mm_add_epi16(_mm_mullo_epi16(v, alpha), _mm_set1_epi16(128));
+        p = _mm_srli_epi16(_mm_add_epi16(p, _mm_srli_epi16(p, 8)), 8);
+        return _mm_or_si128(_mm_andnot_si128(alphaMask, p), _mm_and_si128(alphaMask, v));
+    };
+
+    __m128i colourSum = zero;
+    __m128i alphaSum = zero;
+    __m128i maxError = zero;
+
+    // madd sums two squares into every 32-bit lane, flush them before they can overflow
+    auto flush = [&](){
+        alignas(16) int colour[4];
+        alignas(16) int alpha[4];
+        _mm_store_si128((__m128i*)colour, colourSum);
+        _mm_store_si128((__m128i*)alpha, alphaSum);
+        for(int lane = 0; lane < 4; lane++)
+        {
+            errors.colour += (uint)colour[lane];
+            errors.alpha += (uint)alpha[lane];
+        }
+        colourSum = zero;
+        alphaSum = zero;
+    };
+
+    for(int iteration = 1; i + 4 <= count; i += 4, iteration++)
+    {
+        const auto reference8 = _mm_loadu_si128((const __m128i*)(reference + i*4));
+        const auto image8 = _mm_loadu_si128((const __m128i*)(image + i*4));
+
+        const auto referenceLow  = premultiplyLanes(_mm_unpacklo_epi8(reference8, zero));
+        const auto referenceHigh = premultiplyLanes(_mm_unpackhi_epi8(reference8, zero));
+        const auto imageLow      = premultiplyLanes(_mm_unpacklo_epi8(image8, zero));
+        const auto imageHigh     = premultiplyLanes(_mm_unpackhi_epi8(image8, zero));
+
+        _mm_storeu_si128((__m128i*)(referenceOut + i*4), _mm_packus_epi16(referenceLow, referenceHigh));
+        _mm_storeu_si128((__m128i*)(imageOut + i*4), _mm_packus_epi16(imageLow, imageHigh));
+
+        for(const auto difference : {_mm_sub_epi16(referenceLow, imageLow), _mm_sub_epi16(referenceHigh, imageHigh)})
+        {
+            const auto colour = _mm_andnot_si128(alphaMask, difference);
+            const auto alpha = _mm_and_si128(alphaMask, difference);
+            colourSum = _mm_add_epi32(colourSum, _mm_madd_epi16(colour, colour));
+            alphaSum = _mm_add_epi32(alphaSum, _mm_madd_epi16(alpha, alpha));
+            maxError = _mm_max_epi16(maxError, _mm_max_epi16(difference, _mm_sub_epi16(zero, difference)));
+        }
+
+        if (iteration % 4096 == 0)
+            flush();
+    }
+
+    flush();
+
+    alignas(16) short maxErrors[8];
+    _mm_store_si128((__m128i*)maxErrors, maxError);
+    for(const short error : maxErrors)
+        errors.maxError = std::max<int>(errors.maxError, error);
+#endif
+
+    for(; i < count; i++)
+        premultiplyPixel(reference + i*4, image + i*4, referenceOut + i*4, imageOut + i*4, errors);
+}
+// ========== / Premultiply ==========
+
+// ========== SSIM ==========
+
+void addWindowRow(const uchar* x, const uchar* y, int count, WindowSums& sums)
+{
+    for(int i = 0; i < count*4; i++)
+    {
+        const int c = i & 3;
+        sums.x[c]  += x[i];
+        sums.y[c]  += y[i];
+        sums.xx[c] += x[i] * x[i];
+        sums.yy[c] += y[i] * y[i];
+        sums.xy[c] += x[i] * y[i];
+    }
+}
+
+#ifdef IMAGEMETRICS_SSE2
+// Eight pixels, lanes are r, g, b, a
+void addWindowRow(const uchar* x, const uchar* y, __m128i* sums)
+{
+    const auto zero = _mm_setzero_si128();
+
+    // 16-bit products of two pixels -> 32-bit per channel sums
+    auto addProducts = [&](__m128i& sum, __m128i a, __m128i b){
+        const auto low = _mm_mullo_epi16(a, b);
+        const auto high = _mm_mulhi_epu16(a, b);
+        sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_unpacklo_epi16(low, high), _mm_unpackhi_epi16(low, high)));
+    };
+    auto addValues = [&](__m128i& sum, __m128i a){
+        sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_unpacklo_epi16(a, zero), _mm_unpackhi_epi16(a, zero)));
+    };
+
+    for(int half = 0; half < 2; half++)
+    {
+        const auto x8 = _mm_loadu_si128((const __m128i*)(x + half*16));
+        const auto y8 = _mm_loadu_si128((const __m128i*)(y + half*16));
+
+        for(const auto& [x16, y16] : {std::pair{_mm_unpacklo_epi8(x8, zero), _mm_unpacklo_epi8(y8, zero)},
+                                     std::pair{_mm_unpackhi_epi8(x8, zero), _mm_unpackhi_epi8(y8, zero)}})
+        {
+            addValues(sums[0], x16);
+            addValues(sums[1], y16);
+            addProducts(sums[2], x16, x16);
+            addProducts(sums[3], y16, y16);
+            addProducts(sums[4], x16, y16);
+        }
+    }
+}
+#endif
+
+double getSsim(const WindowSums& sums, int c, int samples)
+{
+    const double meanX = (double)sums.x[c] / samples;
+    const double meanY = (double)sums.y[c] / samples;
+    const double varianceX = (double)sums.xx[c] / samples - meanX*meanX;
+    const double varianceY = (double)sums.yy[c] / samples - meanY*meanY;
+    const double covariance = (double)sums.xy[c] / samples - meanX*meanY;
+
+    return ((2*meanX*meanY + c1) * (2*covariance + c2))
+         / ((meanX*meanX + meanY*meanY + c1) * (varianceX + varianceY + c2));
+}
+
+void addSsim(const uchar* reference, const uchar* image, int width, int height, ImageMetrics::Errors& errors)
+{
+    for(int y = 0; y < height; y += windowSize)
+    {
+        for(int x = 0; x < width; x += windowSize)
+        {
+            // Windows at the right and bottom edges are smaller
+            const int columns = std::min(windowSize, width - x);
+            const int rows = std::min(windowSize, height - y);
+
+            WindowSums sums;
+
+#ifdef IMAGEMETRICS_SSE2
+            if (columns == windowSize)
+            {
+                __m128i vectorSums[5] = {};
+                for(int row = 0; row < rows; row++)
+                {
+                    const size_t offset = ((size_t)(y + row) * width + x) * 4;
+                    addWindowRow(reference + offset, image + offset, vectorSums);
+                }
+
+                uint* destinations[5] = {sums.x, sums.y, sums.xx, sums.yy, sums.xy};
+                for(int i = 0; i < 5; i++)
+                    _mm_storeu_si128((__m128i*)destinations[i], vectorSums[i]);
+            }
+            else
+#endif
+            {
+                for(int row = 0; row < rows; row++)
+                {
+                    const size_t offset = ((size_t)(y + row) * width + x) * 4;
+                    addWindowRow(reference + offset, image + offset, columns, sums);
+                }
+            }
+
+            const int samples = columns * rows;
+            errors.colourSsim += (getSsim(sums, 0, samples) + getSsim(sums, 1, samples) + getSsim(sums, 2, samples)) / 3;
+            errors.alphaSsim += getSsim(sums, 3, samples);
+            errors.windows++;
+        }
+    }
+}
+// ========== / SSIM ==========
+
+} // namespace
+
+ImageMetrics::Errors& ImageMetrics::Errors::operator+=(const Errors& other)
+{
+    colour += other.colour;
+    alpha += other.alpha;
+    pixels += other.pixels;
+    maxError = std::max(maxError, other.maxError);
+    colourSsim += other.colourSsim;
+    alphaSsim += other.alphaSsim;
+    windows += other.windows;
+    return *this;
+}
+
+double ImageMetrics::Errors::getPsnr() const
+{ return toPsnr(colour + alpha, pixels*4); }
+
+double ImageMetrics::Errors::getColourPsnr() const
+{ return toPsnr(colour, pixels*3); }
+
+double ImageMetrics::Errors::getAlphaPsnr() const
+{ return toPsnr(alpha, pixels); }
+
+double ImageMetrics::Errors::getColourSsim() const
+{ return windows > 0 ? colourSsim / windows : 1.0; }
+
+double ImageMetrics::Errors::getAlphaSsim() const
+{ return windows > 0 ? alphaSsim / windows : 1.0; }
+
+ImageMetrics::Errors ImageMetrics::compare(const uchar* reference, const uchar* image, int width, int height)
+{
+    const size_t count = (size_t)width * height;
+
+    Errors errors;
+    errors.pixels = count;
+
+    std::vector<uchar> premultipliedReference(count * 4);
+    std::vector<uchar> premultipliedImage(count * 4);
+    premultiply(reference, image, premultipliedReference.data(), premultipliedImage.data(), count, errors);
+    addSsim(premultipliedReference.data(), premultipliedImage.data(), width, height, errors);
+
+    return errors;
+}
+
+double ImageMetrics::toPsnr(quint64 squaredError, size_t samples)
+{
+    if (squaredError == 0 || samples == 0)
+        return std::numeric_limits<double>::infinity();
+
+    const double mse = (double)squaredError / samples;
+    return 10.0 * std::log10(255.0*255.0 / mse);
+}
@@ -0,0 +1,51 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef IMAGEMETRICS_H
+#define IMAGEMETRICS_H
+
+#include <QtGlobal>
+
+#include <cstddef>
+
+// ========== ImageMetrics ==========
+
+// Error between two RGBA8888 images of the same size, SSE2 where available with a scalar fallback.
+// Colour is weighted by alpha, so differences under transparent pixels don't count.
+// Alpha is scored separately.
+class ImageMetrics
+{
+public:
+    // Sums over every pixel and SSIM window, which add up over several images
+    struct Errors
+    {
+        quint64 colour = 0; // Squared errors of r, g, b
+        quint64 alpha = 0;
+        size_t pixels = 0;
+        int maxError = 0;
+
+        // SSIM over 8x8 windows, colour is the mean of r, g and b
+        double colourSsim = 0;
+        double alphaSsim = 0;
+        size_t windows = 0;
+
+        Errors& operator+=(const Errors& other);
+
+        double getPsnr() const;
+        double getColourPsnr() const;
+        double getAlphaPsnr() const;
+        double getColourSsim() const;
+        double getAlphaSsim() const;
+    };
+
+    static Errors compare(const uchar* reference, const uchar* image, int width, int height);
+
+    // Identical images have an infinite PSNR
+    static double toPsnr(quint64 squaredError, size_t samples);
+};
+
+#endif // IMAGEMETRICS_H
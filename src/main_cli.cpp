@@ -0,0 +1,421 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "imagehelper.h"
+#include "imagemanager.h"
+#include "settings.h"
+#include "sprayencoder.h"
+#include "sprayoptimizer.h"
+#include "spraymakerexception.h"
+#include "spraymakermodel.h"
+#include "vtflayout.h"
+
+// glib, used by libvips, has its own signals
+#pragma push_macro("signals")
+#undef signals
+#include <vips/vips8>
+#pragma pop_macro("signals")
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QFileInfo>
+#include <QMetaEnum>
+#include <QRegularExpression>
+
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+// Batch encoder: every input file becomes its own spray, encoded with the same
+// load -> autocrop -> resize -> crnlib -> VTF pipeline as the GUI.
+
+struct CliOptions
+{
+    SpraymakerModel::ImageFormat format = SpraymakerModel::ImageFormat::DXT1A;
+    SpraymakerModel::AutocropMode autocropMode = SpraymakerModel::AutocropMode::AUTOMATIC;
+    SpraymakerModel::TextureSampleMode textureSampleMode = SpraymakerModel::TextureSampleMode::ANISOTROPIC;
+    int width = 0; // 0 picks the largest resolution fitting maxFileSize
+    int height = 0;
+    int mipmaps = 1; // 0 uses as many as the resolution allows
+    int frames = 0; // 0 uses every frame of the input
+    int maxFileSize = 512*1024;
+    int alphaThreshold = 128;
+    std::vector<double> background = {0, 0, 0, 0};
+    QString outputDirectory = "./sprays";
+    bool useCache = true;
+    qint64 cacheSizeLimit = 0; // Bytes, 0 doesn't prune
+    bool metrics = false;
+    int vtfVersion = VtfLayout::minMinorVersion;
+    bool vtfCrc = false;
+    SpraymakerModel::EncoderBackend encoderBackend = SpraymakerModel::EncoderBackend::CRNLIB;
+    SpraymakerModel::MipmapFilter mipmapFilter = SpraymakerModel::MipmapFilter::SOURCE;
+
+    // Non-empty picks the best looking of these instead of using format, width and height
+    std::vector<SpraymakerModel::ImageFormat> optimizeFormats;
+    std::vector<int> optimizeMipmaps = {1};
+    int maxFrameStride = 1;
+};
+
+static int parseEnum(QMetaEnum metaEnum, QString key)
+{
+    bool ok = false;
+    int value = metaEnum.keyToValue(key.toUpper().toUtf8(), &ok);
+    if (ok == false || value < 0 || value >= metaEnum.keyCount() - 3) // INVALID, _MAX, _COUNT
+        throw SpraymakerException(QObject::tr("Unknown value: %1").arg(key));
+    return value;
+}
+
+static QString sprayNameFromFile(QString file)
+{
+    // Same rules as the GUI's spray name prompt
+    static auto regex = QRegularExpression("[^a-z0-9\\-_]");
+    auto sprayName = QFileInfo(file).completeBaseName().replace(" ", "_").toLower().remove(regex);
+    sprayName.truncate(99);
+    return sprayName;
+}
+
+static SprayEncoder::Parameters makeParameters(const CliOptions& options, SpraymakerModel& model,
+                                               const ImageInfo& imageInfo, int threads)
+{
+    const auto format = options.format;
+    const auto formats = model.mapFormat(format);
+
+    if (formats.crnFormat == crnlib::pixel_format::PIXEL_FMT_INVALID)
+        throw SpraymakerException(QObject::tr("%1 isn't an encodable format.").arg(formats.realName));
+
+    int frames = options.frames > 0 ? std::min(options.frames, imageInfo.frames) : imageInfo.frames;
+    uint width = options.width;
+    uint height = options.height;
+    uint mipmaps = options.mipmaps;
+
+    // Same resolution rules as the GUI's automatic mode
+    if (width == 0 || height == 0)
+        ImageHelper::getAutomaticResolution(format, width, height, mipmaps, frames,
+                                            options.maxFileSize
+                                                - VtfLayout::getMaxImageOffset(options.vtfVersion, options.vtfCrc));
+
+    if (mipmaps == 0)
+        mipmaps = ImageHelper::getMaxMipmaps(width, height);
+
+    mipmaps = std::min(mipmaps, ImageHelper::getMaxMipmaps(width, height));
+
+    SprayEncoder::Parameters parameters{
+        .format            = format,
+        .crnFormat         = formats.crnFormat,
+        .vtfFormat         = formats.vtfFormat,
+        .width             = (int)width,
+        .height            = (int)height,
+        .mipmaps           = (int)mipmaps,
+        .frames            = frames,
+        .textureSampleMode = options.textureSampleMode,
+        .autocropMode      = options.autocropMode,
+        .backgroundRed     = (int)options.background[0],
+        .backgroundGreen   = (int)options.background[1],
+        .backgroundBlue    = (int)options.background[2],
+        .backgroundAlpha   = (int)options.background[3],
+        .alphaThreshold    = options.alphaThreshold,
+        .crnHelperThreads  = 0,
+        .encoderBackend    = options.encoderBackend,
+        .mipmapFilter      = options.mipmapFilter,
+        .threads           = threads,
+        .computeMetrics    = options.metrics,
+        .vtfVersion        = options.vtfVersion,
+        .vtfCrc            = options.vtfCrc,
+    };
+
+    if (options.useCache)
+    {
+        parameters.cacheDirectory = EncodeCache::getDefaultDirectory();
+        parameters.cacheSizeLimit = options.cacheSizeLimit;
+    }
+
+    // Every mipmap is filled with the same frames, like MipmapPropagationMode::FILL
+    parameters.images.resize(mipmaps);
+    for(auto& mipmapImages : parameters.images)
+        mipmapImages.assign(imageInfo.image.begin(), imageInfo.image.begin() + frames);
+
+    if (imageInfo.nativeImage.empty() == false)
+    {
+        parameters.nativeImages.resize(mipmaps);
+        for(auto& mipmapImages : parameters.nativeImages)
+            mipmapImages.assign(imageInfo.nativeImage.begin(), imageInfo.nativeImage.begin() + frames);
+    }
+
+    return parameters;
+}
+
+int main(int argc, char *argv[])
+{
+    VIPS_INIT(argv[0]); // libvips
+
+    QCoreApplication app(argc, argv);
+    Settings::init(); // Shares the GUI's cache directory
+    QCoreApplication::setApplicationVersion(QString("%1.%2.%3")
+                                                .arg(SPRAYMAKER_VERSION_MAJOR)
+                                                .arg(SPRAYMAKER_VERSION_MINOR)
+                                                .arg(SPRAYMAKER_VERSION_PATCH));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QObject::tr("Encodes each input file into its own VTF spray."));
+    parser.addHelpOption();
+    parser.addVersionOption();
+    parser.addPositionalArgument("inputs", QObject::tr("Images or videos to encode."), "<input>...");
+
+    QCommandLineOption formatOption({"f", "format"},
+        QObject::tr("Output image format, e.g. DXT1A, DXT5, BGR888_BLUESCREEN."), "format", "DXT1A");
+    QCommandLineOption sizeOption({"s", "size"},
+        QObject::tr("Resolution as WIDTHxHEIGHT, or \"auto\" for the largest fitting --max-file-size."), "size", "auto");
+    QCommandLineOption mipmapsOption({"m", "mipmaps"},
+        QObject::tr("Mipmap count, or \"max\". --optimize takes a list to try, e.g. 1,max."), "count", "1");
+    QCommandLineOption framesOption({"n", "frames"},
+        QObject::tr("Maximum frame count, or \"all\"."), "count", "all");
+    QCommandLineOption maxFileSizeOption("max-file-size",
+        QObject::tr("File size limit in bytes used by --size auto and --optimize."), "bytes", "524288");
+    QCommandLineOption autocropOption("autocrop",
+        QObject::tr("Autocrop mode: automatic, individual, boundingbox, none."), "mode", "automatic");
+    QCommandLineOption sampleOption("sample",
+        QObject::tr("Texture sample mode: anisotropic, trilinear, point_sample, none."), "mode", "anisotropic");
+    QCommandLineOption backgroundOption("background",
+        QObject::tr("Background colour as R,G,B,A."), "rgba", "0,0,0,0");
+    QCommandLineOption alphaThresholdOption("alpha-threshold",
+        QObject::tr("Alpha below this is transparent for 1-bit alpha formats."), "value", "128");
+    QCommandLineOption outputOption({"o", "output"},
+        QObject::tr("Output directory."), "directory", "./sprays");
+    QCommandLineOption jobsOption({"j", "jobs"},
+        QObject::tr("Sprays encoded at the same time."), "count",
+        QString::number(std::max(1U, std::thread::hardware_concurrency() / 4)));
+    QCommandLineOption encoderOption({"e", "encoder"},
+        QObject::tr("DXT encoder: crnlib, range_fit (fastest), cluster_fit."), "encoder", "crnlib");
+    QCommandLineOption mipmapFilterOption("mipmap-filter",
+        QObject::tr("Mipmaps showing the same image as the one above: source (best), box (fastest), lanczos."),
+        "filter", "source");
+    QCommandLineOption noCacheOption("no-cache",
+        QObject::tr("Encode everything instead of reusing cached images."));
+    QCommandLineOption optimizeOption("optimize",
+        QObject::tr("Instead of --format and --size, trial encode these formats at the largest resolutions fitting "
+                    "--max-file-size and keep the best looking, e.g. DXT1A,DXT5,RGBA8888, or \"simple\"."),
+        "formats");
+    QCommandLineOption maxFrameStrideOption("max-frame-stride",
+        QObject::tr("With --optimize, also try keeping only every 2nd, 3rd, ... up to this frame for a higher resolution."),
+        "count", "1");
+    QCommandLineOption metricsOption("metrics",
+        QObject::tr("Print PSNR, SSIM and the largest error of the encoded images. Cached images aren't measured."));
+
+    QCommandLineOption vtfVersionOption("vtf-version",
+        QObject::tr("VTF version, 7.1 to 7.5. 7.2 and up include a low-res thumbnail."), "version", "7.1");
+    QCommandLineOption crcOption("crc",
+        QObject::tr("Store a CRC-32 of the image data, VTF 7.3 and up."));
+
+    parser.addOptions({formatOption, sizeOption, mipmapsOption, framesOption, maxFileSizeOption,
+                       autocropOption, sampleOption, backgroundOption, alphaThresholdOption,
+                       outputOption, jobsOption, encoderOption, mipmapFilterOption, noCacheOption,
+                       optimizeOption, maxFrameStrideOption, metricsOption, vtfVersionOption, crcOption});
+    parser.process(app);
+
+    const auto inputs = parser.positionalArguments();
+    if (inputs.isEmpty())
+        parser.showHelp(1);
+
+    CliOptions options;
+    int jobs = 1;
+
+    try
+    {
+        options.format = (SpraymakerModel::ImageFormat)parseEnum(
+            QMetaEnum::fromType<SpraymakerModel::ImageFormat>(), parser.value(formatOption));
+        options.autocropMode = (SpraymakerModel::AutocropMode)parseEnum(
+            QMetaEnum::fromType<SpraymakerModel::AutocropMode>(), parser.value(autocropOption));
+        options.textureSampleMode = (SpraymakerModel::TextureSampleMode)parseEnum(
+            QMetaEnum::fromType<SpraymakerModel::TextureSampleMode>(), parser.value(sampleOption));
+        options.encoderBackend = (SpraymakerModel::EncoderBackend)parseEnum(
+            QMetaEnum::fromType<SpraymakerModel::EncoderBackend>(), parser.value(encoderOption));
+        options.mipmapFilter = (SpraymakerModel::MipmapFilter)parseEnum(
+            QMetaEnum::fromType<SpraymakerModel::MipmapFilter>(), parser.value(mipmapFilterOption));
+
+        if (parser.value(sizeOption) != "auto")
+        {
+            auto size = parser.value(sizeOption).split('x');
+            if (size.size() != 2)
+                throw SpraymakerException(QObject::tr("Size must be WIDTHxHEIGHT: %1").arg(parser.value(sizeOption)));
+            options.width  = std::clamp(size[0].toInt(), 1, (int)crn_limits::cCRNMaxLevelResolution);
+            options.height = std::clamp(size[1].toInt(), 1, (int)crn_limits::cCRNMaxLevelResolution);
+        }
+
+        if (parser.isSet(optimizeOption))
+        {
+            // Only used for its format tables
+            SpraymakerModel model;
+            const auto metaEnum = QMetaEnum::fromType<SpraymakerModel::ImageFormat>();
+
+            for(const auto& key : parser.value(optimizeOption).split(','))
+            {
+                if (key.toLower() != "simple")
+                {
+                    options.optimizeFormats.push_back((SpraymakerModel::ImageFormat)parseEnum(metaEnum, key));
+                    continue;
+                }
+
+                for(int format = 0; format < (int)SpraymakerModel::ImageFormat::_COUNT; format++)
+                {
+                    const auto formats = model.mapFormat((SpraymakerModel::ImageFormat)format);
+                    if (formats.isSimple && formats.hide == false)
+                        options.optimizeFormats.push_back(formats.format);
+                }
+            }
+
+            options.maxFrameStride = std::max(1, parser.value(maxFrameStrideOption).toInt());
+        }
+
+        options.optimizeMipmaps.clear();
+        for(const auto& count : parser.value(mipmapsOption).split(','))
+            options.optimizeMipmaps.push_back(count == "max" ? 0 : std::max(1, count.toInt()));
+
+        if (options.optimizeMipmaps.size() > 1 && options.optimizeFormats.empty())
+            throw SpraymakerException(QObject::tr("Only --optimize tries several mipmap counts."));
+
+        options.mipmaps = options.optimizeMipmaps.front();
+
+        if (parser.value(framesOption) != "all")
+            options.frames = std::max(1, parser.value(framesOption).toInt());
+
+        auto background = parser.value(backgroundOption).split(',');
+        if (background.size() != 4)
+            throw SpraymakerException(QObject::tr("Background must be R,G,B,A: %1").arg(parser.value(backgroundOption)));
+        for(int i = 0; i < 4; i++)
+            options.background[i] = std::clamp(background[i].toInt(), 0, 255);
+
+        options.maxFileSize = parser.value(maxFileSizeOption).toInt();
+        options.alphaThreshold = std::clamp(parser.value(alphaThresholdOption).toInt(), -1, 256);
+        options.outputDirectory = parser.value(outputOption);
+        // Same cache settings as the GUI, which --no-cache can only turn off
+        options.useCache = Settings::getInstance()->getUseEncodeCache() && parser.isSet(noCacheOption) == false;
+        options.cacheSizeLimit = (qint64)Settings::getInstance()->getEncodeCacheSize() * 1024 * 1024;
+        options.metrics = parser.isSet(metricsOption);
+
+        static const auto vtfVersionRegex = QRegularExpression("^7\\.([1-5])$");
+        const auto vtfVersion = vtfVersionRegex.match(parser.value(vtfVersionOption));
+        if (vtfVersion.hasMatch() == false)
+            throw SpraymakerException(QObject::tr("VTF version must be 7.1 to 7.5: %1").arg(parser.value(vtfVersionOption)));
+        options.vtfVersion = vtfVersion.captured(1).toInt();
+        options.vtfCrc = parser.isSet(crcOption);
+        if (options.vtfCrc && options.vtfVersion < 3)
+            throw SpraymakerException(QObject::tr("--crc needs VTF 7.3 or later."));
+        jobs = std::clamp(parser.value(jobsOption).toInt(), 1, (int)inputs.size());
+
+        if (QDir().mkpath(options.outputDirectory) == false)
+            throw SpraymakerException(QObject::tr("Failed to create %1 directory.").arg(options.outputDirectory));
+    }
+    catch (const SpraymakerException& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    // Share the cores between sprays being encoded at the same time
+    const int threadsPerJob = std::max(1, (int)std::thread::hardware_concurrency() / jobs);
+
+    std::atomic<int> nextInput = 0;
+    std::atomic<int> failures = 0;
+    std::mutex outputMutex;
+
+    auto worker = [&](){
+        // Only used for its format tables
+        SpraymakerModel model;
+
+        for(int index = nextInput++; index < inputs.size(); index = nextInput++)
+        {
+            const auto& input = inputs[index];
+            const auto outputFile = options.outputDirectory + "/" + sprayNameFromFile(input) + ".vtf";
+
+            try
+            {
+                const auto imageInfo = ImageManager::load(input.toStdString());
+                auto parameters = makeParameters(options, model, imageInfo, threadsPerJob);
+
+                QString optimized;
+                if (options.optimizeFormats.empty() == false)
+                {
+                    SprayOptimizer optimizer(parameters,
+                                             SprayOptimizer::Options{
+                                                 .formats        = options.optimizeFormats,
+                                                 .maxFileSize    = (size_t)options.maxFileSize,
+                                                 .mipmapCounts   = options.optimizeMipmaps,
+                                                 .maxFrameStride = options.maxFrameStride,
+                                             },
+                                             model);
+                    const auto candidates = optimizer.optimize([](int, int){}).candidates;
+                    if (candidates.empty())
+                        throw SpraymakerException(QObject::tr("None of the formats fit in %1 bytes.").arg(options.maxFileSize));
+
+                    // With the cache on, the final encode reuses the trial encode's images
+                    const auto& best = candidates.front();
+                    parameters = optimizer.getParameters(best);
+                    optimized = QString("%1 %2x%3, %4 mipmaps, %5 frames, %6 dB of %7 candidates, ")
+                                    .arg(QMetaEnum::fromType<SpraymakerModel::ImageFormat>().valueToKey((int)best.format))
+                                    .arg(best.width).arg(best.height)
+                                    .arg(best.mipmaps).arg(best.frames)
+                                    .arg(best.errors.getPsnr(), 0, 'f', 2)
+                                    .arg(candidates.size());
+                }
+
+                SprayEncoder encoder(parameters);
+                auto result = encoder.encodeToFile(outputFile, [](int, int){});
+
+                std::scoped_lock lock(outputMutex);
+                std::cout << input.toStdString() << " -> " << outputFile.toStdString()
+                          << " (" << optimized.toStdString()
+                          << result.fileSize << " bytes, "
+                          << result.cellsCached << "/" << result.cells << " cached, "
+                          << result.cellsReused << " repeated)" << std::endl;
+
+                if (options.metrics && result.metrics.pixels > 0)
+                {
+                    const auto& metrics = result.metrics;
+                    std::cout << "    "
+                              << QString("PSNR %1 dB, colour %2 dB, alpha %3 dB, SSIM colour %4, alpha %5, max error %6")
+                                     .arg(metrics.getPsnr(), 0, 'f', 2)
+                                     .arg(metrics.getColourPsnr(), 0, 'f', 2)
+                                     .arg(metrics.getAlphaPsnr(), 0, 'f', 2)
+                                     .arg(metrics.getColourSsim(), 0, 'f', 4)
+                                     .arg(metrics.getAlphaSsim(), 0, 'f', 4)
+                                     .arg(metrics.maxError).toStdString()
+                              << std::endl;
+                }
+            }
+            catch (const SpraymakerException& e)
+            {
+                failures++;
+                std::scoped_lock lock(outputMutex);
+                std::cerr << input.toStdString() << ": " << e.what() << std::endl;
+                if (e.hasDebugMessage)
+                    std::cerr << e.debugMessage.toStdString() << std::endl;
+            }
+            catch (const std::exception& e)
+            {
+                failures++;
+                std::scoped_lock lock(outputMutex);
+                std::cerr << input.toStdString() << ": " << e.what() << std::endl;
+            }
+        }
+    };
+
+    {
+        std::vector<std::jthread> threads;
+        for(int i = 0; i < jobs; i++)
+            threads.emplace_back(worker);
+    }
+
+    // Sprays whose final encode never ran still left their trial encodes in the cache
+    if (options.useCache && options.cacheSizeLimit > 0)
+        EncodeCache(EncodeCache::getDefaultDirectory()).prune(options.cacheSizeLimit);
+
+    vips_shutdown();
+
+    return failures > 0 ? 2 : 0;
+}
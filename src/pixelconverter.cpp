@@ -0,0 +1,651 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "pixelconverter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PIXELCONVERTER_SSE2
+#include <emmintrin.h>
+#endif
+
+// F16C is picked at runtime, builds for any x86 CPU can still use it
+#if defined(PIXELCONVERTER_SSE2) && (defined(_MSC_VER) || defined(__GNUC__))
+#define PIXELCONVERTER_F16C
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define PIXELCONVERTER_F16C_TARGET
+#else
+#define PIXELCONVERTER_F16C_TARGET __attribute__((target("avx,f16c")))
+#endif
+#endif
+
+// Every format is described by what it does to one pixel, loaded as a little-endian
+// 32-bit lane (r in the low byte, a in the high byte), and how many bytes of the
+// resulting lane make up an output pixel. The same lane operation is written once
+// for a single uint and once for four pixels in an SSE2 register.
+// Formats with more than 8 bits per channel are converted from float RGBA instead,
+// see PixelConverter::getFloatKernel().
+
+namespace {
+
+// ========== Lane operations ==========
+
+struct Identity
+{
+    static uint lane(uint x, int) { return x; }
+#ifdef PIXELCONVERTER_SSE2
+    static __m128i lanes(__m128i x, __m128i) { return x; }
+#endif
+};
+
+// r, g, b, a -> b, g, r, a
+struct SwapRB
+{
+    static uint lane(uint x, int)
+    { return (x & 0xff00ff00) | ((x >> 16) & 0xff) | ((x & 0xff) << 16); }
+#ifdef PIXELCONVERTER_SSE2
+    static __m128i lanes(__m128i x, __m128i)
+    {
+        return _mm_or_si128(_mm_and_si128(x, _mm_set1_epi32(0xff00ff00)),
+               _mm_or_si128(_mm_and_si128(_mm_srli_epi32(x, 16), _mm_set1_epi32(0xff)),
+                            _mm_slli_epi32(_mm_and_si128(x, _mm_set1_epi32(0xff)), 16)));
+    }
+#endif
+};
+
+// r, g, b, a -> a, b, g, r
+struct Reverse
+{
+    static uint lane(uint x, int)
+    { return (x << 24) | ((x << 8) & 0xff0000) | ((x >> 8) & 0xff00) | (x >> 24); }
+#ifdef PIXELCONVERTER_SSE2
+    static __m128i lanes(__m128i x, __m128i)
+    {
+        return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(x, 24),
+                                          _mm_and_si128(_mm_slli_epi32(x, 8), _mm_set1_epi32(0xff0000))),
+                            _mm_or_si128(_mm_and_si128(_mm_srli_epi32(x, 8), _mm_set1_epi32(0xff00)),
+                                         _mm_srli_epi32(x, 24)));
+    }
+#endif
+};
+
+struct Alpha
+{
+    static uint lane(uint x, int) { return x >> 24; }
+#ifdef PIXELCONVERTER_SSE2
+    static __m128i lanes(__m128i x, __m128i) { return _mm_srli_epi32(x, 24); }
+#endif
+};
+
+// Rec. 601 luma, the same weights crnlib used for L8
+struct Luma
+{
+    static uint lane(uint x, int)
+    { return (19595U*(x & 0xff) + 38470U*((x >> 8) & 0xff) + 7471U*((x >> 16) & 0xff) + 32768U) >> 16; }
+#ifdef PIXELCONVERTER_SSE2
+    static __m128i lanes(__m128i x, __m128i)
+    {
+        // madd only takes signed 16-bit weights, so g*38470 is split into g*5702 + g*32768
+        const auto rb = _mm_and_si128(x, _mm_set1_epi32(0x00ff00ff));
+        const auto g  = _mm_and_si128(_mm_srli_epi32(x, 8), _mm_set1_epi32(0xff));
+        auto sum = _mm_madd_epi16(rb, _mm_set1_epi32((7471 << 16) | 19595));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(g, _mm_set1_epi32(5702)));
+        sum = _mm_add_epi32(sum, _mm_slli_epi32(g, 15));
+        sum = _mm_add_epi32(sum, _mm_set1_epi32(32768));
+        return _mm_srli_epi32(sum, 16);
+    }
+#endif
+};
+
+struct LumaAlpha
+{
+    static uint lane(uint x, int t) { return Luma::lane(x, t) | ((x >> 24) << 8); }
+#ifdef PIXELCONVERTER_SSE2
+    static __m128i lanes(__m128i x, __m128i t)
+    { return _mm_or_si128(Luma::lanes(x, t), _mm_slli_epi32(_mm_srli_epi32(x, 24), 8)); }
+#endif
+};
+
+// Shift-and-mask packing into 16 bits: each channel is (x >> shift) & mask, or'd together.
+// Negative shifts are left shifts.
+template<int RShift, uint RMask, int GShift, uint GMask, int BShift, uint BMask, int AShift, uint AMask>
+struct Pack16
+{
+    static uint shift(uint x, int s) { return s >= 0 ? x >> s : x << -s; }
+
+    static uint lane(uint x, int)
+    {
+        return (shift(x, RShift) & RMask) | (shift(x, GShift) & GMask)
+             | (shift(x, BShift) & BMask) | (shift(x, AShift) & AMask);
+    }
+#ifdef PIXELCONVERTER_SSE2
+    template<int S>
+    static __m128i shift(__m128i x)
+    {
+        if constexpr (S >= 0)
+            return _mm_srli_epi32(x, S);
+        else
+            return _mm_slli_epi32(x, -S);
+    }
+
+    static __m128i lanes(__m128i x, __m128i)
+    {
+        auto channel = [](__m128i v, uint mask){ return _mm_and_si128(v, _mm_set1_epi32(mask)); };
+        return _mm_or_si128(_mm_or_si128(channel(shift<RShift>(x), RMask), channel(shift<GShift>(x), GMask)),
+                            _mm_or_si128(channel(shift<BShift>(x), BMask), channel(shift<AShift>(x), AMask)));
+    }
+#endif
+};
+
+//                   r                g              b              a
+using PackBGRA4444 = Pack16<-4, 0x0f00,  8, 0x00f0, 20, 0x000f, 16, 0xf000>;
+using PackBGRA5551 = Pack16<-7, 0x7c00,  6, 0x03e0, 19, 0x001f, 16, 0x8000>;
+using PackBGR565   = Pack16<-8, 0xf800,  5, 0x07e0, 19, 0x001f,  0, 0x0000>;
+using PackRGB565   = Pack16< 3, 0x001f,  5, 0x07e0,  8, 0xf800,  0, 0x0000>;
+
+// Pixels with alpha below the threshold become pure blue, pure blue pixels are nudged off it
+template<bool BGR>
+struct Bluescreen
+{
+    static uint lane(uint x, int alphaThreshold)
+    {
+        uint rgb = x & 0xffffff;
+
+        if (rgb == 0xff0000)
+            rgb = 0xfe0000;
+
+        if ((int)(x >> 24) < alphaThreshold)
+            rgb = 0xff0000;
+
+        return BGR ? SwapRB::lane(rgb, 0) : rgb;
+    }
+#ifdef PIXELCONVERTER_SSE2
+    static __m128i lanes(__m128i x, __m128i alphaThreshold)
+    {
+        const auto blue = _mm_set1_epi32(0xff0000);
+        auto rgb = _mm_and_si128(x, _mm_set1_epi32(0xffffff));
+
+        const auto isBlue = _mm_cmpeq_epi32(rgb, blue);
+        rgb = _mm_sub_epi32(rgb, _mm_and_si128(isBlue, _mm_set1_epi32(0x010000)));
+
+        const auto transparent = _mm_cmplt_epi32(_mm_srli_epi32(x, 24), alphaThreshold);
+        rgb = _mm_or_si128(_mm_and_si128(transparent, blue), _mm_andnot_si128(transparent, rgb));
+
+        return BGR ? SwapRB::lanes(rgb, alphaThreshold) : rgb;
+    }
+#endif
+};
+
+// The first Channels channels scaled to 0-127, matching the old floor(0x7f * c / 255.0)
+template<int Channels>
+struct SignedNormal
+{
+    static constexpr uint mask = Channels == 4 ? 0xffffffff : (1U << (Channels*8)) - 1;
+
+    static uint lane(uint x, int)
+    {
+        uint result = 0;
+        for(int c = 0; c < Channels; c++)
+            result |= ((((x >> (c*8)) & 0xff) * 127) / 255) << (c*8);
+        return result;
+    }
+#ifdef PIXELCONVERTER_SSE2
+    static __m128i lanes(__m128i x, __m128i)
+    {
+        // floor(v / 255) == (v + 1 + (v >> 8)) >> 8 for every v this can produce
+        auto scale = [](__m128i v){
+            v = _mm_mullo_epi16(v, _mm_set1_epi16(127));
+            v = _mm_add_epi16(_mm_add_epi16(v, _mm_set1_epi16(1)), _mm_srli_epi16(v, 8));
+            return _mm_srli_epi16(v, 8);
+        };
+        const auto bytes = _mm_set1_epi16(0xff);
+        const auto rb = scale(_mm_and_si128(x, bytes));
+        const auto ga = scale(_mm_and_si128(_mm_srli_epi16(x, 8), bytes));
+        return _mm_and_si128(_mm_or_si128(rb, _mm_slli_epi16(ga, 8)), _mm_set1_epi32(mask));
+    }
+#endif
+};
+
+// ========== Stores ==========
+
+// Writes the low Size bytes of every lane, 8 pixels from two registers
+#ifdef PIXELCONVERTER_SSE2
+template<int Size>
+void store(__m128i a, __m128i b, uchar* out)
+{
+    if constexpr (Size == 4)
+    {
+        _mm_storeu_si128((__m128i*)out, a);
+        _mm_storeu_si128((__m128i*)(out + 16), b);
+    }
+    else if constexpr (Size == 2)
+    {
+        // packs saturates signed values, so bias the 16-bit range into it and back
+        const auto bias32 = _mm_set1_epi32(0x8000);
+        const auto packed = _mm_packs_epi32(_mm_sub_epi32(a, bias32), _mm_sub_epi32(b, bias32));
+        _mm_storeu_si128((__m128i*)out, _mm_add_epi16(packed, _mm_set1_epi16((short)0x8000)));
+    }
+    else if constexpr (Size == 1)
+    {
+        const auto packed = _mm_packs_epi32(a, b);
+        _mm_storel_epi64((__m128i*)out, _mm_packus_epi16(packed, packed));
+    }
+    else if constexpr (Size == 3)
+    {
+        // Squeeze the empty fourth byte out of every lane: pairs of pixels first
+        // within each 64-bit half, then the two halves together, 12 bytes per register
+        auto pack = [](__m128i v){
+            const auto low = _mm_set_epi32(0, -1, 0, -1);
+            v = _mm_and_si128(v, _mm_set1_epi32(0xffffff));
+            v = _mm_or_si128(_mm_and_si128(v, low), _mm_srli_epi64(_mm_andnot_si128(low, v), 8));
+            return _mm_or_si128(_mm_move_epi64(v), _mm_slli_si128(_mm_srli_si128(v, 8), 6));
+        };
+        const auto first = pack(a);
+        const auto second = pack(b);
+        _mm_storeu_si128((__m128i*)out, _mm_or_si128(first, _mm_slli_si128(second, 12)));
+        _mm_storel_epi64((__m128i*)(out + 16), _mm_srli_si128(second, 4));
+    }
+    else if constexpr (Size == 8)
+    {
+        // Each byte c doubled into the 16-bit c*257
+        _mm_storeu_si128((__m128i*)out,        _mm_unpacklo_epi8(a, a));
+        _mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi8(a, a));
+        _mm_storeu_si128((__m128i*)(out + 32), _mm_unpacklo_epi8(b, b));
+        _mm_storeu_si128((__m128i*)(out + 48), _mm_unpackhi_epi8(b, b));
+    }
+}
+#endif
+
+template<int Size>
+void storeOne(uint lane, uchar* out)
+{
+    if constexpr (Size == 8)
+    {
+        for(int c = 0; c < 4; c++)
+        {
+            out[c*2    ] = lane >> (c*8);
+            out[c*2 + 1] = lane >> (c*8);
+        }
+    }
+    else
+    {
+        for(int c = 0; c < Size; c++)
+            out[c] = lane >> (c*8);
+    }
+}
+
+// ========== Kernels ==========
+
+template<typename Op, int Size>
+void convert(const uchar* rgba, uchar* out, int count, int alphaThreshold)
+{
+    int i = 0;
+
+#ifdef PIXELCONVERTER_SSE2
+    const auto threshold = _mm_set1_epi32(alphaThreshold);
+    for(; i + 8 <= count; i += 8)
+    {
+        const auto a = _mm_loadu_si128((const __m128i*)(rgba + i*4));
+        const auto b = _mm_loadu_si128((const __m128i*)(rgba + i*4 + 16));
+        store<Size>(Op::lanes(a, threshold), Op::lanes(b, threshold), out + (size_t)i*Size);
+    }
+#endif
+
+    for(; i < count; i++)
+    {
+        const uchar* p = rgba + i*4;
+        const uint x = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint)p[3] << 24);
+        storeOne<Size>(Op::lane(x, alphaThreshold), out + (size_t)i*Size);
+    }
+}
+
+// ========== Float kernels ==========
+
+// One float RGBA pixel -> Size bytes, written once for a single pixel and once for four
+// pixels, one per SSE2 register
+
+struct FloatRGBA
+{
+    static constexpr int size = 16;
+    static void pixel(const float* p, uchar* out) { memcpy(out, p, 16); }
+};
+
+struct FloatRGB
+{
+    static constexpr int size = 12;
+    static void pixel(const float* p, uchar* out) { memcpy(out, p, 12); }
+#ifdef PIXELCONVERTER_SSE2
+    static void pixels(const __m128 p[4], uchar* out)
+    {
+        // Every store's alpha is overwritten by the next pixel, the fourth is stored on its own
+        _mm_storeu_ps((float*)out, p[0]);
+        _mm_storeu_ps((float*)(out + 12), p[1]);
+        _mm_storeu_ps((float*)(out + 24), p[2]);
+        memcpy(out + 36, &p[3], 12);
+    }
+#endif
+};
+
+struct FloatR
+{
+    static constexpr int size = 4;
+    static void pixel(const float* p, uchar* out) { memcpy(out, p, 4); }
+#ifdef PIXELCONVERTER_SSE2
+    static void pixels(const __m128 p[4], uchar* out)
+    {
+        // r0 r1 g0 g1, r2 r3 g2 g3 -> r0 r1 r2 r3
+        const auto low = _mm_unpacklo_ps(p[0], p[1]);
+        const auto high = _mm_unpacklo_ps(p[2], p[3]);
+        _mm_storeu_ps((float*)out, _mm_movelh_ps(low, high));
+    }
+#endif
+};
+
+// Unsigned 16-bit, clamped and rounded to nearest
+struct UShortRGBA
+{
+    static constexpr int size = 8;
+    static void pixel(const float* p, uchar* out)
+    {
+        for(int c = 0; c < 4; c++)
+        {
+            const auto value = (ushort)std::lrint(std::clamp(p[c], 0.0f, 1.0f) * 65535.0f);
+            memcpy(out + c*2, &value, 2);
+        }
+    }
+#ifdef PIXELCONVERTER_SSE2
+    static void pixels(const __m128 p[4], uchar* out)
+    {
+        // cvtps rounds to nearest even like lrint, packs is biased into the signed range as in store<2>
+        auto scale = [](__m128 v){
+            v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+            return _mm_sub_epi32(_mm_cvtps_epi32(_mm_mul_ps(v, _mm_set1_ps(65535.0f))), _mm_set1_epi32(0x8000));
+        };
+        const auto bias16 = _mm_set1_epi16((short)0x8000);
+        _mm_storeu_si128((__m128i*)out,        _mm_add_epi16(_mm_packs_epi32(scale(p[0]), scale(p[1])), bias16));
+        _mm_storeu_si128((__m128i*)(out + 16), _mm_add_epi16(_mm_packs_epi32(scale(p[2]), scale(p[3])), bias16));
+    }
+#endif
+};
+
+// IEEE half floats, rounded to nearest even like F16C. Overflow becomes infinity, NaN stays NaN.
+struct HalfRGBA
+{
+    static constexpr int size = 8;
+
+    static ushort toHalf(float value)
+    {
+        uint f;
+        memcpy(&f, &value, 4);
+        const uint sign = f & 0x80000000;
+        f ^= sign;
+
+        ushort half;
+        if (f >= (127 + 16) << 23)
+            half = f > 0x7f800000 ? 0x7e00 : 0x7c00; // Too large for a half, infinity or NaN
+        else if (f < (127 - 14) << 23)
+        {
+            // Subnormal halves: adding the magic number shifts the mantissa into place,
+            // and the float addition does the rounding
+            const uint magic = ((127 - 15) + (23 - 10) + 1) << 23;
+            float magicFloat, shifted;
+            memcpy(&magicFloat, &magic, 4);
+            memcpy(&shifted, &f, 4);
+            shifted += magicFloat;
+            memcpy(&f, &shifted, 4);
+            half = f - magic;
+        }
+        else
+        {
+            // Rebias the exponent, then round the 13 mantissa bits which are cut off
+            const uint odd = (f >> 13) & 1;
+            half = (f + ((uint)(15 - 127) << 23) + 0xfff + odd) >> 13;
+        }
+
+        return half | (sign >> 16);
+    }
+
+    static void pixel(const float* p, uchar* out)
+    {
+        for(int c = 0; c < 4; c++)
+        {
+            const auto value = toHalf(p[c]);
+            memcpy(out + c*2, &value, 2);
+        }
+    }
+#ifdef PIXELCONVERTER_SSE2
+    // The same steps as toHalf() with every branch computed and selected by masks
+    static __m128i toHalves(__m128 value)
+    {
+        const auto magic = _mm_set1_epi32(((127 - 15) + (23 - 10) + 1) << 23);
+
+        const auto sign = _mm_and_si128(_mm_castps_si128(value), _mm_set1_epi32(0x80000000));
+        const auto f = _mm_xor_si128(_mm_castps_si128(value), sign);
+
+        const auto nan = _mm_and_si128(_mm_cmpgt_epi32(f, _mm_set1_epi32(0x7f800000)), _mm_set1_epi32(0x200));
+        const auto special = _mm_or_si128(nan, _mm_set1_epi32(0x7c00));
+
+        const auto subnormal = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(_mm_castsi128_ps(f), _mm_castsi128_ps(magic))), magic);
+
+        const auto odd = _mm_and_si128(_mm_srli_epi32(f, 13), _mm_set1_epi32(1));
+        auto normal = _mm_add_epi32(f, _mm_set1_epi32((int)((uint)(15 - 127) << 23) + 0xfff));
+        normal = _mm_srli_epi32(_mm_add_epi32(normal, odd), 13);
+
+        const auto isSubnormal = _mm_cmplt_epi32(f, _mm_set1_epi32((127 - 14) << 23));
+        const auto isRegular = _mm_cmplt_epi32(f, _mm_set1_epi32((127 + 16) << 23));
+        auto half = _mm_or_si128(_mm_and_si128(isSubnormal, subnormal), _mm_andnot_si128(isSubnormal, normal));
+        half = _mm_or_si128(_mm_and_si128(isRegular, half), _mm_andnot_si128(isRegular, special));
+
+        // Sign extended from bit 15, so packs keeps every half as it is
+        return _mm_or_si128(half, _mm_srai_epi32(sign, 16));
+    }
+
+    static void pixels(const __m128 p[4], uchar* out)
+    {
+        _mm_storeu_si128((__m128i*)out,        _mm_packs_epi32(toHalves(p[0]), toHalves(p[1])));
+        _mm_storeu_si128((__m128i*)(out + 16), _mm_packs_epi32(toHalves(p[2]), toHalves(p[3])));
+    }
+#endif
+};
+
+template<typename Op>
+void convertFloat(const float* rgba, uchar* out, int count)
+{
+    int i = 0;
+
+#ifdef PIXELCONVERTER_SSE2
+    if constexpr (requires(const __m128* p, uchar* o){ Op::pixels(p, o); })
+    {
+        for(; i + 4 <= count; i += 4)
+        {
+            const float* p = rgba + (size_t)i*4;
+            const __m128 pixels[4] = {_mm_loadu_ps(p), _mm_loadu_ps(p + 4), _mm_loadu_ps(p + 8), _mm_loadu_ps(p + 12)};
+            Op::pixels(pixels, out + (size_t)i*Op::size);
+        }
+    }
+#endif
+
+    for(; i < count; i++)
+        Op::pixel(rgba + (size_t)i*4, out + (size_t)i*Op::size);
+}
+
+#ifdef PIXELCONVERTER_F16C
+// Eight floats, two pixels, per instruction
+PIXELCONVERTER_F16C_TARGET
+void convertHalfF16c(const float* rgba, uchar* out, int count)
+{
+    int i = 0;
+    for(; i + 2 <= count; i += 2)
+    {
+        const auto halves = _mm256_cvtps_ph(_mm256_loadu_ps(rgba + (size_t)i*4), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i*)(out + (size_t)i*8), halves);
+    }
+
+    for(; i < count; i++)
+    {
+        const auto halves = _mm_cvtps_ph(_mm_loadu_ps(rgba + (size_t)i*4), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storel_epi64((__m128i*)(out + (size_t)i*8), halves);
+    }
+}
+
+bool hasF16c()
+{
+#ifdef _MSC_VER
+    // F16C instructions are VEX encoded, so the OS has to save the AVX registers too
+    int info[4];
+    __cpuid(info, 1);
+    const bool f16c = (info[2] >> 29) & 1;
+    const bool osxsave = (info[2] >> 27) & 1;
+    const bool avx = (info[2] >> 28) & 1;
+    return f16c && avx && osxsave && (_xgetbv(0) & 6) == 6;
+#else
+    // Only reported when the OS saves the AVX registers
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+#endif
+}
+#endif
+
+// RGBA8888 through a float kernel, a chunk at a time so the floats stay in cache
+template<typename Op>
+void widenToFloat(const uchar* rgba, uchar* out, int count, int)
+{
+    constexpr int chunk = 256;
+    alignas(16) float buffer[chunk * 4];
+
+    for(int start = 0; start < count; start += chunk)
+    {
+        const int n = std::min(chunk, count - start);
+        const uchar* in = rgba + (size_t)start*4;
+        int i = 0;
+
+#ifdef PIXELCONVERTER_SSE2
+        const auto zero = _mm_setzero_si128();
+        const auto max = _mm_set1_ps(255.0f);
+        for(; i + 16 <= n*4; i += 16)
+        {
+            const auto bytes = _mm_loadu_si128((const __m128i*)(in + i));
+            const auto low = _mm_unpacklo_epi8(bytes, zero);
+            const auto high = _mm_unpackhi_epi8(bytes, zero);
+            _mm_store_ps(buffer + i,      _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(low, zero)), max));
+            _mm_store_ps(buffer + i + 4,  _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(low, zero)), max));
+            _mm_store_ps(buffer + i + 8,  _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(high, zero)), max));
+            _mm_store_ps(buffer + i + 12, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(high, zero)), max));
+        }
+#endif
+
+        for(; i < n*4; i++)
+            buffer[i] = in[i] / 255.0f;
+
+        convertFloat<Op>(buffer, out + (size_t)start*Op::size, n);
+    }
+}
+
+} // namespace
+
+void PixelConverter::thresholdAlpha(uchar* rgba, size_t count, int alphaThreshold, uint background)
+{
+    background &= 0xffffff;
+    size_t i = 0;
+
+#ifdef PIXELCONVERTER_SSE2
+    const auto threshold = _mm_set1_epi32(alphaThreshold);
+    const auto backgroundLanes = _mm_set1_epi32(background);
+    const auto opaque = _mm_set1_epi32(0xff000000);
+    for(; i + 4 <= count; i += 4)
+    {
+        auto* ptr = (__m128i*)(rgba + i*4);
+        const auto x = _mm_loadu_si128(ptr);
+        const auto transparent = _mm_cmplt_epi32(_mm_srli_epi32(x, 24), threshold);
+        _mm_storeu_si128(ptr, _mm_or_si128(_mm_and_si128(transparent, backgroundLanes),
+                                           _mm_andnot_si128(transparent, _mm_or_si128(x, opaque))));
+    }
+#endif
+
+    for(; i < count; i++)
+    {
+        uchar* p = rgba + i*4;
+        uint pixel = p[0] | (p[1] << 8) | (p[2] << 16) | 0xff000000;
+
+        if (p[3] < alphaThreshold)
+            pixel = background;
+
+        for(int c = 0; c < 4; c++)
+            p[c] = pixel >> (c*8);
+    }
+}
+
+PixelConverter::Kernel PixelConverter::getKernel(SpraymakerModel::ImageFormat format)
+{
+    // Reference: https://learn.microsoft.com/en-us/windows/uwp/gaming/complete-code-for-ddstextureloader
+    // The "X" formats don't set bits to 1, but this probably doesn't matter?
+    switch(format)
+    {
+    case SpraymakerModel::ImageFormat::RGBA8888:          return convert<Identity, 4>;
+    case SpraymakerModel::ImageFormat::RGB888:            return convert<Identity, 3>;
+    case SpraymakerModel::ImageFormat::BGRA8888:
+    case SpraymakerModel::ImageFormat::BGRX8888:          return convert<SwapRB, 4>;
+    case SpraymakerModel::ImageFormat::BGR888:            return convert<SwapRB, 3>;
+    case SpraymakerModel::ImageFormat::ABGR8888:          return convert<Reverse, 4>;
+    case SpraymakerModel::ImageFormat::A8:                return convert<Alpha, 1>;
+    case SpraymakerModel::ImageFormat::I8:                return convert<Luma, 1>;
+    case SpraymakerModel::ImageFormat::IA88:              return convert<LumaAlpha, 2>;
+    // TODO: Even with max alpha the textures are slightly transparent
+    // Is that a bug, or just how this texture works with sprays?
+    case SpraymakerModel::ImageFormat::BGRA4444:          return convert<PackBGRA4444, 2>;
+    case SpraymakerModel::ImageFormat::BGRA5551:
+    case SpraymakerModel::ImageFormat::BGRX5551:          return convert<PackBGRA5551, 2>;
+    case SpraymakerModel::ImageFormat::BGR565:            return convert<PackBGR565, 2>;
+    // Note: not supported in TF2, other engines?
+    case SpraymakerModel::ImageFormat::RGB565:            return convert<PackRGB565, 2>;
+    case SpraymakerModel::ImageFormat::BGR888_BLUESCREEN: return convert<Bluescreen<true>, 3>;
+    // TF2: Not supported.
+    case SpraymakerModel::ImageFormat::RGB888_BLUESCREEN: return convert<Bluescreen<false>, 3>;
+    // TODO: This is probably wrong
+    // Note: In sprays blue is always max with this format
+    case SpraymakerModel::ImageFormat::UV88:              return convert<SignedNormal<2>, 2>;
+    // TODO: This is probably wrong
+    case SpraymakerModel::ImageFormat::UVWQ8888:
+    case SpraymakerModel::ImageFormat::UVLX8888:          return convert<SignedNormal<4>, 4>;
+    // c*257 is exactly what the float kernel makes of 8-bit input
+    case SpraymakerModel::ImageFormat::RGBA16161616:      return convert<Identity, 8>;
+    case SpraymakerModel::ImageFormat::RGBA16161616F:     return widenToFloat<HalfRGBA>;
+    case SpraymakerModel::ImageFormat::R32F:              return widenToFloat<FloatR>;
+    case SpraymakerModel::ImageFormat::RGB323232F:        return widenToFloat<FloatRGB>;
+    case SpraymakerModel::ImageFormat::RGBA32323232F:     return widenToFloat<FloatRGBA>;
+    default:
+        return nullptr;
+    }
+}
+
+PixelConverter::FloatKernel PixelConverter::getFloatKernel(SpraymakerModel::ImageFormat format)
+{
+    switch(format)
+    {
+    case SpraymakerModel::ImageFormat::RGBA16161616:      return convertFloat<UShortRGBA>;
+    case SpraymakerModel::ImageFormat::RGBA16161616F:
+    {
+#ifdef PIXELCONVERTER_F16C
+        static const bool f16c = hasF16c();
+        if (f16c)
+            return convertHalfF16c;
+#endif
+        return convertFloat<HalfRGBA>;
+    }
+    // The one channel is red
+    case SpraymakerModel::ImageFormat::R32F:              return convertFloat<FloatR>;
+    case SpraymakerModel::ImageFormat::RGB323232F:        return convertFloat<FloatRGB>;
+    case SpraymakerModel::ImageFormat::RGBA32323232F:     return convertFloat<FloatRGBA>;
+    default:
+        return nullptr;
+    }
+}
@@ -0,0 +1,34 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIXELCONVERTER_H
+#define PIXELCONVERTER_H
+
+#include "spraymakermodel.h"
+
+// ========== PixelConverter ==========
+
+// RGBA8888 -> uncompressed VTF format kernels, SSE2 where available with a scalar fallback
+class PixelConverter
+{
+public:
+    using Kernel = void (*)(const uchar* rgba, uchar* out, int count, int alphaThreshold);
+    // Float RGBA, 0-1 for the range RGBA8888 covers
+    using FloatKernel = void (*)(const float* rgba, uchar* out, int count);
+
+    // nullptr for formats without a kernel
+    static Kernel getKernel(SpraymakerModel::ImageFormat format);
+    // Only the formats with more than 8 bits per channel, nullptr for every other format.
+    // Half floats use F16C when the CPU has it.
+    static FloatKernel getFloatKernel(SpraymakerModel::ImageFormat format);
+
+    // In place: pixels with alpha below the threshold become the background colour with
+    // zero alpha, every other pixel becomes opaque. background is 0x00BBGGRR.
+    static void thresholdAlpha(uchar* rgba, size_t count, int alphaThreshold, uint background);
+};
+
+#endif // PIXELCONVERTER_H
@@ -0,0 +1,30 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "rawencoder.h"
+#include "imagehelper.h"
+
+RawEncoder::RawEncoder(SpraymakerModel::ImageFormat format, int alphaThreshold)
+    : format(format)
+    , alphaThreshold(alphaThreshold)
+{}
+
+bool RawEncoder::supports(SpraymakerModel::ImageFormat format) const
+{
+    return format == this->format && ImageHelper::isDxt(format) == false;
+}
+
+bool RawEncoder::encode(const uchar* pixels, int width, int height, uchar* output, size_t size) const
+{
+    const size_t bytesPerPixel = ImageHelper::getImageDataSize(format, 1, 1, 1, 1);
+    if (bytesPerPixel == 0)
+        return true;
+
+    const int count = std::min((size_t)width*height, size / bytesPerPixel);
+    ImageHelper::convertPixelFormat(pixels, output, count, format, alphaThreshold);
+    return true;
+}
@@ -0,0 +1,29 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RAWENCODER_H
+#define RAWENCODER_H
+
+#include "imageencoder.h"
+
+// ========== RawEncoder ==========
+
+// Uncompressed formats, converted in a single pass from the rendered RGBA8888 pixels
+class RawEncoder : public ImageEncoder
+{
+public:
+    RawEncoder(SpraymakerModel::ImageFormat format, int alphaThreshold);
+
+    bool supports(SpraymakerModel::ImageFormat format) const override;
+    bool encode(const uchar* pixels, int width, int height, uchar* output, size_t size) const override;
+
+private:
+    SpraymakerModel::ImageFormat format;
+    int alphaThreshold;
+};
+
+#endif // RAWENCODER_H
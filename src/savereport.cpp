@@ -0,0 +1,116 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "savereport.h"
+#include "spraymakerexception.h"
+
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QMetaEnum>
+#include <QSaveFile>
+
+SaveReport::SaveReport(QString sprayName, const SprayEncoder::Parameters& parameters,
+                       const std::vector<SprayEncoder::Cell>& cells, const SprayEncoder::Result& result)
+    : wallSeconds(result.wallSeconds)
+{
+    summary = QJsonObject{
+        { "spray",          sprayName },
+        { "format",         QMetaEnum::fromType<SpraymakerModel::ImageFormat>().valueToKey((int)parameters.format) },
+        { "encoder",        QMetaEnum::fromType<SpraymakerModel::EncoderBackend>().valueToKey((int)parameters.encoderBackend) },
+        { "width",          parameters.width },
+        { "height",         parameters.height },
+        { "mipmaps",        parameters.mipmaps },
+        { "frames",         parameters.frames },
+        { "file_size",      (qint64)result.fileSize },
+        { "cells",          result.cells },
+        { "cells_cached",   result.cellsCached },
+        { "cells_repeated", result.cellsReused },
+        { "blocks_reused",  result.blocksReused },
+    };
+
+    for(int stage = 0; stage < (int)SprayEncoder::Stage::_COUNT; stage++)
+        stages.emplace_back(SprayEncoder::getStageName((SprayEncoder::Stage)stage), result.stages[stage]);
+
+    for(int index = 0; index < cells.size() && index < result.cellStats.size(); index++)
+    {
+        const auto& cell = cells[index];
+        const auto& stats = result.cellStats[index];
+
+        // Only the stages the cell went through
+        QJsonObject cellStages;
+        for(int stage = 0; stage < (int)SprayEncoder::Stage::_COUNT; stage++)
+        {
+            if (stats.stages[stage].seconds > 0)
+                cellStages[SprayEncoder::getStageName((SprayEncoder::Stage)stage)] = toJson(stats.stages[stage]);
+        }
+
+        cellReports.append(QJsonObject{
+            { "mipmap", cell.mipmap },
+            { "frame",  cell.frame },
+            { "width",  cell.width },
+            { "height", cell.height },
+            { "source", stats.repeated ? "repeated" : stats.cached ? "cached" : "encoded" },
+            { "stages", cellStages },
+        });
+    }
+}
+
+void SaveReport::addStage(QString name, const SprayEncoder::StageTime& time)
+{ stages.emplace_back(name, time); }
+
+void SaveReport::addWallSeconds(double seconds)
+{ wallSeconds += seconds; }
+
+QJsonObject SaveReport::toJson() const
+{
+    auto report = summary;
+
+    double cpuSeconds = 0;
+    QJsonArray stageArray;
+    for(const auto& [name, time] : stages)
+    {
+        auto stage = toJson(time);
+        stage["name"] = name;
+        stageArray.append(stage);
+        cpuSeconds += time.cpuSeconds;
+    }
+
+    report["wall_seconds"] = wallSeconds;
+    report["cpu_seconds"] = cpuSeconds;
+    report["stages"] = stageArray;
+    report["cell_reports"] = cellReports;
+    return report;
+}
+
+QString SaveReport::getFilePath(QString vtfFilePath)
+{
+    const QFileInfo info(vtfFilePath);
+    return info.path() + "/" + info.completeBaseName() + ".report.json";
+}
+
+void SaveReport::write(QString filePath) const
+{
+    QSaveFile file(filePath);
+    if (file.open(QIODevice::WriteOnly) == false)
+        throw SpraymakerException(QObject::tr("Failed to open %1").arg(filePath), file.errorString());
+
+    file.write(QJsonDocument(toJson()).toJson(QJsonDocument::Indented));
+
+    if (file.commit() == false)
+        throw SpraymakerException(QObject::tr("Failed to write %1").arg(filePath), file.errorString());
+}
+
+QJsonObject SaveReport::toJson(const SprayEncoder::StageTime& time)
+{
+    return QJsonObject{
+        { "wall_seconds",  time.seconds },
+        { "cpu_seconds",   time.cpuSeconds },
+        { "pixels",        (qint64)time.pixels },
+        { "bytes",         (qint64)time.bytes },
+        { "mb_per_second", time.seconds > 0 ? time.bytes / time.seconds / 1e6 : 0.0 },
+    };
+}
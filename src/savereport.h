@@ -0,0 +1,49 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SAVEREPORT_H
+#define SAVEREPORT_H
+
+#include "sprayencoder.h"
+
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QString>
+
+#include <utility>
+#include <vector>
+
+// ========== SaveReport ==========
+
+// Where the time of one save went, per stage and per (mipmap, frame), as JSON.
+// Stage times are summed over every worker thread, wall_seconds at the top is the save's.
+class SaveReport
+{
+public:
+    SaveReport(QString sprayName, const SprayEncoder::Parameters& parameters,
+               const std::vector<SprayEncoder::Cell>& cells, const SprayEncoder::Result& result);
+
+    // Stages after the encode, like installing into games
+    void addStage(QString name, const SprayEncoder::StageTime& time);
+    void addWallSeconds(double seconds);
+
+    QJsonObject toJson() const;
+
+    // Next to the spray, e.g. ./sprays/name.report.json
+    static QString getFilePath(QString vtfFilePath);
+    void write(QString filePath) const;
+
+private:
+    QJsonObject summary;
+    QJsonArray cellReports;
+    std::vector<std::pair<QString, SprayEncoder::StageTime>> stages;
+    double wallSeconds = 0;
+
+    static QJsonObject toJson(const SprayEncoder::StageTime& time);
+};
+
+#endif // SAVEREPORT_H
@@ -6,7 +6,9 @@
  */
 
 #include "settings.h"
+#include "vtflayout.h"
 #include <QCoreApplication>
+#include <QMetaEnum>
 #include <QSettings>
 #include <crnlib.h>
 
@@ -24,6 +26,38 @@ Settings::Settings()
     useSimpleFormats = settings->value("simple_formats", true).toBool();
     previewResolution = std::clamp(settings->value("preview_resolution", 128).toInt(), 64, 1024);
     alphaThreshold = std::clamp(settings->value("alpha_threshold", 128).toInt(), -1, 256);
+    useEncodeCache = settings->value("encode_cache", true).toBool();
+    encodeCacheSize = std::max(settings->value("encode_cache_size", 1024).toInt(), 0);
+    vtfVersion = std::clamp(settings->value("vtf_version", VtfLayout::minMinorVersion).toInt(),
+                            VtfLayout::minMinorVersion, VtfLayout::maxMinorVersion);
+    vtfCrc = settings->value("vtf_crc", false).toBool();
+
+    // Stored by name so the ini file stays readable
+    bool ok = false;
+    auto encoderBackendEnum = QMetaEnum::fromType<SpraymakerModel::EncoderBackend>();
+    encoderBackend = (SpraymakerModel::EncoderBackend)encoderBackendEnum.keyToValue(
+        settings->value("encoder_backend", "CRNLIB").toString().toUtf8(), &ok);
+    if (ok == false
+        || encoderBackend < SpraymakerModel::EncoderBackend::CRNLIB
+        || encoderBackend > SpraymakerModel::EncoderBackend::_MAX)
+        encoderBackend = SpraymakerModel::EncoderBackend::CRNLIB;
+
+    auto mipmapFilterEnum = QMetaEnum::fromType<SpraymakerModel::MipmapFilter>();
+    mipmapFilter = (SpraymakerModel::MipmapFilter)mipmapFilterEnum.keyToValue(
+        settings->value("mipmap_filter", "SOURCE").toString().toUtf8(), &ok);
+    if (ok == false
+        || mipmapFilter < SpraymakerModel::MipmapFilter::SOURCE
+        || mipmapFilter > SpraymakerModel::MipmapFilter::_MAX)
+        mipmapFilter = SpraymakerModel::MipmapFilter::SOURCE;
+
+    settings->beginGroup("throughput");
+    for(const auto& key : settings->allKeys())
+    {
+        const double pixelsPerSecond = settings->value(key).toDouble();
+        if (pixelsPerSecond > 0)
+            throughputs[key] = pixelsPerSecond;
+    }
+    settings->endGroup();
 
     save();
 }
@@ -41,6 +75,20 @@ void Settings::save()
     settings->setValue("simple_formats", useSimpleFormats);
     settings->setValue("preview_resolution", previewResolution);
     settings->setValue("alpha_threshold", alphaThreshold);
+    settings->setValue("encode_cache", useEncodeCache);
+    settings->setValue("encode_cache_size", encodeCacheSize);
+    settings->setValue("vtf_version", vtfVersion);
+    settings->setValue("vtf_crc", vtfCrc);
+    settings->setValue("encoder_backend",
+                       QMetaEnum::fromType<SpraymakerModel::EncoderBackend>().valueToKey((int)encoderBackend));
+    settings->setValue("mipmap_filter",
+                       QMetaEnum::fromType<SpraymakerModel::MipmapFilter>().valueToKey((int)mipmapFilter));
+
+    settings->beginGroup("throughput");
+    for(auto it = throughputs.cbegin(); it != throughputs.cend(); it++)
+        settings->setValue(it.key(), it.value());
+    settings->endGroup();
+
     settings->sync();
 }
 
@@ -121,3 +169,66 @@ void Settings::setAlphaThreshold(int alphaThreshold)
     this->alphaThreshold = alphaThreshold;
     save();
 }
+
+bool Settings::getUseEncodeCache()
+{ return useEncodeCache; }
+
+void Settings::setUseEncodeCache(bool useEncodeCache)
+{
+    this->useEncodeCache = useEncodeCache;
+    save();
+}
+
+int Settings::getEncodeCacheSize()
+{ return encodeCacheSize; }
+
+void Settings::setEncodeCacheSize(int encodeCacheSize)
+{
+    this->encodeCacheSize = encodeCacheSize;
+    save();
+}
+
+SpraymakerModel::EncoderBackend Settings::getEncoderBackend()
+{ return encoderBackend; }
+
+void Settings::setEncoderBackend(SpraymakerModel::EncoderBackend encoderBackend)
+{
+    this->encoderBackend = encoderBackend;
+    save();
+}
+
+SpraymakerModel::MipmapFilter Settings::getMipmapFilter()
+{ return mipmapFilter; }
+
+void Settings::setMipmapFilter(SpraymakerModel::MipmapFilter mipmapFilter)
+{
+    this->mipmapFilter = mipmapFilter;
+    save();
+}
+
+int Settings::getVtfVersion()
+{ return vtfVersion; }
+
+void Settings::setVtfVersion(int vtfVersion)
+{
+    this->vtfVersion = std::clamp(vtfVersion, VtfLayout::minMinorVersion, VtfLayout::maxMinorVersion);
+    save();
+}
+
+bool Settings::getVtfCrc()
+{ return vtfCrc; }
+
+void Settings::setVtfCrc(bool vtfCrc)
+{
+    this->vtfCrc = vtfCrc;
+    save();
+}
+
+double Settings::getThroughput(QString key)
+{ return throughputs.value(key, 0.0); }
+
+void Settings::setThroughput(QString key, double pixelsPerSecond)
+{
+    throughputs[key] = pixelsPerSecond;
+    save();
+}
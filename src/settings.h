@@ -8,6 +8,9 @@
 #ifndef SETTINGS_H
 #define SETTINGS_H
 
+#include "spraymakermodel.h"
+
+#include <QMap>
 #include <QSettings>
 
 class Settings : public QObject
@@ -24,6 +27,16 @@ public:
     int getPreviewResolution();
     bool getUseSimpleFormats();
     int getAlphaThreshold();
+    bool getUseEncodeCache();
+    int getEncodeCacheSize();
+    SpraymakerModel::EncoderBackend getEncoderBackend();
+    SpraymakerModel::MipmapFilter getMipmapFilter();
+    // Minor version of VTF 7.x written, see SprayEncoder::Parameters::vtfVersion
+    int getVtfVersion();
+    bool getVtfCrc();
+    // Pixels per second per worker thread measured on this machine, 0 if never measured.
+    // See EncodeEstimator for the keys.
+    double getThroughput(QString key);
 
     static void init();
 
@@ -34,6 +47,13 @@ public slots:
     void setUseSimpleFormats(bool simpleFormats);
     void setPreviewResolution(int previewResolution);
     void setAlphaThreshold(int alphaThreshold);
+    void setUseEncodeCache(bool useEncodeCache);
+    void setEncodeCacheSize(int encodeCacheSize);
+    void setEncoderBackend(SpraymakerModel::EncoderBackend encoderBackend);
+    void setMipmapFilter(SpraymakerModel::MipmapFilter mipmapFilter);
+    void setVtfVersion(int vtfVersion);
+    void setVtfCrc(bool vtfCrc);
+    void setThroughput(QString key, double pixelsPerSecond);
     void save();
 
 private:
@@ -45,7 +65,14 @@ private:
     int crnHelperThreads;
     int previewResolution;
     int alphaThreshold;
+    int encodeCacheSize; // MiB
+    int vtfVersion;
+    bool vtfCrc;
     bool useSimpleFormats;
+    bool useEncodeCache;
+    SpraymakerModel::EncoderBackend encoderBackend;
+    SpraymakerModel::MipmapFilter mipmapFilter;
+    QMap<QString, double> throughputs;
 };
 
 #endif // SETTINGS_H
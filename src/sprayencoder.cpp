@@ -0,0 +1,1314 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "sprayencoder.h"
+#include "crnlibencoder.h"
+#include "dxtencoder.h"
+#include "imagedecoder.h"
+#include "rawencoder.h"
+#include "spraymakerexception.h"
+#include "vtfwriter.h"
+
+#include <crnlib.h>
+
+#include <QCryptographicHash>
+
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <thread>
+
+SprayEncoder::SprayEncoder(Parameters parameters)
+    : parameters(parameters)
+    , layout(parameters.vtfVersion, parameters.vtfCrc, parameters.width, parameters.height)
+    , pixelAlphaMode(ImageHelper::PixelAlphaMode::INVALID)
+    , thumbnailWritten(false)
+    , cellsFinished(0)
+    , cellsCached(0)
+    , cellsReused(0)
+    , blocksReused(0)
+    , encodingPercent(0)
+    , cancelled(false)
+{
+    const auto format = parameters.format;
+
+    if(ImageHelper::hasOneBitAlpha(format) || ImageHelper::hasAlpha(format) == false)
+        pixelAlphaMode = ImageHelper::PixelAlphaMode::THRESHOLD;
+
+    if(ImageHelper::hasMultiBitAlpha(format))
+        pixelAlphaMode = ImageHelper::PixelAlphaMode::FULL;
+
+    if(parameters.pixelAlphaMode != ImageHelper::PixelAlphaMode::INVALID)
+        pixelAlphaMode = parameters.pixelAlphaMode;
+
+    // Precompute where every (mipmap, frame) lives in the VTF file so cells can be
+    // encoded in any order.
+    // VTF mipmaps are ordered smallest to largest
+    size_t offset = layout.getImageOffset();
+    for(int mipmap = parameters.mipmaps - 1; mipmap >= 0; mipmap--)
+    {
+        auto mipWidth  = std::max(1, parameters.width  >> mipmap);
+        auto mipHeight = std::max(1, parameters.height >> mipmap);
+        auto size = ImageHelper::getImageDataSize(format, mipWidth, mipHeight, 1, 1);
+
+        for(int frame = 0; frame < parameters.frames; frame++)
+        {
+            cells.push_back(Cell{
+                .mipmap = mipmap,
+                .frame  = frame,
+                .width  = mipWidth,
+                .height = mipHeight,
+                .offset = offset,
+                .size   = size,
+            });
+            offset += size;
+        }
+    }
+
+    temporalReuse = ImageHelper::isDxt(format) && parameters.frames > 1;
+
+    // Cells are ordered smallest mipmap first
+    for(int index = 0; index < cells.size() && layout.getThumbnailSize() > 0; index++)
+    {
+        const auto& cell = cells[index];
+        if (cell.frame == 0
+            && cell.width >= layout.getThumbnailWidth() && cell.height >= layout.getThumbnailHeight())
+        {
+            thumbnailCell = index;
+            break;
+        }
+    }
+
+    cellBoundingBoxes.resize(cells.size());
+    mipmapBoundingBoxes.resize(parameters.mipmaps);
+    mipmapBounded.resize(parameters.mipmaps, false);
+
+    if (parameters.cacheDirectory.isEmpty() == false)
+        cache = std::make_unique<EncodeCache>(parameters.cacheDirectory);
+}
+
+size_t SprayEncoder::getFileSize() const
+{
+    return layout.getImageOffset()
+         + ImageHelper::getImageDataSize(parameters.format,
+                                         parameters.width, parameters.height,
+                                         parameters.mipmaps, parameters.frames);
+}
+
+const std::vector<SprayEncoder::Cell>& SprayEncoder::getCells() const
+{ return cells; }
+
+const VtfLayout& SprayEncoder::getLayout() const
+{ return layout; }
+
+void SprayEncoder::writeHeader(uchar* data, uint32_t crc) const
+{
+    const auto format = parameters.format;
+    const auto mipmaps = parameters.mipmaps;
+    const auto textureSampleMode = parameters.textureSampleMode;
+
+    const auto flags =
+        VTF_FLAGS::CLAMPS | VTF_FLAGS::CLAMPT | VTF_FLAGS::CLAMPU | VTF_FLAGS::NOLOD | VTF_FLAGS::ALL_MIPS
+         | (mipmaps == 1                          ? VTF_FLAGS::NOMIP         : VTF_FLAGS::NONE)
+         | (ImageHelper::hasOneBitAlpha(format)   ? VTF_FLAGS::ONEBITALPHA   : VTF_FLAGS::NONE)
+         | (ImageHelper::hasMultiBitAlpha(format) ? VTF_FLAGS::EIGHTBITALPHA : VTF_FLAGS::NONE)
+         | (mipmaps == 1
+            && textureSampleMode == SpraymakerModel::TextureSampleMode::POINT_SAMPLE
+            ? VTF_FLAGS::POINTSAMPLE : VTF_FLAGS::NONE)
+         | (textureSampleMode == SpraymakerModel::TextureSampleMode::ANISOTROPIC
+            ? VTF_FLAGS::ANISOTROPIC : VTF_FLAGS::NONE)
+         | (textureSampleMode == SpraymakerModel::TextureSampleMode::TRILINEAR
+            ? VTF_FLAGS::TRILINEAR   : VTF_FLAGS::NONE);
+
+    if (layout.getMinorVersion() == 1)
+    {
+        new(data) VTF_HEADER_71
+            {
+            .signature          = {'V', 'T', 'F', 0},
+            .version            = {7, 1},
+            .headerSize         = 64,
+            .width              = (ushort)parameters.width,
+            .height             = (ushort)parameters.height,
+            .flags              = flags,
+            .frames             = (ushort)parameters.frames,
+            .firstFrame         = 0,
+            .padding0           = {'C', 'M', 'C', '3'},
+            .reflectivity       = {0.5, 0.5, 0.5},
+            .padding1           = {'B', 'F', 'F', '!'},
+            .bumpmapScale       = 1.0,
+            .highResImageFormat = parameters.vtfFormat,
+            .mipmapCount        = (uchar)mipmaps,
+            .lowResImageFormat  = VTF_IMAGE_FORMAT::NONE,
+            .lowResImageWidth   = 0,
+            .lowResImageHeight  = 0,
+            .padding2           = 20,
+            };
+        return;
+    }
+
+    const auto resources = layout.getResources(crc);
+
+    new(data) VTF_HEADER_73
+        {
+        .signature          = {'V', 'T', 'F', 0},
+        .version            = {7, (uint32_t)layout.getMinorVersion()},
+        .headerSize         = (uint32_t)layout.getHeaderSize(),
+        .width              = (ushort)parameters.width,
+        .height             = (ushort)parameters.height,
+        .flags              = flags,
+        .frames             = (ushort)parameters.frames,
+        .firstFrame         = 0,
+        .padding0           = {'C', 'M', 'C', '3'},
+        .reflectivity       = {0.5, 0.5, 0.5},
+        .padding1           = {'B', 'F', 'F', '!'},
+        .bumpmapScale       = 1.0,
+        .highResImageFormat = parameters.vtfFormat,
+        .mipmapCount        = (uchar)mipmaps,
+        .lowResImageFormat  = VTF_IMAGE_FORMAT::DXT1,
+        .lowResImageWidth   = (uchar)layout.getThumbnailWidth(),
+        .lowResImageHeight  = (uchar)layout.getThumbnailHeight(),
+        .depth              = 1,
+        .padding2           = {},
+        .resourceCount      = (uint32_t)resources.size(),
+        .padding3           = {},
+        };
+
+    memcpy(data + sizeof(VTF_HEADER_73), resources.data(), resources.size() * sizeof(VTF_RESOURCE));
+}
+
+void SprayEncoder::cancel()
+{ cancelled = true; }
+
+bool SprayEncoder::isCancelled() const
+{ return cancelled; }
+
+SprayEncoder::Result SprayEncoder::encode(uchar* data, ProgressCallback progressCallback)
+{
+    cellsFinished = 0;
+    cellsCached = 0;
+    cellsReused = 0;
+    blocksReused = 0;
+    encodingPercent = 0;
+    cellStats.assign(cells.size(), CellStats());
+    thumbnailWritten = false;
+    const StageTimer timer;
+
+    writeHeader(data);
+
+    // Stage 1: autocrop bounding boxes, which every frame of a mipmap may depend on
+    findBoundingBoxes(progressCallback);
+    findChains();
+    findDuplicates(progressCallback);
+
+    // Every chain runs on its own worker, so split crnlib's helper threads between them
+    // instead of letting each cell spin up the full count.
+    const int workerCount = std::clamp(getThreadCount(), 1, std::max(1, (int)chains.size()));
+    crnHelperThreads = std::min(parameters.crnHelperThreads,
+                                std::max(0, getThreadCount() / workerCount - 1));
+    imageEncoder = createImageEncoder();
+    findJobs(workerCount);
+
+    // Stage 2: crop, resize, and encode every (mipmap, frame) straight into its offset
+    // Every worker renders its cells into the same buffers, sized once for the largest mipmap
+    workers.clear();
+    workers.resize(workerCount);
+    for(auto& worker : workers)
+    {
+        worker.pixels.reserve((size_t)parameters.width * parameters.height * 4);
+        if (parameters.mipmapFilter != SpraymakerModel::MipmapFilter::SOURCE)
+            worker.nextPixels.reserve((size_t)parameters.width * parameters.height);
+        worker.previousFrames.assign(parameters.mipmaps, -1);
+        worker.previousPixels.resize(parameters.mipmaps);
+    }
+
+    cellMetrics.assign(parameters.computeMetrics ? cells.size() : 0, ImageMetrics::Errors());
+
+    runJobs(jobs.size(), [&](int index, int worker){
+        for(int chain = jobs[index].first; chain < jobs[index].second && cancelled == false; chain++)
+        {
+            if (chainDuplicateOf[chain] == -1)
+                encodeChain(chains[chain], data, workers[worker]);
+        }
+    }, progressCallback);
+
+    // Stage 3: duplicates get a copy of what was encoded
+    copyDuplicates(data);
+    finishThumbnail(data);
+
+    // Only known once every cell is in place
+    if (layout.hasCrc() && cancelled == false)
+        writeHeader(data, VtfLayout::crc32(data + layout.getImageOffset(), getFileSize() - layout.getImageOffset()));
+
+    progressCallback(cellsFinished, encodingPercent);
+
+    if (cache && parameters.cacheSizeLimit > 0)
+        cache->prune(parameters.cacheSizeLimit);
+
+    ImageMetrics::Errors metrics;
+    for(const auto& errors : cellMetrics)
+        metrics += errors;
+
+    std::array<StageTime, (int)Stage::_COUNT> stages;
+    for(const auto& stats : cellStats)
+    {
+        for(int stage = 0; stage < (int)Stage::_COUNT; stage++)
+            stages[stage] += stats.stages[stage];
+    }
+
+    return Result{
+        .cancelled   = cancelled,
+        .fileSize    = getFileSize(),
+        .cells       = cellsFinished,
+        .cellsCached = cellsCached,
+        .cellsReused = cellsReused,
+        .blocksReused = blocksReused,
+        .metrics     = metrics,
+        .cellMetrics = cellMetrics,
+        .stages      = stages,
+        .cellStats   = cellStats,
+        .wallSeconds = timer.getWallSeconds(),
+    };
+}
+
+SprayEncoder::Result SprayEncoder::encodeToFile(QString filePath, ProgressCallback progressCallback)
+{
+    // Cells are encoded straight into the mapped file, there's no intermediate buffer
+    StageTimer timer;
+    VtfWriter writer(filePath, getFileSize());
+    const double createSeconds = timer.getWallSeconds();
+    const double createCpuSeconds = timer.getCpuSeconds();
+
+    auto result = encode(writer.data(), progressCallback);
+
+    // An uncommitted writer cleans up after itself, leaving any previous spray untouched
+    if (result.cancelled)
+        return result;
+
+    timer.restart();
+    writer.commit();
+
+    auto& write = result.stages[(int)Stage::WRITE];
+    write.bytes      = result.fileSize;
+    write.seconds    = createSeconds + timer.getWallSeconds();
+    write.cpuSeconds = createCpuSeconds + timer.getCpuSeconds();
+    result.wallSeconds += write.seconds;
+
+    return result;
+}
+
+QString SprayEncoder::getStageName(Stage stage)
+{
+    switch(stage)
+    {
+    case Stage::CROP:    return "crop";
+    case Stage::HASH:    return "hash";
+    case Stage::RESIZE:  return "resize";
+    case Stage::CONVERT: return "convert";
+    case Stage::ENCODE:  return "encode";
+    case Stage::METRICS: return "metrics";
+    case Stage::CACHE:   return "cache";
+    case Stage::WRITE:   return "write";
+    default:             return "";
+    }
+}
+
+SprayEncoder::StageTime& SprayEncoder::StageTime::operator+=(const StageTime& other)
+{
+    pixels     += other.pixels;
+    bytes      += other.bytes;
+    seconds    += other.seconds;
+    cpuSeconds += other.cpuSeconds;
+    return *this;
+}
+
+void SprayEncoder::findBoundingBoxes(ProgressCallback progressCallback)
+{
+    bool boundedAutocrop = false;
+    bool forceBoundedAutocrop = false;
+    bool autocrop = false;
+
+    switch(parameters.autocropMode)
+    {
+    case SpraymakerModel::AutocropMode::BOUNDINGBOX:
+        forceBoundedAutocrop = true;
+    case SpraymakerModel::AutocropMode::AUTOMATIC:
+        boundedAutocrop = true;
+    case SpraymakerModel::AutocropMode::INDIVIDUAL:
+        autocrop = true;
+        break;
+    case SpraymakerModel::AutocropMode::NONE:
+    default:
+        break;
+    }
+
+    if (autocrop == false)
+        return;
+
+    // Cells showing the same source image share one box, so each source is only looked at
+    // once. With MipmapPropagationMode::FILL that's every mipmap of a frame.
+    std::unordered_map<const VipsImage*, int> sourceCells;
+    std::vector<int> sourceCell(cells.size());
+    std::vector<int> uniqueCells;
+    for(int index = 0; index < cells.size(); index++)
+    {
+        const auto& cell = cells[index];
+        const auto [it, inserted] = sourceCells.try_emplace(
+            parameters.images[cell.mipmap][cell.frame].get_image(), index);
+        if (inserted)
+            uniqueCells.push_back(index);
+        sourceCell[index] = it->second;
+    }
+
+    runJobs(uniqueCells.size(), [&](int job, int){
+        const int index = uniqueCells[job];
+        const auto& cell = cells[index];
+
+        // Precomputed projections answer without touching the pixels
+        const auto projections = getEdgeProjections(cell);
+        if (projections)
+        {
+            cellBoundingBoxes[index] = projections->getBorders(pixelAlphaMode, parameters.alphaThreshold);
+            return;
+        }
+
+        // Each job takes its own reference so concurrent evaluation never touches the shared image
+        const StageTimer timer;
+        auto img = parameters.images[cell.mipmap][cell.frame].copy();
+        cellBoundingBoxes[index] = ImageHelper::getImageBorders(img.data(), img.width(), img.height(),
+                                                                pixelAlphaMode, parameters.alphaThreshold);
+        const quint64 pixels = (quint64)img.width() * img.height();
+        addStageTime(cell, Stage::CROP, pixels, pixels * 4, timer);
+    }, progressCallback);
+
+    for(int index = 0; index < cells.size(); index++)
+        cellBoundingBoxes[index] = cellBoundingBoxes[sourceCell[index]];
+
+    if (boundedAutocrop == false)
+        return;
+
+    // ========== Find bounding box for autocropping animations ==========
+    for(int index = 0; index < cells.size(); index++)
+    {
+        const auto& cell = cells[index];
+        const auto& img = parameters.images[cell.mipmap][cell.frame];
+        const auto& firstImg = parameters.images[cell.mipmap][0];
+
+        if (cell.frame == 0)
+        {
+            mipmapBounded[cell.mipmap] = true;
+            mipmapBoundingBoxes[cell.mipmap] = ImageHelper::BoundingBox();
+        }
+
+        if (mipmapBounded[cell.mipmap] == false)
+            continue;
+
+        // Animations with differently sized frames can't share a bounding box
+        if (forceBoundedAutocrop == false
+            && (img.width() != firstImg.width() || img.height() != firstImg.height()))
+        {
+            mipmapBounded[cell.mipmap] = false;
+            continue;
+        }
+
+        mipmapBoundingBoxes[cell.mipmap] += cellBoundingBoxes[index];
+    }
+    // ========== / Find bounding box for autocropping animations ==========
+}
+
+const EdgeProjections* SprayEncoder::getEdgeProjections(const Cell& cell) const
+{
+    if ((size_t)cell.mipmap >= parameters.edgeProjections.size()
+        || (size_t)cell.frame >= parameters.edgeProjections[cell.mipmap].size())
+        return nullptr;
+
+    const auto& projections = parameters.edgeProjections[cell.mipmap][cell.frame];
+    const auto& img = parameters.images[cell.mipmap][cell.frame];
+
+    // Stale if the image was replaced without rebuilding them
+    if (projections == nullptr
+        || projections->getWidth() != (uint)img.width()
+        || projections->getHeight() != (uint)img.height())
+        return nullptr;
+
+    return projections.get();
+}
+
+const vips::VImage* SprayEncoder::getNativeImage(const Cell& cell) const
+{
+    // Only formats which can store more than 8 bits per channel are rendered from them
+    if (ImageHelper::isHighBitDepth(parameters.format) == false
+        || (size_t)cell.mipmap >= parameters.nativeImages.size()
+        || (size_t)cell.frame >= parameters.nativeImages[cell.mipmap].size())
+        return nullptr;
+
+    const auto& native = parameters.nativeImages[cell.mipmap][cell.frame];
+    const auto& img = parameters.images[cell.mipmap][cell.frame];
+
+    // Crop boxes are found on the 8-bit image, they have to be the same size
+    if (native.is_null() || native.width() != img.width() || native.height() != img.height())
+        return nullptr;
+
+    return &native;
+}
+
+const ImageHelper::BoundingBox* SprayEncoder::getCropBox(const Cell& cell) const
+{
+    if (mipmapBounded[cell.mipmap])
+        return &mipmapBoundingBoxes[cell.mipmap];
+
+    if (parameters.autocropMode != SpraymakerModel::AutocropMode::NONE)
+        return &cellBoundingBoxes[&cell - cells.data()];
+
+    return nullptr;
+}
+
+void SprayEncoder::findChains()
+{
+    chains.clear();
+    cellResampledFrom.assign(cells.size(), -1);
+
+    if (parameters.mipmapFilter == SpraymakerModel::MipmapFilter::SOURCE)
+    {
+        for(int index = 0; index < cells.size(); index++)
+            chains.push_back({index});
+        return;
+    }
+
+    // Cells are ordered smallest mipmap first, frame by frame
+    auto cellIndex = [this](int mipmap, int frame){
+        return (parameters.mipmaps - 1 - mipmap) * parameters.frames + frame;
+    };
+
+    for(int frame = 0; frame < parameters.frames; frame++)
+    {
+        for(int mipmap = 0; mipmap < parameters.mipmaps; mipmap++)
+        {
+            const int index = cellIndex(mipmap, frame);
+            if (mipmap > 0 && canResample(cells[cellIndex(mipmap - 1, frame)], cells[index]))
+            {
+                const int parent = cellIndex(mipmap - 1, frame);
+                chains.back().push_back(index);
+                cellResampledFrom[index] = cellResampledFrom[parent] == -1 ? mipmap - 1 : cellResampledFrom[parent];
+            }
+            else
+                chains.push_back({index});
+        }
+    }
+}
+
+void SprayEncoder::findDuplicates(ProgressCallback progressCallback)
+{
+    // Hashing the sources is the slow part, and getSourceHash() only does each image once
+    cellKeys.assign(cells.size(), QByteArray());
+    runJobs(cells.size(), [&](int index, int){
+        cellKeys[index] = getCacheKey(cells[index]);
+    }, progressCallback);
+
+    // Holds in GIFs and videos are repeated frames, which are the same after resizing too.
+    // Chains are compared as a whole, since every link after the first depends on the one before.
+    cellDuplicateOf.assign(cells.size(), -1);
+    chainDuplicateOf.assign(chains.size(), -1);
+
+    std::map<QByteArray, int> firstChains;
+    for(int chain = 0; chain < chains.size(); chain++)
+    {
+        QByteArray key;
+        for(const int index : chains[chain])
+            key += cellKeys[index];
+
+        const auto [it, inserted] = firstChains.try_emplace(key, chain);
+        if (inserted)
+            continue;
+
+        chainDuplicateOf[chain] = it->second;
+        for(int link = 0; link < chains[chain].size(); link++)
+            cellDuplicateOf[chains[chain][link]] = chains[it->second][link];
+    }
+}
+
+void SprayEncoder::findJobs(int workerCount)
+{
+    jobs.clear();
+
+    if (temporalReuse == false)
+    {
+        for(int chain = 0; chain < chains.size(); chain++)
+        {
+            if (chainDuplicateOf[chain] == -1)
+                jobs.push_back({chain, chain + 1});
+        }
+        return;
+    }
+
+    // A worker can only reuse blocks of frames it encoded itself, so every worker gets one
+    // run of consecutive chains with about the same number of pixels
+    auto chainPixels = [this](int chain){
+        quint64 pixels = 0;
+        if (chainDuplicateOf[chain] != -1)
+            return pixels;
+
+        for(const int index : chains[chain])
+            pixels += (quint64)cells[index].width * cells[index].height;
+        return pixels;
+    };
+
+    quint64 totalPixels = 0;
+    for(int chain = 0; chain < chains.size(); chain++)
+        totalPixels += chainPixels(chain);
+
+    quint64 pixels = 0;
+    int first = 0;
+    for(int chain = 0; chain < chains.size(); chain++)
+    {
+        pixels += chainPixels(chain);
+        if (pixels * workerCount >= totalPixels * (jobs.size() + 1) || chain + 1 == chains.size())
+        {
+            jobs.push_back({first, chain + 1});
+            first = chain + 1;
+        }
+    }
+}
+
+bool SprayEncoder::canResample(const Cell& parent, const Cell& cell) const
+{
+    // Chains resample RGBA8888, which would throw away the extra bits
+    if (ImageHelper::isHighBitDepth(parameters.format))
+        return false;
+
+    // Custom images per mipmap keep being rendered from their own source
+    if (parameters.images[parent.mipmap][parent.frame].get_image()
+        != parameters.images[cell.mipmap][cell.frame].get_image())
+        return false;
+
+    const auto parentBox = getCropBox(parent);
+    const auto cellBox = getCropBox(cell);
+    if ((parentBox == nullptr) != (cellBox == nullptr))
+        return false;
+
+    if (parentBox && (parentBox->left  != cellBox->left  || parentBox->top    != cellBox->top
+                   || parentBox->width != cellBox->width || parentBox->height != cellBox->height))
+        return false;
+
+    return cell.width  == std::max(1, parent.width  / 2)
+        && cell.height == std::max(1, parent.height / 2);
+}
+
+double SprayEncoder::getEightBitScale(const vips::VImage& img)
+{
+    switch (img.format())
+    {
+    case VIPS_FORMAT_USHORT:
+        return 257;
+    case VIPS_FORMAT_FLOAT:
+        return 1.0 / 255;
+    default:
+        return 1;
+    }
+}
+
+vips::VImage SprayEncoder::getCellImage(const Cell& cell) const
+{
+    // 16-bit or float when the format and source have more than 8 bits per channel, background is given for 8
+    const auto native = getNativeImage(cell);
+    auto img = (native ? *native : parameters.images[cell.mipmap][cell.frame]).copy();
+    const double scale = getEightBitScale(img);
+
+    // Apply appropriate autocrop method
+    if (const auto bb = getCropBox(cell))
+        img = img.crop(bb->left, bb->top, bb->width, bb->height);
+
+    // Should the user be able to set scale mode between fit, fill, stretch, none?
+    // TODO: Proper scale method for pixel art
+    if (img.format() == VIPS_FORMAT_FLOAT)
+    {
+        // thumbnail_image would convert scRGB to 8-bit sRGB, so float is fitted the same way by hand
+        const double factor = std::min((double)cell.width / img.width(), (double)cell.height / img.height());
+        img = img.premultiply(vips::VImage::option()->set("max_alpha", 1.0))
+                  .resize(factor, vips::VImage::option()->set("kernel", VIPS_KERNEL_LANCZOS3))
+                  .unpremultiply(vips::VImage::option()->set("max_alpha", 1.0));
+    }
+    else
+    {
+        img = img.thumbnail_image(cell.width,
+                                  vips::VImage::option()
+                                      ->set("height", cell.height)
+                                      ->set("size", VipsSize::VIPS_SIZE_BOTH));
+    }
+
+    return img.gravity(VipsCompassDirection::VIPS_COMPASS_DIRECTION_CENTRE,
+                       cell.width, cell.height,
+                       vips::VImage::option()
+                           ->set("background", std::vector<double>{
+                                                   parameters.backgroundRed * scale,
+                                                   parameters.backgroundGreen * scale,
+                                                   parameters.backgroundBlue * scale,
+                                                   parameters.backgroundAlpha * scale,
+                                               })
+                           ->set("extend", VIPS_EXTEND_BACKGROUND));
+}
+
+vips::VImage SprayEncoder::flattenAlpha(vips::VImage img) const
+{
+    // Same result as ImageHelper::applyAlphaThreshold: below the threshold becomes the
+    // background with zero alpha, everything else becomes opaque.
+    // Every value is given for 8 bits, and scaled for 16-bit and float images.
+    const double scale = getEightBitScale(img);
+    const auto transparent = img.extract_band(3) < parameters.alphaThreshold * scale;
+    const auto opaque = img.extract_band(0, vips::VImage::option()->set("n", 3)).bandjoin(255 * scale);
+
+    return transparent.ifthenelse(std::vector<double>{
+                                      parameters.backgroundRed * scale,
+                                      parameters.backgroundGreen * scale,
+                                      parameters.backgroundBlue * scale,
+                                      0.0,
+                                  }, opaque)
+        .cast(img.format());
+}
+
+void SprayEncoder::resampleCell(const Cell& parent, const std::vector<uchar>& parentPixels,
+                                const Cell& cell, std::vector<uchar>& pixels) const
+{
+    pixels.resize((size_t)cell.width * cell.height * 4);
+
+    if (parameters.mipmapFilter == SpraymakerModel::MipmapFilter::BOX)
+    {
+        ImageHelper::halveImage(parentPixels.data(), parent.width, parent.height, pixels.data());
+        return;
+    }
+
+    // Premultiplied like thumbnail_image, so transparent pixels don't bleed
+    auto img = vips::VImage::new_from_memory((void*)parentPixels.data(), parentPixels.size(),
+                                             parent.width, parent.height, 4, VIPS_FORMAT_UCHAR);
+    img = img.premultiply()
+              .resize((double)cell.width / parent.width,
+                      vips::VImage::option()
+                          ->set("vscale", (double)cell.height / parent.height)
+                          ->set("kernel", VIPS_KERNEL_LANCZOS3))
+              .unpremultiply()
+              .cast(VIPS_FORMAT_UCHAR);
+    img.write(vips::VImage::new_from_memory(pixels.data(), pixels.size(),
+                                            cell.width, cell.height, 4, VIPS_FORMAT_UCHAR));
+}
+
+void SprayEncoder::encodeCell(const Cell& cell, uchar* data, Worker& worker)
+{
+    const auto format = parameters.format;
+    const auto mipWidth = cell.width;
+    const auto mipHeight = cell.height;
+
+    if (loadCached(cell, data))
+        return;
+
+    // Crop, resize, pad and flatten are one vips graph, evaluated once straight into
+    // the output or the worker's buffer
+    const StageTimer timer;
+    const quint64 pixelCount = (quint64)mipWidth * mipHeight;
+    auto img = getCellImage(cell);
+    const bool fixTransparency = ImageHelper::hasOneBitAlpha(format) || ImageHelper::hasAlpha(format) == false;
+    if (fixTransparency)
+        img = flattenAlpha(img);
+
+    uchar* pos = data + cell.offset;
+
+    // Formats with more than 8 bits per channel are rendered as floats, from the 16-bit or float
+    // source where there is one, and converted straight into the output. Float sources aren't clipped.
+    if (ImageHelper::isHighBitDepth(format))
+    {
+        auto& floats = worker.floatPixels;
+        floats.resize(pixelCount * 4);
+        img.linear(1.0 / (255 * getEightBitScale(img)), 0.0)
+            .write(vips::VImage::new_from_memory(floats.data(), floats.size() * sizeof(float),
+                                                 mipWidth, mipHeight, 4, VIPS_FORMAT_FLOAT));
+        addStageTime(cell, Stage::RESIZE, pixelCount, pixelCount * 4 * sizeof(float), timer);
+
+        const StageTimer convertTimer;
+        ImageHelper::convertFloatPixelFormat(floats.data(), pos, (int)pixelCount, format);
+        addStageTime(cell, Stage::CONVERT, pixelCount, cell.size, convertTimer);
+
+        storeCached(cell, data);
+        return;
+    }
+
+    // Formats which are only a selection of vips' RGBA bytes are rendered straight into the output,
+    // unless the metrics need the pixels
+    std::vector<int> bands;
+    if (parameters.computeMetrics == false && ImageHelper::getBandOrder(format, bands))
+    {
+        auto out = img;
+        if (bands != std::vector<int>{0, 1, 2, 3})
+        {
+            out = img.extract_band(bands[0]);
+            for(int band = 1; band < bands.size(); band++)
+                out = out.bandjoin(img.extract_band(bands[band]));
+        }
+
+        out.write(vips::VImage::new_from_memory(pos, cell.size, mipWidth, mipHeight, bands.size(), VIPS_FORMAT_UCHAR));
+        addStageTime(cell, Stage::RESIZE, pixelCount, pixelCount * 4, timer);
+
+        storeCached(cell, data);
+        return;
+    }
+
+    // Render into the worker's buffer instead of a fresh allocation per cell
+    auto& pixels = worker.pixels;
+    pixels.resize((size_t)mipWidth * mipHeight * 4);
+    img.write(vips::VImage::new_from_memory(pixels.data(), pixels.size(),
+                                            mipWidth, mipHeight, 4, VIPS_FORMAT_UCHAR));
+    addStageTime(cell, Stage::RESIZE, pixelCount, pixelCount * 4, timer);
+
+    // ========== Encoding ==========
+    if (encodeImage(cell, pixels.data(), data, worker) == false)
+        return; // Cancelled
+    // ========== / Encoding ==========
+
+    storeCached(cell, data);
+}
+
+void SprayEncoder::encodeChain(const std::vector<int>& chain, uchar* data, Worker& worker)
+{
+    if (chain.size() == 1)
+    {
+        encodeCell(cells[chain.front()], data, worker);
+        if (cancelled == false)
+            cellsFinished++;
+        return;
+    }
+
+    // Cached cells are loaded up front, the chain only has to be rendered as far as
+    // the last cell that wasn't
+    std::vector<bool> cached(chain.size(), false);
+    int rendered = 0;
+    for(int link = 0; link < chain.size(); link++)
+    {
+        cached[link] = loadCached(cells[chain[link]], data);
+
+        if (cached[link])
+            cellsFinished++;
+        else
+            rendered = link + 1;
+    }
+
+    auto* current = &worker.pixels;
+    auto* next = &worker.nextPixels;
+    for(int link = 0; link < rendered && cancelled == false; link++)
+    {
+        const auto& cell = cells[chain[link]];
+
+        // Only the first cell of a chain comes from the source
+        if (link == 0)
+        {
+            const StageTimer timer;
+            const quint64 pixelCount = (quint64)cell.width * cell.height;
+            current->resize(pixelCount * 4);
+            getCellImage(cell).write(vips::VImage::new_from_memory(current->data(), current->size(),
+                                                                   cell.width, cell.height, 4, VIPS_FORMAT_UCHAR));
+            addStageTime(cell, Stage::RESIZE, pixelCount, pixelCount * 4, timer);
+        }
+
+        // Resampled before this cell's transparency is flattened
+        if (link + 1 < rendered)
+        {
+            const auto& nextCell = cells[chain[link + 1]];
+            const StageTimer timer;
+            const quint64 pixelCount = (quint64)nextCell.width * nextCell.height;
+            resampleCell(cell, *current, nextCell, *next);
+            addStageTime(nextCell, Stage::RESIZE, pixelCount, pixelCount * 4, timer);
+        }
+
+        if (cached[link] == false)
+        {
+            if (encodePixels(cell, data, *current, worker) == false)
+                return; // Cancelled
+
+            storeCached(cell, data);
+            cellsFinished++;
+        }
+
+        std::swap(current, next);
+    }
+}
+
+bool SprayEncoder::encodePixels(const Cell& cell, uchar* data, std::vector<uchar>& pixels, Worker& worker)
+{
+    const auto format = parameters.format;
+
+    // ========== Fix transparency for 1-bit and nonalpha targets ==========
+    // Chains resample from unflattened pixels, so they can't use flattenAlpha() and
+    // flatten each buffer in place instead, while it is still in cache
+    if (ImageHelper::hasOneBitAlpha(format) || ImageHelper::hasAlpha(format) == false)
+    {
+        ImageHelper::applyAlphaThreshold(pixels.data(), (size_t)cell.width * cell.height,
+                                         parameters.alphaThreshold,
+                                         parameters.backgroundRed,
+                                         parameters.backgroundGreen,
+                                         parameters.backgroundBlue);
+    }
+    // ========== / Fix transparency for 1-bit and nonalpha targets ==========
+
+    // ========== Encoding ==========
+    return encodeImage(cell, pixels.data(), data, worker);
+    // ========== / Encoding ==========
+}
+
+bool SprayEncoder::encodeImage(const Cell& cell, const uchar* pixels, uchar* data, Worker& worker)
+{
+    // Made from the pixels while they're here, instead of another pass over the source
+    if (&cell - cells.data() == thumbnailCell)
+        writeThumbnail(cell, pixels, data);
+
+    bool encoded = false;
+    if (temporalReuse == false)
+        encoded = runImageEncoder(cell, pixels, cell.width, cell.height, data + cell.offset, cell.size);
+    else
+    {
+        // Cells are ordered frame by frame within a mipmap. A duplicated previous frame is only
+        // copied at the end, but the frame it duplicates has the same data.
+        const Cell* previousCell = nullptr;
+        if (cell.frame > 0)
+        {
+            const int previous = &cell - cells.data() - 1;
+            previousCell = &cells[cellDuplicateOf[previous] == -1 ? previous : cellDuplicateOf[previous]];
+        }
+
+        // The previous frame's data is only complete if this worker encoded it
+        encoded = previousCell
+               && previousCell->mipmap == cell.mipmap
+               && worker.previousFrames[cell.mipmap] == previousCell->frame
+            ? encodeChangedBlocks(cell, *previousCell, pixels, data, worker)
+            : runImageEncoder(cell, pixels, cell.width, cell.height, data + cell.offset, cell.size);
+
+        worker.previousFrames[cell.mipmap] = encoded ? cell.frame : -1;
+        if (encoded)
+            worker.previousPixels[cell.mipmap].assign(pixels, pixels + (size_t)cell.width * cell.height * 4);
+    }
+
+    if (encoded && parameters.computeMetrics)
+    {
+        const StageTimer timer;
+        const quint64 pixelCount = (quint64)cell.width * cell.height;
+        measureCell(cell, pixels, data, worker);
+        addStageTime(cell, Stage::METRICS, pixelCount, pixelCount * 4, timer);
+    }
+
+    return encoded;
+}
+
+void SprayEncoder::measureCell(const Cell& cell, const uchar* pixels, const uchar* data, Worker& worker)
+{
+    if (ImageDecoder::canDecode(parameters.format) == false)
+        return;
+
+    // Against the pixels as they were handed to the encoder, after transparency was fixed
+    auto& decoded = worker.decoded;
+    decoded.resize((size_t)cell.width * cell.height * 4);
+    if (ImageDecoder::decode(parameters.format, data + cell.offset, cell.width, cell.height, decoded.data()) == false)
+        return;
+
+    // Formats without alpha decode as opaque, score them on the pixels which are drawn
+    if (ImageHelper::hasAlpha(parameters.format) == false)
+    {
+        for(size_t i = 3; i < decoded.size(); i += 4)
+            decoded[i] = pixels[i];
+    }
+
+    cellMetrics[&cell - cells.data()] = ImageMetrics::compare(pixels, decoded.data(), cell.width, cell.height);
+}
+
+bool SprayEncoder::encodeChangedBlocks(const Cell& cell, const Cell& previousCell,
+                                       const uchar* pixels, uchar* data, Worker& worker)
+{
+    const int blocksWide = (cell.width + 3) / 4;
+    const int blocksHigh = (cell.height + 3) / 4;
+    const int blockCount = blocksWide * blocksHigh;
+    const size_t blockSize = cell.size / blockCount;
+
+    const uchar* previousPixels = worker.previousPixels[cell.mipmap].data();
+    const uchar* previousData = data + previousCell.offset;
+    uchar* output = data + cell.offset;
+
+    // ========== Copy unchanged blocks ==========
+    auto& changed = worker.changedBlocks;
+    changed.clear();
+
+    for(int block = 0; block < blockCount; block++)
+    {
+        const int x = (block % blocksWide) * 4;
+        const int y = (block / blocksWide) * 4;
+        const size_t rowSize = std::min(4, cell.width - x) * 4;
+
+        bool same = true;
+        for(int row = y; row < std::min(y + 4, cell.height) && same; row++)
+        {
+            const size_t offset = ((size_t)row * cell.width + x) * 4;
+            same = std::memcmp(pixels + offset, previousPixels + offset, rowSize) == 0;
+        }
+
+        if (same)
+            std::memcpy(output + block*blockSize, previousData + block*blockSize, blockSize);
+        else
+            changed.push_back(block);
+    }
+
+    blocksReused += blockCount - (int)changed.size();
+
+    if (changed.empty())
+        return true;
+
+    if ((int)changed.size() == blockCount)
+        return runImageEncoder(cell, pixels, cell.width, cell.height, output, cell.size);
+    // ========== / Copy unchanged blocks ==========
+
+    // ========== Encode changed blocks ==========
+    // Side by side in rows of up to 64 blocks. Blocks crossing the image's edge are padded
+    // by repeating the edge, like the encoders do, and spare slots repeat the last block.
+    const int columns = std::min<int>(changed.size(), 64);
+    const int rows = (changed.size() + columns - 1) / columns;
+    const int stripWidth = columns * 4;
+    const int stripHeight = rows * 4;
+
+    auto& strip = worker.changedPixels;
+    strip.resize((size_t)stripWidth * stripHeight * 4);
+
+    for(int slot = 0; slot < columns * rows; slot++)
+    {
+        const int block = changed[std::min<size_t>(slot, changed.size() - 1)];
+        const int x = (block % blocksWide) * 4;
+        const int y = (block / blocksWide) * 4;
+        uchar* dst = strip.data() + ((size_t)(slot / columns) * 4 * stripWidth + (slot % columns) * 4) * 4;
+
+        for(int row = 0; row < 4; row++)
+        {
+            const int sy = std::min(y + row, cell.height - 1);
+            for(int column = 0; column < 4; column++)
+            {
+                const int sx = std::min(x + column, cell.width - 1);
+                std::memcpy(dst + ((size_t)row * stripWidth + column) * 4,
+                            pixels + ((size_t)sy * cell.width + sx) * 4, 4);
+            }
+        }
+    }
+
+    auto& stripData = worker.changedData;
+    stripData.resize((size_t)columns * rows * blockSize);
+    if (runImageEncoder(cell, strip.data(), stripWidth, stripHeight, stripData.data(), stripData.size()) == false)
+        return false;
+
+    // Strip blocks are in slot order
+    for(int slot = 0; slot < changed.size(); slot++)
+        std::memcpy(output + changed[slot]*blockSize, stripData.data() + slot*blockSize, blockSize);
+    // ========== / Encode changed blocks ==========
+
+    return true;
+}
+
+bool SprayEncoder::runImageEncoder(const Cell& cell, const uchar* pixels, int width, int height,
+                                   uchar* out, size_t outSize)
+{
+    const StageTimer timer;
+    const bool encoded = imageEncoder->encode(pixels, width, height, out, outSize);
+
+    // The raw encoder is only a pixel format conversion
+    const quint64 pixelCount = (quint64)width * height;
+    addStageTime(cell, ImageHelper::isDxt(parameters.format) ? Stage::ENCODE : Stage::CONVERT,
+                 pixelCount, pixelCount * 4, timer);
+    return encoded;
+}
+
+bool SprayEncoder::loadCached(const Cell& cell, uchar* data)
+{
+    if (cache == nullptr)
+        return false;
+
+    const int index = &cell - cells.data();
+    const StageTimer timer;
+    const bool loaded = cache->load(cellKeys[index], data + cell.offset, cell.size);
+    addStageTime(cell, Stage::CACHE, 0, loaded ? cell.size : 0, timer);
+
+    if (loaded)
+    {
+        cellStats[index].cached = true;
+        cellsCached++;
+    }
+    return loaded;
+}
+
+void SprayEncoder::storeCached(const Cell& cell, const uchar* data)
+{
+    if (cache == nullptr)
+        return;
+
+    const StageTimer timer;
+    cache->store(cellKeys[&cell - cells.data()], data + cell.offset, cell.size);
+    addStageTime(cell, Stage::CACHE, 0, cell.size, timer);
+}
+
+void SprayEncoder::copyDuplicates(uchar* data)
+{
+    if (cancelled)
+        return;
+
+    for(int index = 0; index < cells.size(); index++)
+    {
+        if (cellDuplicateOf[index] == -1)
+            continue;
+
+        const auto& cell = cells[index];
+        std::memcpy(data + cell.offset, data + cells[cellDuplicateOf[index]].offset, cell.size);
+        if (parameters.computeMetrics)
+            cellMetrics[index] = cellMetrics[cellDuplicateOf[index]];
+        cellStats[index].repeated = true;
+        cellsReused++;
+        cellsFinished++;
+    }
+}
+
+void SprayEncoder::writeThumbnail(const Cell& cell, const uchar* pixels, uchar* data)
+{
+    // Halved like box filtered mipmaps, the layout picked the thumbnail's size the same way
+    std::vector<uchar> halved;
+    std::vector<uchar> current;
+    const uchar* source = pixels;
+    int width = cell.width;
+    int height = cell.height;
+    while(width > layout.getThumbnailWidth() || height > layout.getThumbnailHeight())
+    {
+        halved.resize((size_t)std::max(1, width / 2) * std::max(1, height / 2) * 4);
+        ImageHelper::halveImage(source, width, height, halved.data());
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+        current.swap(halved);
+        source = current.data();
+    }
+
+    const DxtEncoder encoder(SpraymakerModel::ImageFormat::DXT1, DxtEncoder::Fit::CLUSTER);
+    encoder.encode(source, width, height, data + layout.getThumbnailOffset(), layout.getThumbnailSize());
+    thumbnailWritten = true;
+}
+
+void SprayEncoder::finishThumbnail(uchar* data)
+{
+    if (thumbnailCell == -1 || thumbnailWritten || cancelled)
+        return;
+
+    // Cached, copied and directly rendered cells are already encoded, decoding them is
+    // cheaper than rendering the source again
+    const auto& cell = cells[thumbnailCell];
+    const StageTimer timer;
+    const quint64 pixelCount = (quint64)cell.width * cell.height;
+    std::vector<uchar> pixels(pixelCount * 4);
+
+    if (ImageDecoder::canDecode(parameters.format)
+        && ImageDecoder::decode(parameters.format, data + cell.offset, cell.width, cell.height, pixels.data()))
+    {
+        addStageTime(cell, Stage::RESIZE, pixelCount, pixels.size(), timer);
+        writeThumbnail(cell, pixels.data(), data);
+        return;
+    }
+
+    auto img = getCellImage(cell);
+    if (img.format() == VIPS_FORMAT_USHORT)
+        img = img.cast(VIPS_FORMAT_UCHAR, vips::VImage::option()->set("shift", true));
+    else if (img.format() == VIPS_FORMAT_FLOAT)
+        img = img.extract_band(0, vips::VImage::option()->set("n", 3))
+                  .colourspace(VIPS_INTERPRETATION_sRGB)
+                  .bandjoin((img.extract_band(3) * 255).cast(VIPS_FORMAT_UCHAR));
+    img.write(vips::VImage::new_from_memory(pixels.data(), pixels.size(),
+                                            cell.width, cell.height, 4, VIPS_FORMAT_UCHAR));
+    addStageTime(cell, Stage::RESIZE, pixelCount, pixels.size(), timer);
+    writeThumbnail(cell, pixels.data(), data);
+}
+
+void SprayEncoder::addStageTime(const Cell& cell, Stage stage, quint64 pixels, quint64 bytes, const StageTimer& timer)
+{
+    cellStats[&cell - cells.data()].stages[(int)stage] += StageTime{
+        .pixels     = pixels,
+        .bytes      = bytes,
+        .seconds    = timer.getWallSeconds(),
+        .cpuSeconds = timer.getCpuSeconds(),
+    };
+}
+
+QByteArray SprayEncoder::getSourceHash(const Cell& cell, const vips::VImage& img)
+{
+    // The same source image is often used by every mipmap, only hash it once.
+    // Workers asking for it while the first one is hashing wait for that hash.
+    std::promise<QByteArray> promise;
+    std::shared_future<QByteArray> pending;
+    {
+        std::scoped_lock lock(sourceHashMutex);
+        auto [it, inserted] = sourceHashes.try_emplace(img.get_image());
+        if (inserted)
+            it->second = promise.get_future().share();
+        else
+            pending = it->second;
+    }
+    if (pending.valid())
+        return pending.get();
+
+    try
+    {
+        const StageTimer timer;
+        auto copy = img.copy();
+        const auto pixels = (const char*)copy.data();
+        const auto size = VIPS_IMAGE_SIZEOF_IMAGE(copy.get_image());
+
+        QCryptographicHash hash(QCryptographicHash::Blake2b_256);
+        const int header[] = { copy.width(), copy.height(), copy.bands(), copy.format() };
+        hash.addData(QByteArrayView((const char*)header, sizeof(header)));
+        hash.addData(QByteArrayView(pixels, size));
+        addStageTime(cell, Stage::HASH, (quint64)copy.width() * copy.height(), size, timer);
+
+        const auto result = hash.result();
+        promise.set_value(result);
+        return result;
+    }
+    catch (...)
+    {
+        // Waiting workers get the same error
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+}
+
+QByteArray SprayEncoder::getCacheKey(const Cell& cell)
+{
+    // Bump whenever the encoding pipeline changes what it produces
+    constexpr int cacheVersion = 6;
+
+    ImageHelper::BoundingBox cropBox;
+    if (const auto bb = getCropBox(cell))
+        cropBox = *bb;
+
+    const int values[] = {
+        cacheVersion,
+        CRNLIB_VERSION,
+        (int)parameters.format,
+        (int)parameters.crnFormat,
+        (int)parameters.vtfFormat,
+        cell.width,
+        cell.height,
+        (int)cropBox.left,
+        (int)cropBox.top,
+        (int)cropBox.width,
+        (int)cropBox.height,
+        parameters.backgroundRed,
+        parameters.backgroundGreen,
+        parameters.backgroundBlue,
+        parameters.backgroundAlpha,
+        parameters.alphaThreshold,
+        (int)parameters.textureSampleMode,
+        (int)parameters.encoderBackend,
+        // Resampled cells also depend on the filter and the mipmap the chain started at
+        cellResampledFrom[&cell - cells.data()] == -1 ? 0 : (int)parameters.mipmapFilter,
+        cellResampledFrom[&cell - cells.data()],
+    };
+
+    QCryptographicHash hash(QCryptographicHash::Blake2b_256);
+    const auto native = getNativeImage(cell);
+    hash.addData(getSourceHash(cell, native ? *native : parameters.images[cell.mipmap][cell.frame]));
+    hash.addData(QByteArrayView((const char*)values, sizeof(values)));
+    return hash.result();
+}
+
+std::unique_ptr<ImageEncoder> SprayEncoder::createImageEncoder() const
+{
+    if (ImageHelper::isDxt(parameters.format) == false)
+        return std::make_unique<RawEncoder>(parameters.format, parameters.alphaThreshold);
+
+    std::unique_ptr<ImageEncoder> encoder;
+
+    switch(parameters.encoderBackend)
+    {
+    case SpraymakerModel::EncoderBackend::RANGE_FIT:
+        encoder = std::make_unique<DxtEncoder>(parameters.format, DxtEncoder::Fit::RANGE);
+        break;
+    case SpraymakerModel::EncoderBackend::CLUSTER_FIT:
+        encoder = std::make_unique<DxtEncoder>(parameters.format, DxtEncoder::Fit::CLUSTER);
+        break;
+    case SpraymakerModel::EncoderBackend::CRNLIB:
+    default:
+        break;
+    }
+
+    if (encoder && encoder->supports(parameters.format))
+        return encoder;
+
+    return std::make_unique<CrnlibEncoder>(parameters.format, parameters.crnFormat,
+                                           crnHelperThreads,
+                                           SprayEncoder::crnProgressCallback, (void*)this,
+                                           &cancelled);
+}
+
+int SprayEncoder::getThreadCount() const
+{
+    if (parameters.threads > 0)
+        return parameters.threads;
+
+    return std::max(1U, std::thread::hardware_concurrency());
+}
+
+void SprayEncoder::runJobs(int jobCount, const std::function<void(int, int)>& job, ProgressCallback progressCallback)
+{
+    std::atomic<int> nextJob = 0;
+    std::atomic<bool> failed = false;
+    std::exception_ptr error;
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    const int workers = std::clamp(getThreadCount(), 1, std::max(1, jobCount));
+    int running = workers;
+
+    auto worker = [&](int workerIndex){
+        for(int index = nextJob++; index < jobCount && failed == false && cancelled == false; index = nextJob++)
+        {
+            try
+            {
+                job(index, workerIndex);
+            }
+            catch (...)
+            {
+                std::scoped_lock lock(mutex);
+                if (failed.exchange(true) == false)
+                    error = std::current_exception();
+            }
+        }
+
+        std::scoped_lock lock(mutex);
+        running--;
+        finished.notify_all();
+    };
+
+    {
+        std::vector<std::jthread> threads;
+        for(int i = 0; i < workers; i++)
+            threads.emplace_back(worker, i);
+
+        // Report progress from the calling thread while the workers run
+        std::unique_lock lock(mutex);
+        while(running > 0)
+        {
+            finished.wait_for(lock, std::chrono::milliseconds(50));
+            lock.unlock();
+            progressCallback(cellsFinished, encodingPercent);
+            lock.lock();
+        }
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+bool SprayEncoder::crnProgressCallback(uint percentage_complete, void* pUser_data_ptr)
+{
+    auto encoder = (SprayEncoder*)pUser_data_ptr;
+    encoder->encodingPercent = percentage_complete;
+
+    // Returning false makes crnlib abort the conversion
+    return encoder->cancelled == false;
+}
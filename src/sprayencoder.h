@@ -0,0 +1,292 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPRAYENCODER_H
+#define SPRAYENCODER_H
+
+#include "edgeprojections.h"
+#include "encodecache.h"
+#include "imageencoder.h"
+#include "imagehelper.h"
+#include "imagemetrics.h"
+#include "spraymakermodel.h"
+#include "stagetimer.h"
+#include "vtf_defs.h"
+#include "vtflayout.h"
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// ========== SprayEncoder ==========
+
+class SprayEncoder
+{
+public:
+    // Snapshot of everything needed to encode a spray, taken when saving starts
+    struct Parameters
+    {
+        SpraymakerModel::ImageFormat format = SpraymakerModel::ImageFormat::INVALID;
+        crnlib::pixel_format crnFormat = crnlib::pixel_format::PIXEL_FMT_INVALID;
+        VTF_IMAGE_FORMAT vtfFormat = VTF_IMAGE_FORMAT::NONE;
+
+        int width   = 0;
+        int height  = 0;
+        int mipmaps = 0;
+        int frames  = 0;
+
+        SpraymakerModel::TextureSampleMode textureSampleMode = SpraymakerModel::TextureSampleMode::ANISOTROPIC;
+        SpraymakerModel::AutocropMode autocropMode = SpraymakerModel::AutocropMode::NONE;
+
+        int backgroundRed   = 0;
+        int backgroundGreen = 0;
+        int backgroundBlue  = 0;
+        int backgroundAlpha = 0;
+
+        int alphaThreshold   = 128;
+        int crnHelperThreads = 0;
+
+        // How autocrop treats alpha, INVALID derives it from the format
+        ImageHelper::PixelAlphaMode pixelAlphaMode = ImageHelper::PixelAlphaMode::INVALID;
+
+        // The built-in encoders only do DXT, other formats always use crnlib
+        SpraymakerModel::EncoderBackend encoderBackend = SpraymakerModel::EncoderBackend::CRNLIB;
+        SpraymakerModel::MipmapFilter mipmapFilter = SpraymakerModel::MipmapFilter::SOURCE;
+
+        // Worker threads for this spray, 0 uses every core
+        int threads = 0;
+
+        // Decodes every encoded cell and compares it against the pixels it was encoded from
+        bool computeMetrics = false;
+
+        // VTF 7.x. 2 and up add a DXT1 thumbnail made from one of the mipmaps, 3 and up a resource directory.
+        int vtfVersion = 1;
+        // Stores a CRC-32 of the image data in a resource, 7.3 and up
+        bool vtfCrc = false;
+
+        // Encoded payloads are reused from here when nothing that affects them changed.
+        // Empty disables the cache.
+        QString cacheDirectory;
+        qint64 cacheSizeLimit = 0;
+
+        // images[mipmap][frame]
+        std::vector<std::vector<vips::VImage>> images;
+        // edgeProjections[mipmap][frame], optional. Cells without one scan their image instead.
+        std::vector<std::vector<std::shared_ptr<const EdgeProjections>>> edgeProjections;
+        // nativeImages[mipmap][frame], optional. 16-bit or float RGBA versions of images, which formats with
+        // more than 8 bits per channel are rendered from. Null where the source only had 8 bits.
+        std::vector<std::vector<vips::VImage>> nativeImages;
+    };
+
+    // One (mipmap, frame) image and the location of its data within the VTF file
+    struct Cell
+    {
+        int mipmap;
+        int frame;
+        int width;
+        int height;
+        size_t offset;
+        size_t size;
+    };
+
+    // Where an encode's time goes, see Result::stages
+    enum class Stage
+    {
+        CROP,    // Scanning sources for autocrop
+        HASH,    // Hashing sources for the cache and repeated frames
+        RESIZE,  // Rendering cells: crop, resize, pad and mipmap resampling
+        CONVERT, // Uncompressed formats, ImageHelper::convertPixelFormat()
+        ENCODE,  // DXT encoders
+        METRICS, // Parameters::computeMetrics
+        CACHE,   // Loading and storing cached cells
+        WRITE,   // Creating and committing the output file, encodeToFile() only
+        _COUNT,
+    };
+
+    struct StageTime
+    {
+        quint64 pixels = 0;
+        quint64 bytes = 0;
+        // Summed over every worker thread
+        double seconds = 0;
+        double cpuSeconds = 0;
+
+        StageTime& operator+=(const StageTime& other);
+    };
+
+    struct CellStats
+    {
+        std::array<StageTime, (int)Stage::_COUNT> stages;
+        bool cached = false;
+        bool repeated = false;
+    };
+
+    struct Result
+    {
+        bool cancelled = false;
+        size_t fileSize = 0;
+        int cells = 0;
+        int cellsCached = 0;
+        int cellsReused = 0;
+        int blocksReused = 0;
+
+        // Only set with Parameters::computeMetrics. Cells loaded from the cache aren't measured.
+        ImageMetrics::Errors metrics;
+        std::vector<ImageMetrics::Errors> cellMetrics;
+
+        // Only the work which was done, cached and repeated cells take no time
+        std::array<StageTime, (int)Stage::_COUNT> stages;
+        // Per cell, in the order of getCells()
+        std::vector<CellStats> cellStats;
+        double wallSeconds = 0;
+    };
+
+    // Called on the thread which called encode()
+    using ProgressCallback = std::function<void(int cellsFinished, int encodingPercent)>;
+
+    SprayEncoder(Parameters parameters);
+
+    size_t getFileSize() const;
+    const std::vector<Cell>& getCells() const;
+    const VtfLayout& getLayout() const;
+
+    // crc is only written with Parameters::vtfCrc, encode() fills it in once the image data is done
+    void writeHeader(uchar* data, uint32_t crc = 0) const;
+    Result encode(uchar* data, ProgressCallback progressCallback);
+    Result encodeToFile(QString filePath, ProgressCallback progressCallback);
+
+    // e.g. "resize", used as a key in reports and Settings
+    static QString getStageName(Stage stage);
+
+    // Thread-safe. Stops handing out new cells and makes crnlib abort the ones in progress.
+    void cancel();
+    bool isCancelled() const;
+
+private:
+    Parameters parameters;
+    VtfLayout layout;
+    std::vector<Cell> cells;
+
+    ImageHelper::PixelAlphaMode pixelAlphaMode;
+
+    // Autocrop bounding boxes, per cell and combined per mipmap
+    std::vector<ImageHelper::BoundingBox> cellBoundingBoxes;
+    std::vector<ImageHelper::BoundingBox> mipmapBoundingBoxes;
+    std::vector<bool> mipmapBounded;
+
+    // Every cell of a chain after the first is resampled from the one before it instead
+    // of the source, see Parameters::mipmapFilter.
+    std::vector<std::vector<int>> chains;
+    // Mipmap the cell's chain was rendered from the source at, -1 for chain roots
+    std::vector<int> cellResampledFrom;
+    // Stage 2 jobs, [first, last) chains. Consecutive chains hold consecutive frames.
+    std::vector<std::pair<int, int>> jobs;
+
+    // Everything that goes into a cell's payload, see getCacheKey()
+    std::vector<QByteArray> cellKeys;
+    // Cells and chains which encode to the same payload as an earlier one get a copy of
+    // it instead, -1 for the ones which are encoded
+    std::vector<int> cellDuplicateOf;
+    std::vector<int> chainDuplicateOf;
+
+    // DXT blocks identical to the previous frame's are copied instead of encoded again
+    bool temporalReuse = false;
+
+    // The thumbnail is halved from frame 0 of the smallest mipmap at least as large as it,
+    // while its pixels are at hand. -1 without a thumbnail.
+    int thumbnailCell = -1;
+    std::atomic<bool> thumbnailWritten;
+
+    // Scratch space per worker thread, sized once for the largest mipmap
+    struct Worker
+    {
+        // The cell being encoded, and the next cell of its chain
+        std::vector<uchar> pixels;
+        std::vector<uchar> nextPixels;
+
+        // Per mipmap, the last frame this worker encoded and its pixels as they were encoded
+        std::vector<int> previousFrames;
+        std::vector<std::vector<uchar>> previousPixels;
+
+        // The blocks which changed since the previous frame, side by side, and their encoding
+        std::vector<int> changedBlocks;
+        std::vector<uchar> changedPixels;
+        std::vector<uchar> changedData;
+
+        // The cell's data decoded again, for Parameters::computeMetrics
+        std::vector<uchar> decoded;
+
+        // The cell as float RGBA, for formats with more than 8 bits per channel
+        std::vector<float> floatPixels;
+    };
+
+    std::unique_ptr<ImageEncoder> imageEncoder;
+    std::vector<Worker> workers;
+    std::vector<ImageMetrics::Errors> cellMetrics;
+    std::unique_ptr<EncodeCache> cache;
+    std::mutex sourceHashMutex;
+    // Shared by every cell of the same source, set by whichever worker hashes it first
+    std::unordered_map<const VipsImage*, std::shared_future<QByteArray>> sourceHashes;
+
+    int crnHelperThreads = 0;
+    std::atomic<int> cellsFinished;
+    std::atomic<int> cellsCached;
+    std::atomic<int> cellsReused;
+    std::atomic<int> blocksReused;
+    std::atomic<int> encodingPercent;
+    // Every cell is only timed by the worker it belongs to
+    std::vector<CellStats> cellStats;
+    std::atomic<bool> cancelled;
+
+    void findBoundingBoxes(ProgressCallback progressCallback);
+    const ImageHelper::BoundingBox* getCropBox(const Cell& cell) const;
+    const EdgeProjections* getEdgeProjections(const Cell& cell) const;
+    const vips::VImage* getNativeImage(const Cell& cell) const;
+    void findChains();
+    void findDuplicates(ProgressCallback progressCallback);
+    void findJobs(int workerCount);
+    bool canResample(const Cell& parent, const Cell& cell) const;
+    vips::VImage getCellImage(const Cell& cell) const;
+    vips::VImage flattenAlpha(vips::VImage img) const;
+    // What a value given for 8 bits is multiplied by for img: 257 for 16-bit, 1/255 for float
+    static double getEightBitScale(const vips::VImage& img);
+    void resampleCell(const Cell& parent, const std::vector<uchar>& parentPixels,
+                      const Cell& cell, std::vector<uchar>& pixels) const;
+    void encodeCell(const Cell& cell, uchar* data, Worker& worker);
+    void encodeChain(const std::vector<int>& chain, uchar* data, Worker& worker);
+    bool encodePixels(const Cell& cell, uchar* data, std::vector<uchar>& pixels, Worker& worker);
+    bool encodeImage(const Cell& cell, const uchar* pixels, uchar* data, Worker& worker);
+    bool encodeChangedBlocks(const Cell& cell, const Cell& previousCell,
+                             const uchar* pixels, uchar* data, Worker& worker);
+    void measureCell(const Cell& cell, const uchar* pixels, const uchar* data, Worker& worker);
+    bool runImageEncoder(const Cell& cell, const uchar* pixels, int width, int height, uchar* out, size_t outSize);
+    bool loadCached(const Cell& cell, uchar* data);
+    void storeCached(const Cell& cell, const uchar* data);
+    void copyDuplicates(uchar* data);
+    void writeThumbnail(const Cell& cell, const uchar* pixels, uchar* data);
+    // For thumbnail cells whose pixels never were RGBA8888, or weren't encoded at all
+    void finishThumbnail(uchar* data);
+    void addStageTime(const Cell& cell, Stage stage, quint64 pixels, quint64 bytes, const StageTimer& timer);
+
+    QByteArray getSourceHash(const Cell& cell, const vips::VImage& img);
+    QByteArray getCacheKey(const Cell& cell);
+
+    std::unique_ptr<ImageEncoder> createImageEncoder() const;
+    int getThreadCount() const;
+    // job(index, worker), worker is in [0, thread count)
+    void runJobs(int jobCount, const std::function<void(int, int)>& job, ProgressCallback progressCallback);
+
+    static bool crnProgressCallback(uint percentage_complete, void* pUser_data_ptr);
+};
+
+#endif // SPRAYENCODER_H
@@ -0,0 +1,125 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "sprayencodeworker.h"
+#include "savereport.h"
+#include "spraymakerexception.h"
+#include "stagetimer.h"
+
+#include <QDebug>
+#include <QFileInfo>
+
+#include <QPromise>
+
+SprayEncodeWorker::SprayEncodeWorker(QObject *parent)
+    : QObject(parent)
+{}
+
+SprayEncodeWorker::~SprayEncodeWorker()
+{
+    // Don't leave a thread writing into a spray after the window is gone
+    if (thread != nullptr)
+    {
+        cancel();
+        thread->wait();
+    }
+}
+
+QFuture<SprayEncoder::Result> SprayEncodeWorker::start(SprayEncoder::Parameters parameters,
+                                                       QString sprayName,
+                                                       std::list<GameSpray> gamesWithSprays)
+{
+    if (isRunning())
+        throw SpraymakerException(tr("A spray is already being saved."));
+
+    QPromise<SprayEncoder::Result> promise;
+    future = promise.future();
+    cancelRequested = false;
+
+    thread = QThread::create([=, this, promise = std::move(promise)]() mutable {
+        promise.start();
+        try
+        {
+            run(promise, parameters, sprayName, gamesWithSprays);
+        }
+        catch (...)
+        {
+            // Rethrown on the GUI thread when the future's result is read
+            promise.setException(std::current_exception());
+        }
+        promise.finish();
+    });
+
+    connect(thread, &QThread::finished,
+            thread, &QObject::deleteLater);
+    connect(thread, &QThread::finished,
+            this,   [=, this](){
+        thread = nullptr;
+        emit finished();
+    });
+
+    thread->start();
+
+    return future;
+}
+
+bool SprayEncodeWorker::isRunning() const
+{ return thread != nullptr; }
+
+void SprayEncodeWorker::cancel()
+{ cancelRequested = true; }
+
+void SprayEncodeWorker::run(QPromise<SprayEncoder::Result>& promise,
+                            SprayEncoder::Parameters parameters,
+                            QString sprayName,
+                            std::list<GameSpray> gamesWithSprays)
+{
+    SprayEncoder encoder(parameters);
+
+    auto filePath = "./sprays/" + sprayName + ".vtf";
+
+    auto result = encoder.encodeToFile(filePath, [&](int cellsFinished, int encodingPercent){
+        // Polled every few milliseconds, which is also how fast a cancel reaches crnlib
+        if (cancelRequested)
+            encoder.cancel();
+
+        emit progressChanged(cellsFinished, encodingPercent);
+    });
+
+    // A cancel which comes after the spray is written is too late, it's installed and
+    // reported like any other save. The promise is never cancelled, so its result counts.
+    if (result.cancelled)
+        return;
+
+    SaveReport report(sprayName, parameters, encoder.getCells(), result);
+
+    StageTimer timer;
+    SprayEncoder::StageTime install;
+    for (const auto& gameSpray : gamesWithSprays)
+    {
+        gameSpray.installSpray(filePath, sprayName, true);
+        install.bytes += QFileInfo(filePath).size();
+    }
+    install.seconds = timer.getWallSeconds();
+    install.cpuSeconds = timer.getCpuSeconds();
+
+    report.addStage("install", install);
+    report.addWallSeconds(install.seconds);
+
+    // A spray that saved is worth more than its report
+    try
+    {
+        report.write(SaveReport::getFilePath(filePath));
+    }
+    catch (const SpraymakerException& e)
+    {
+        qWarning() << e.what();
+    }
+    emit reportReady(report.toJson());
+
+    promise.addResult(result);
+}
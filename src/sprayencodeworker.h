@@ -0,0 +1,59 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPRAYENCODEWORKER_H
+#define SPRAYENCODEWORKER_H
+
+#include "sprayencoder.h"
+#include "gamespray.h"
+
+#include <QObject>
+#include <QFuture>
+#include <QJsonObject>
+#include <QThread>
+
+#include <atomic>
+
+// ========== SprayEncodeWorker ==========
+
+// Runs the whole save pipeline (encode, write, install) on its own thread.
+// Progress is emitted as signals, which are queued to receivers living on the GUI thread.
+class SprayEncodeWorker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SprayEncodeWorker(QObject *parent = nullptr);
+    ~SprayEncodeWorker();
+
+    QFuture<SprayEncoder::Result> start(SprayEncoder::Parameters parameters,
+                                        QString sprayName,
+                                        std::list<GameSpray> gamesWithSprays);
+    bool isRunning() const;
+
+public slots:
+    void cancel();
+
+signals:
+    void progressChanged(int cellsFinished, int encodingPercent);
+    // See SaveReport, also written next to the spray
+    void reportReady(QJsonObject report);
+    // The thread is gone and isRunning() is false again, after the future finished
+    void finished();
+
+private:
+    QThread* thread = nullptr;
+    QFuture<SprayEncoder::Result> future;
+    // Only honoured until the spray is written, see run()
+    std::atomic<bool> cancelRequested = false;
+
+    void run(QPromise<SprayEncoder::Result>& promise,
+             SprayEncoder::Parameters parameters,
+             QString sprayName,
+             std::list<GameSpray> gamesWithSprays);
+};
+
+#endif // SPRAYENCODEWORKER_H
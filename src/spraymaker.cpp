@@ -10,15 +10,14 @@
 #include "imagehelper.h"
 #include "sizedisplaylabel.h"
 #include "spraymakerexception.h"
-#include "vtf_defs.h"
+#include "vtflayout.h"
 #include "gamespray.h"
 #include "settings.h"
+#include "sprayencoder.h"
 
 #include <crnlib.h>
-#include <crnlib/crn_mipmapped_texture.h>
 
 #include <iostream>
-#include <fstream>
 
 #include <QLabel>
 #include <QGridLayout>
@@ -33,6 +32,8 @@
 #include <QInputDialog>
 #include <QDir>
 #include <QTreeWidget>
+#include <QJsonArray>
+#include <QMenu>
 #include <QDirIterator>
 #include <QSaveFile>
 #include <QFileDialog>
@@ -79,6 +80,7 @@ Spraymaker::Spraymaker(QWidget *parent)
     , ui(new Ui::Spraymaker)
     , spraymakerModel(new SpraymakerModel)
     , settings(Settings::getInstance())
+    , encodeWorker(new SprayEncodeWorker(this))
 {
     if (Spraymaker::instance != nullptr)
         throw std::runtime_error("Tried to create multiple instances of Spraymaker");
@@ -142,6 +144,24 @@ Spraymaker::Spraymaker(QWidget *parent)
         ui->statusbar->addPermanentWidget(imageProcessingContainer);
     }
 
+    // ========== Save report panel ==========
+    // Hidden until it's opened from the View menu, filled by every save
+    {
+        reportTree = new QTreeWidget();
+        reportTree->setColumnCount(5);
+        reportTree->setHeaderLabels({ tr("Stage"), tr("Wall (s)"), tr("CPU (s)"), tr("MB"), tr("MB/s") });
+
+        reportDock = new QDockWidget(tr("Save report"), this);
+        reportDock->setObjectName("saveReportDock");
+        reportDock->setWidget(reportTree);
+        addDockWidget(Qt::BottomDockWidgetArea, reportDock);
+        reportDock->hide();
+
+        auto viewMenu = new QMenu(tr("View"), ui->menubar);
+        viewMenu->addAction(reportDock->toggleViewAction());
+        ui->menubar->insertMenu(ui->menuAbout->menuAction(), viewMenu);
+    }
+
     // ========== Connections ==========
 
     // Spinboxes -> SpraymakerModel
@@ -455,7 +475,8 @@ Spraymaker::Spraymaker(QWidget *parent)
             spraymakerModel->getHeight(),
             spraymakerModel->getMipmapCount(),
             spraymakerModel->getFrameCount());
-        vtfSize += sizeof(VTF_HEADER_71);
+        vtfSize += VtfLayout(settings->getVtfVersion(), settings->getVtfCrc(),
+                             spraymakerModel->getWidth(), spraymakerModel->getHeight()).getImageOffset();
         spraymakerModel->setVtfFileSize(vtfSize);
     });
 
@@ -542,7 +563,8 @@ Spraymaker::Spraymaker(QWidget *parent)
             width, height,
             mipmaps,
             spraymakerModel->getFrameCount(),
-            spraymakerModel->getMaxVtfFileSize() - sizeof(VTF_HEADER_71),
+            spraymakerModel->getMaxVtfFileSize()
+                - VtfLayout::getMaxImageOffset(settings->getVtfVersion(), settings->getVtfCrc()),
             step, square, powerOf2);
 
         spraymakerModel->setResolution(width, height);
@@ -624,7 +646,37 @@ Spraymaker::Spraymaker(QWidget *parent)
     connect(ui->saveSprayButton, &QPushButton::clicked,
             this,                &Spraymaker::saveSpray);
 
+    // Cancel button stops the save running in the background
+    connect(ui->cancelSaveButton, &QPushButton::clicked,
+            encodeWorker,         &SprayEncodeWorker::cancel);
+
+    // SprayEncodeWorker -> Progress bars
+    // Emitted from the worker thread, queued onto this one
+    connect(encodeWorker,     &SprayEncodeWorker::progressChanged,
+            this,             [=, this](int cellsFinished, int encodingPercent){
+        imageProgressBar->setValue(cellsFinished);
+        encodingProgressBar->setValue(encodingPercent);
+
+        if (encodeEstimator)
+        {
+            const auto remaining = encodeEstimator->getRemainingSeconds(encodeTimer.elapsed() / 1000.0, cellsFinished);
+            encodingProgressBar->setFormat(tr("Encoding: %p% (%1 left)").arg(EncodeEstimator::formatSeconds(remaining)));
+        }
+    });
+
+    connect(&encodeWatcher, &QFutureWatcher<SprayEncoder::Result>::finished,
+            this,           &Spraymaker::saveSprayFinished);
+
+    connect(encodeWorker, &SprayEncodeWorker::reportReady,
+            this,         &Spraymaker::showSaveReport);
+
     auto saveEnableToggler = [=, this](){
+        if (encodeWorker->isRunning())
+        {
+            ui->saveSprayButton->setEnabled(false);
+            return;
+        }
+
         for(int mipmap = 0; mipmap < spraymakerModel->getMipmapCount(); mipmap++)
         {
             for(int frame = 0; frame < spraymakerModel->getFrameCount(); frame++)
@@ -640,6 +692,10 @@ Spraymaker::Spraymaker(QWidget *parent)
         ui->saveSprayButton->setEnabled(true);
     };
 
+    // Re-enable saving once the background save's thread is gone, the future finishes before that
+    connect(encodeWorker, &SprayEncodeWorker::finished,
+            this,         saveEnableToggler);
+
     // Toggle the save button enabled/disabled
     connect(spraymakerModel, &SpraymakerModel::mipmapCountChanged,
             this,            saveEnableToggler);
@@ -686,12 +742,6 @@ Spraymaker* Spraymaker::getInstance()
     return Spraymaker::instance;
 }
 
-bool Spraymaker::crnProgressCallback(uint percentage_complete, void* pUser_data_ptr)
-{    
-    Spraymaker::instance->encodingProgressBar->setValue(percentage_complete);
-    return true;
-}
-
 Spraymaker::TryAddGameResult Spraymaker::tryAddGame(QString directory)
 {
     try
@@ -821,7 +871,7 @@ void Spraymaker::aboutDialog()
     about.exec();
 }
 
-QString Spraymaker::sprayNamePrompt()
+QString Spraymaker::sprayNamePrompt(double estimatedSeconds)
 {
     QDir dir;
     if (dir.mkpath("./sprays") == false)
@@ -963,6 +1013,7 @@ QString Spraymaker::sprayNamePrompt()
     filePromptLayout->addWidget(lineEdit);
     filePromptLayout->addWidget(overwriteCheckbox, Qt::AlignLeft);
     filePromptLayout->addWidget(outputListWidget);
+    filePromptLayout->addWidget(new QLabel(tr("Estimated time: %1").arg(EncodeEstimator::formatSeconds(estimatedSeconds))));
     filePromptLayout->addLayout(buttonsLayout);
 
     {
@@ -1002,250 +1053,152 @@ void Spraymaker::saveSpray()
 {
     spraymakerModel->invalidateProgress();
 
-    auto sprayName = sprayNamePrompt();
+    // The model is snapshotted here, so it can keep being edited while the spray saves
+    auto parameters = getEncoderParameters();
+    auto estimator = std::make_unique<EncodeEstimator>(parameters);
+
+    auto sprayName = sprayNamePrompt(estimator->getEstimatedSeconds());
 
     if(sprayName.length() == 0)
         return;
 
-    auto width   = spraymakerModel->getWidth();
-    auto height  = spraymakerModel->getHeight();
-    auto mipmaps = spraymakerModel->getMipmapCount();
-    auto frames  = spraymakerModel->getFrameCount();
-    auto format  = spraymakerModel->getFormat();
+    ui->saveSprayButton->setEnabled(false);
+    ui->cancelSaveButton->setEnabled(true);
 
-    auto buffer = std::make_unique<uchar[]>(spraymakerModel->getVtfFileSize());
-    uchar* pos = buffer.get();
+    encodeEstimator = std::move(estimator);
+    encodeTimer.start();
 
-    new(pos) VTF_HEADER_71
-        {
-        .signature  = {'V', 'T', 'F', 0},
-        .version    = {7, 1},
-        .headerSize = 64,
-        .width      = (ushort)width,
-        .height     = (ushort)height,
-        .flags =
-            VTF_FLAGS::CLAMPS | VTF_FLAGS::CLAMPT | VTF_FLAGS::CLAMPU | VTF_FLAGS::NOLOD | VTF_FLAGS::ALL_MIPS
-             | (mipmaps == 1                          ? VTF_FLAGS::NOMIP         : VTF_FLAGS::NONE)
-             | (ImageHelper::hasOneBitAlpha(format)   ? VTF_FLAGS::ONEBITALPHA   : VTF_FLAGS::NONE)
-             | (ImageHelper::hasMultiBitAlpha(format) ? VTF_FLAGS::EIGHTBITALPHA : VTF_FLAGS::NONE)
-             | (mipmaps == 1
-                && spraymakerModel->getTextureSampleMode() == SpraymakerModel::TextureSampleMode::POINT_SAMPLE
-                ? VTF_FLAGS::POINTSAMPLE : VTF_FLAGS::NONE)
-             | (spraymakerModel->getTextureSampleMode() == SpraymakerModel::TextureSampleMode::ANISOTROPIC
-                ? VTF_FLAGS::ANISOTROPIC : VTF_FLAGS::NONE)
-             | (spraymakerModel->getTextureSampleMode() == SpraymakerModel::TextureSampleMode::TRILINEAR
-                ? VTF_FLAGS::TRILINEAR   : VTF_FLAGS::NONE)
-        ,
-        .frames             = (ushort)frames,
-        .firstFrame         = 0,
-        .padding0           = {'C', 'M', 'C', '3'},
-        .reflectivity       = {0.5, 0.5, 0.5},
-        .padding1           = {'B', 'F', 'F', '!'},
-        .bumpmapScale       = 1.0,
-        .highResImageFormat = spraymakerModel->mapFormat().vtfFormat,
-        .mipmapCount        = (uchar)mipmaps,
-        .lowResImageFormat  = VTF_IMAGE_FORMAT::NONE,
-        .lowResImageWidth   = 0,
-        .lowResImageHeight  = 0,
-        .padding2           = 20,
-        };
-
-    pos += sizeof(VTF_HEADER_71);
-
-    ImageHelper::PixelAlphaMode pixelAlphaMode = ImageHelper::PixelAlphaMode::INVALID;
-
-    if(ImageHelper::hasOneBitAlpha(format) || ImageHelper::hasAlpha(format) == false)
-        pixelAlphaMode = ImageHelper::PixelAlphaMode::THRESHOLD;
-
-    if(ImageHelper::hasMultiBitAlpha(format))
-        pixelAlphaMode = ImageHelper::PixelAlphaMode::FULL;
-
-    int alphaThreshold = settings->getAlphaThreshold();
+    auto future = encodeWorker->start(parameters, sprayName, gamesWithSprays);
+    encodeWatcher.setFuture(future);
+}
 
-    bool boundedAutocrop = false;
-    bool forceBoundedAutocrop = false;
-    bool autocrop = false;
+void Spraymaker::saveSprayFinished()
+{
+    ui->cancelSaveButton->setEnabled(false);
+    encodingProgressBar->setFormat(tr("Encoding: %p%"));
 
-    switch(spraymakerModel->getAutocropMode())
-    {
-    case SpraymakerModel::AutocropMode::BOUNDINGBOX:
-        forceBoundedAutocrop = true;
-    case SpraymakerModel::AutocropMode::AUTOMATIC:
-        boundedAutocrop = true;
-    case SpraymakerModel::AutocropMode::INDIVIDUAL:
-        autocrop = true;
-        break;
-    case SpraymakerModel::AutocropMode::NONE:
-    default:
-        break;
-    }
+    auto future = encodeWatcher.future();
+    auto estimator = std::move(encodeEstimator);
 
-    // VTF mipmaps are ordered smallest to largest
-    for(int mipmap = mipmaps - 1; mipmap >= 0; mipmap--)
+    if (future.resultCount() == 0)
     {
-        auto mipWidth  = std::max(1, spraymakerModel->getWidth()  >> mipmap);
-        auto mipHeight = std::max(1, spraymakerModel->getHeight() >> mipmap);
-
-        // ========== Find bounding box for autocropping animations ==========
-        uint lastWidth = 0;
-        uint lastHeight = 0;
-        auto bb = ImageHelper::BoundingBox();
-        if (boundedAutocrop)
-        for(int frame = 0; frame < frames; frame++)
-        {
-            const auto img = spraymakerModel->getImage(mipmap, frame);
+        spraymakerModel->invalidateProgress();
 
-            if (frame == 0)
-            {
-                lastWidth  = img->width();
-                lastHeight = img->height();
-            }
+        // Rethrows anything thrown on the worker thread
+        future.waitForFinished();
 
-            if (forceBoundedAutocrop == false
-                && (img->width() != lastWidth || img->height() != lastHeight))
-            {
-                boundedAutocrop = false;
-                break;
-            }
+        ui->statusbar->showMessage(tr("Save cancelled."), 5000);
+        return;
+    }
 
-            bb += ImageHelper::getImageBorders(img->data(), img->width(), img->height(),
-                                               pixelAlphaMode, alphaThreshold);
+    auto result = future.result();
 
-            lastWidth  = img->width();
-            lastHeight = img->height();
-        }
-        // ========== / Find bounding box for autocropping animations ==========
+    // Measured on this machine, for the next estimate
+    if (estimator)
+        estimator->record(result);
 
-        for(int frame = 0; frame < frames; frame++)
-        {
-            auto img = spraymakerModel->getImage(mipmap, frame)->copy();
+    ui->statusbar->showMessage(tr("Saved spray in %5 (%1 bytes, %2 of %3 images cached, %4 repeated).")
+                                   .arg(result.fileSize)
+                                   .arg(result.cellsCached)
+                                   .arg(result.cells)
+                                   .arg(result.cellsReused)
+                                   .arg(EncodeEstimator::formatSeconds(encodeTimer.elapsed() / 1000.0)), 5000);
+}
 
-            // Apply appropriate autocrop method
-            if (forceBoundedAutocrop || boundedAutocrop)
-            {
-                img = img.crop(bb.left, bb.top, bb.width, bb.height);
-            }
-            else if (autocrop)
-            {
-                auto bb = ImageHelper::getImageBorders(img.data(), img.width(), img.height(),
-                                                       pixelAlphaMode, alphaThreshold);
-                img = img.crop(bb.left, bb.top, bb.width, bb.height);
-            }
+void Spraymaker::showSaveReport(QJsonObject report)
+{
+    auto addRow = [](QTreeWidgetItem* parent, QString name, const QJsonObject& stage){
+        return new QTreeWidgetItem(parent, QStringList{
+            name,
+            QString::number(stage["wall_seconds"].toDouble(), 'f', 3),
+            QString::number(stage["cpu_seconds"].toDouble(), 'f', 3),
+            stage.contains("bytes") ? QString::number(stage["bytes"].toDouble() / 1e6, 'f', 2) : QString(),
+            stage.contains("mb_per_second") ? QString::number(stage["mb_per_second"].toDouble(), 'f', 1) : QString(),
+        });
+    };
 
-            // Should the user be able to set scale mode between fit, fill, stretch, none?
-            // TODO: Proper scale method for pixel art
-            img = img.thumbnail_image(mipWidth,
-                                      vips::VImage::option()
-                                          ->set("height", mipHeight)
-                                          ->set("size", VipsSize::VIPS_SIZE_BOTH));
-
-            img = img.gravity(VipsCompassDirection::VIPS_COMPASS_DIRECTION_CENTRE,
-                              mipWidth, mipHeight,
-                              vips::VImage::option()
-                                  ->set("background", std::vector<double>{
-                                                          (double)spraymakerModel->getBackgroundRed(),
-                                                          (double)spraymakerModel->getBackgroundGreen(),
-                                                          (double)spraymakerModel->getBackgroundBlue(),
-                                                          (double)spraymakerModel->getBackgroundAlpha(),
-                                                      })
-                                  ->set("extend", VIPS_EXTEND_BACKGROUND));
-
-            // ========== Fix transparency for 1-bit and nonalpha targets ==========
-            if (ImageHelper::hasOneBitAlpha(format) || ImageHelper::hasAlpha(format) == false)
-            {
-                auto replaceEffectivePixel = [=, this](uchar* ptr, uint x, uint y, uint width,
-                                                       ImageHelper::PixelAlphaMode pixelAlphaMode, int alphaThreshold) {
-                    uchar* pixelPtr = (uchar*)ptr + (x*4 + y*width*4);
-                    uint pixel = (pixelPtr[0] << 0 )
-                               | (pixelPtr[1] << 8 )
-                               | (pixelPtr[2] << 16);
-
-                    switch(pixelAlphaMode)
-                    {
-                    case ImageHelper::PixelAlphaMode::FULL:
-                        pixel |= pixelPtr[3] << 24;
-                        break;
-                    case ImageHelper::PixelAlphaMode::THRESHOLD:
-                        if (pixelPtr[3] < alphaThreshold)
-                            pixel = spraymakerModel->getBackgroundRed()   << 0
-                                  | spraymakerModel->getBackgroundGreen() << 8
-                                  | spraymakerModel->getBackgroundBlue()  << 16;
-                        else
-                            pixel |= 0xff000000;
-                        break;
-                    case ImageHelper::PixelAlphaMode::NONE:
-                    default:
-                        break;
-                    }
+    reportTree->clear();
 
-                    for(int c = 0; c < 4; c++)
-                    {
-                        pixelPtr[c] = pixel >> (c*8);
-                    }
-                };
+    auto total = addRow(reportTree->invisibleRootItem(),
+                        tr("%1 (%2x%3 %4)")
+                            .arg(report["spray"].toString())
+                            .arg(report["width"].toInt())
+                            .arg(report["height"].toInt())
+                            .arg(report["format"].toString()),
+                        report);
 
-                for(uint x = 0; x < img.width(); x++)
-                {
-                    for(uint y = 0; y < img.height(); y++)
-                    {
-                        replaceEffectivePixel(
-                            (uchar*)img.data(), x, y, img.width(),
-                            ImageHelper::PixelAlphaMode::THRESHOLD, alphaThreshold);
-                    }
-                }
-            }
-            // ========== / Fix transparency for 1-bit and nonalpha targets ==========
+    for(const auto& stage : report["stages"].toArray())
+    {
+        const auto object = stage.toObject();
+        if (object["wall_seconds"].toDouble() > 0)
+            addRow(total, object["name"].toString(), object);
+    }
 
-            // ========== crnlib conversion ==========
-            auto crnStyleImage = new crnlib::image_u8((crnlib::color_quad_u8*)img.data(), mipWidth, mipHeight);
+    // Every (mipmap, frame), collapsed
+    auto cells = new QTreeWidgetItem(total, QStringList(tr("Images")));
+    for(const auto& value : report["cell_reports"].toArray())
+    {
+        const auto cell = value.toObject();
+        auto cellItem = new QTreeWidgetItem(cells, QStringList(tr("Mipmap %1, frame %2 (%3)")
+                                                                   .arg(cell["mipmap"].toInt())
+                                                                   .arg(cell["frame"].toInt())
+                                                                   .arg(cell["source"].toString())));
+
+        const auto stages = cell["stages"].toObject();
+        for(auto it = stages.begin(); it != stages.end(); it++)
+            addRow(cellItem, it.key(), it.value().toObject());
+    }
 
-            crnlib::mipmapped_texture mipTex;
-            mipTex.init(mipWidth, mipHeight, 1, 1, crnlib::PIXEL_FMT_A8R8G8B8, "", crnlib::cDefaultOrientationFlags);
-            mipTex.assign(crnStyleImage, crnlib::PIXEL_FMT_A8R8G8B8);
+    total->setExpanded(true);
+    for(int column = 0; column < reportTree->columnCount(); column++)
+        reportTree->resizeColumnToContents(column);
+}
 
-            auto params = crnlib::dxt_image::pack_params();
-            params.m_pProgress_callback = Spraymaker::crnProgressCallback;
-            params.m_num_helper_threads = settings->getCrnHelperThreads();
+SprayEncoder::Parameters Spraymaker::getEncoderParameters()
+{
+    SprayEncoder::Parameters parameters{
+        .format            = spraymakerModel->getFormat(),
+        .crnFormat         = spraymakerModel->mapFormat().crnFormat,
+        .vtfFormat         = spraymakerModel->mapFormat().vtfFormat,
+        .width             = spraymakerModel->getWidth(),
+        .height            = spraymakerModel->getHeight(),
+        .mipmaps           = spraymakerModel->getMipmapCount(),
+        .frames            = spraymakerModel->getFrameCount(),
+        .textureSampleMode = spraymakerModel->getTextureSampleMode(),
+        .autocropMode      = spraymakerModel->getAutocropMode(),
+        .backgroundRed     = spraymakerModel->getBackgroundRed(),
+        .backgroundGreen   = spraymakerModel->getBackgroundGreen(),
+        .backgroundBlue    = spraymakerModel->getBackgroundBlue(),
+        .backgroundAlpha   = spraymakerModel->getBackgroundAlpha(),
+        .alphaThreshold    = settings->getAlphaThreshold(),
+        .crnHelperThreads  = settings->getCrnHelperThreads(),
+        .encoderBackend    = settings->getEncoderBackend(),
+        .mipmapFilter      = settings->getMipmapFilter(),
+        .vtfVersion        = settings->getVtfVersion(),
+        .vtfCrc            = settings->getVtfCrc(),
+    };
 
-            if (mipTex.convert(spraymakerModel->mapFormat().crnFormat, params) == false)
-            {
-                throw SpraymakerException(tr("crnlib error:\n%1").arg(mipTex.get_last_error().c_str()));
-            }
-            // ========== / crnlib conversion ==========
+    if (settings->getUseEncodeCache())
+    {
+        parameters.cacheDirectory = EncodeCache::getDefaultDirectory();
+        parameters.cacheSizeLimit = (qint64)settings->getEncodeCacheSize() * 1024 * 1024;
+    }
 
-            // ========== Buffer copying and pixel alignment ==========
-            if (ImageHelper::isDxt(format))
-            {
-                auto dataVec = mipTex.get_level(0, 0)->get_dxt_image()->get_element_vec();
-                for(const auto& element : dataVec)
-                {
-                    for(int i = 0; i < 8; i++)
-                    {
-                        // TODO: Benchmark vs. memcpy
-                        *pos = element.m_bytes[i];
-                        pos++;
-                    }
-                }
-            }
-            else
-            {
-                auto dataPtr = mipTex.get_level(0, 0)->get_image()->get_ptr();
-                auto count = img.width()*img.height();
-                ImageHelper::convertPixelFormat(dataPtr, pos, count, mipTex.get_format(), format, alphaThreshold);
-                pos += count;
-            }
-            // ========== / Buffer copying and pixel alignment ==========
+    // vips::VImage is reference counted, so this doesn't copy any pixels
+    parameters.images.resize(parameters.mipmaps);
+    parameters.edgeProjections.resize(parameters.mipmaps);
+    parameters.nativeImages.resize(parameters.mipmaps);
+    for(int mipmap = 0; mipmap < parameters.mipmaps; mipmap++)
+    {
+        for(int frame = 0; frame < parameters.frames; frame++)
+        {
+            parameters.images[mipmap].push_back(*spraymakerModel->getImage(mipmap, frame));
+            parameters.edgeProjections[mipmap].push_back(spraymakerModel->getEdgeProjections(mipmap, frame));
 
-            imageProgressBar->setValue(imageProgressBar->value() + 1);
+            const auto native = spraymakerModel->getNativeImage(mipmap, frame);
+            parameters.nativeImages[mipmap].push_back(native ? *native : vips::VImage());
         }
     }
 
-    auto filePath = ("./sprays/" + sprayName + ".vtf").toUtf8();
-    const char* file = filePath;
-    std::ofstream(file, std::ios::binary).write((char*)buffer.get(), spraymakerModel->getVtfFileSize());
-
-    for (const auto& gameSpray : gamesWithSprays)
-    {
-        gameSpray.installSpray(filePath, sprayName, true);
-    }
+    return parameters;
 }
@@ -8,15 +8,25 @@
 #ifndef SPRAYMAKER_H
 #define SPRAYMAKER_H
 
+#include "encodeestimator.h"
 #include "settings.h"
 #include "spraymakermodel.h"
 #include "gamespray.h"
+#include "sprayencoder.h"
+#include "sprayencodeworker.h"
 
+#include <QDockWidget>
+#include <QElapsedTimer>
+#include <QJsonObject>
 #include <QMainWindow>
+#include <QTreeWidget>
 #include <QProgressBar>
+#include <QFutureWatcher>
 
 #include <crnlib.h>
 
+#include <memory>
+
 QT_BEGIN_NAMESPACE
 namespace Ui {
 class Spraymaker;
@@ -34,6 +44,8 @@ public:
 
 private slots:
     void saveSpray();
+    void saveSprayFinished();
+    void showSaveReport(QJsonObject report);
     void aboutDialog();
 
 private:
@@ -60,8 +72,16 @@ private:
     QProgressBar *imageProgressBar;
     QProgressBar *encodingProgressBar;
 
-    QString sprayNamePrompt();
+    QDockWidget *reportDock;
+    QTreeWidget *reportTree;
+
+    SprayEncodeWorker *encodeWorker;
+    QFutureWatcher<SprayEncoder::Result> encodeWatcher;
+    // The save in progress, for its time left
+    std::unique_ptr<EncodeEstimator> encodeEstimator;
+    QElapsedTimer encodeTimer;
 
-    static bool crnProgressCallback(uint percentage_complete, void* pUser_data_ptr);
+    QString sprayNamePrompt(double estimatedSeconds);
+    SprayEncoder::Parameters getEncoderParameters();
 };
 #endif // SPRAYMAKER_H
@@ -6,6 +6,7 @@
  */
 
 #include "spraymakermodel.h"
+#include "edgeprojections.h"
 
 // ========== SpraymakerModel ==========
 
@@ -180,6 +181,14 @@ void SpraymakerModel::resizeVectors()
     files.resize(mipmaps);
     for(auto& mipmap:files)
         mipmap.resize(frames);
+
+    edgeProjections.resize(mipmaps);
+    for(auto& mipmap:edgeProjections)
+        mipmap.resize(frames);
+
+    nativeImages.resize(mipmaps);
+    for(auto& mipmap:nativeImages)
+        mipmap.resize(frames);
 }
 
 void SpraymakerModel::setImage(vips::VImage image, std::string file, int mipmap, int frame)
@@ -208,8 +217,19 @@ void SpraymakerModel::importImage(const ImageInfo& imageInfo, int mipmap, int fr
     // Add each frame individually
     for(int frameOffset = 0; auto const& imageFrame : imageInfo.image)
     {
+        // Autocrop summary, built once per frame so changing the alpha threshold or
+        // autocrop mode never has to look at the pixels again
+        auto pixels = imageFrame.copy();
+        auto projections = std::make_shared<const EdgeProjections>(pixels.data(), pixels.width(), pixels.height());
+
+        // Null for 8-bit files, which also clears the one of an image this replaces
+        auto nativeFrame = frameOffset < imageInfo.nativeImage.size() ? imageInfo.nativeImage[frameOffset]
+                                                                      : vips::VImage();
+
         setImage(imageFrame, imageInfo.file, mipmap, frame + frameOffset);
         setPreview(previewInfo.pixmap.at(frameOffset), mipmap, frame + frameOffset);
+        setEdgeProjections(projections, mipmap, frame + frameOffset);
+        setNativeImage(nativeFrame, mipmap, frame + frameOffset);
 
         if (mipmapPropagationMode == MipmapPropagationMode::FILL
          || mipmapPropagationMode == MipmapPropagationMode::NO_OVERWRITE)
@@ -222,6 +242,8 @@ void SpraymakerModel::importImage(const ImageInfo& imageInfo, int mipmap, int fr
 
                 setImage(imageFrame, imageInfo.file, mipmapIndex, frame + frameOffset);
                 setPreview(previewInfo.pixmap.at(frameOffset), mipmapIndex, frame + frameOffset);
+                setEdgeProjections(projections, mipmapIndex, frame + frameOffset);
+                setNativeImage(nativeFrame, mipmapIndex, frame + frameOffset);
             }
         }
         frameOffset++;
@@ -235,6 +257,8 @@ void SpraymakerModel::copyImage(int fromMipmap, int fromFrame, int toMipmap, int
 
     setImage(images[fromMipmap][fromFrame], files[fromMipmap][fromFrame], toMipmap, toFrame);
     setPreview(previews[fromMipmap][fromFrame], toMipmap, toFrame);
+    setEdgeProjections(edgeProjections[fromMipmap][fromFrame], toMipmap, toFrame);
+    setNativeImage(nativeImages[fromMipmap][fromFrame], toMipmap, toFrame);
 }
 
 void SpraymakerModel::importImages(const std::list<ImageInfo>& imageInfos, int mipmap, int frame)
@@ -270,6 +294,33 @@ void SpraymakerModel::setPreview(QPixmap preview, int mipmap, int frame)
     emit previewChanged(preview, mipmap, frame);
 }
 
+void SpraymakerModel::setEdgeProjections(std::shared_ptr<const EdgeProjections> projections, int mipmap, int frame)
+{
+    if (mipmap >= mipmaps || frame >= frames)
+        return; // Dimensions changed during import/generation process
+
+    edgeProjections[mipmap][frame] = projections;
+}
+
+std::shared_ptr<const EdgeProjections> SpraymakerModel::getEdgeProjections(int mipmap, int frame)
+{ return edgeProjections[mipmap][frame]; }
+
+void SpraymakerModel::setNativeImage(vips::VImage image, int mipmap, int frame)
+{
+    if (mipmap >= mipmaps || frame >= frames)
+        return; // Dimensions changed during import/generation process
+
+    nativeImages[mipmap][frame] = image;
+}
+
+const vips::VImage* SpraymakerModel::getNativeImage(int mipmap, int frame)
+{
+    if (nativeImages[mipmap][frame].is_null())
+        return nullptr;
+
+    return &nativeImages[mipmap][frame];
+}
+
 void SpraymakerModel::setVtfFileSize(int vtfFileSize)
 {
     if (suppress && this->vtfFileSize == vtfFileSize)
@@ -316,6 +367,9 @@ SpraymakerModel::ImageFormat SpraymakerModel::getFormat()
 { return imageFormat; }
 
 SpraymakerModel::Formats SpraymakerModel::mapFormat()
+{ return mapFormat(imageFormat); }
+
+SpraymakerModel::Formats SpraymakerModel::mapFormat(ImageFormat imageFormat)
 {
     for(const auto& format : EnumMapper)
     {
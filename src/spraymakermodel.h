@@ -16,6 +16,10 @@
 
 #include <QObject>
 
+#include <memory>
+
+class EdgeProjections;
+
 class SpraymakerModel : public QObject
 {
     Q_OBJECT
@@ -131,6 +135,31 @@ public:
     };
     Q_ENUM(AutocropMode);
 
+    enum class EncoderBackend : int {
+        INVALID = -1,
+
+        CRNLIB = 0,
+        RANGE_FIT,
+        CLUSTER_FIT,
+
+        _MAX = CLUSTER_FIT,
+        _COUNT,
+    };
+    Q_ENUM(EncoderBackend);
+
+    // How a mipmap showing the same image as the mipmap above it is resampled
+    enum class MipmapFilter : int {
+        INVALID = -1,
+
+        SOURCE = 0, // From the full resolution source, like every other mipmap
+        BOX,        // 2x2 box filter of the mipmap above
+        LANCZOS,    // Lanczos3 of the mipmap above
+
+        _MAX = LANCZOS,
+        _COUNT,
+    };
+    Q_ENUM(MipmapFilter);
+
     struct Formats {
         const ImageFormat format = ImageFormat::INVALID;
         const crnlib::pixel_format crnFormat = crnlib::pixel_format::PIXEL_FMT_INVALID;
@@ -302,35 +331,30 @@ public:
                 .vtfFormat  = VTF_IMAGE_FORMAT::RGBA16161616,
                 .simpleName = "RGBA16161616",
                 .realName   = "RGBA16161616",
-                .hide       = true, // Not implemented correctly
             },{
                 .format     = ImageFormat::RGBA16161616F,
                 .crnFormat  = crnlib::pixel_format::PIXEL_FMT_A8R8G8B8,
                 .vtfFormat  = VTF_IMAGE_FORMAT::RGBA16161616F,
                 .simpleName = "RGBA16161616F",
                 .realName   = "RGBA16161616F",
-                .hide       = true, // Not implemented
             },{
                 .format     = ImageFormat::R32F,
                 .crnFormat  = crnlib::pixel_format::PIXEL_FMT_A8R8G8B8,
                 .vtfFormat  = VTF_IMAGE_FORMAT::R32F,
                 .simpleName = "R32F",
                 .realName   = "R32F",
-                .hide       = true, // Not implemented
             },{
                 .format     = ImageFormat::RGB323232F,
                 .crnFormat  = crnlib::pixel_format::PIXEL_FMT_A8R8G8B8,
                 .vtfFormat  = VTF_IMAGE_FORMAT::RGB323232F,
                 .simpleName = "RGB323232F",
                 .realName   = "RGB323232F",
-                .hide       = true, // Not implemented
             },{
                 .format     = ImageFormat::RGBA32323232F,
                 .crnFormat  = crnlib::pixel_format::PIXEL_FMT_A8R8G8B8,
                 .vtfFormat  = VTF_IMAGE_FORMAT::RGBA32323232F,
                 .simpleName = "RGBA32323232F",
                 .realName   = "RGBA32323232F",
-                .hide       = true, // Not implemented correctly
             },{
                 .format     = ImageFormat::ABGR8888,
                 .crnFormat  = crnlib::pixel_format::PIXEL_FMT_A8R8G8B8,
@@ -375,9 +399,13 @@ public:
     std::string getFile(int mipmap, int frame);
     const vips::VImage* getImage(int mipmap, int frame);
     const QPixmap& getPreview(int mipmap, int frame);
+    std::shared_ptr<const EdgeProjections> getEdgeProjections(int mipmap, int frame);
+    // nullptr unless the image's file has more than 8 bits per channel
+    const vips::VImage* getNativeImage(int mipmap, int frame);
 
     ImageFormat getFormat();
     Formats mapFormat();
+    Formats mapFormat(ImageFormat imageFormat);
 
     MipmapInputMode getMipmapInputMode();
     ResolutionInputMode getResolutionInputMode();
@@ -395,6 +423,10 @@ private:
     std::vector<std::vector<QPixmap>> previews;
     // files[mipmap][frame] = /some/filesystem/path.png
     std::vector<std::vector<std::string>> files;
+    // edgeProjections[mipmap][frame], shared by every cell showing the same imported frame
+    std::vector<std::vector<std::shared_ptr<const EdgeProjections>>> edgeProjections;
+    // nativeImages[mipmap][frame], 16-bit or float RGBA for files with more than 8 bits per channel, otherwise null
+    std::vector<std::vector<vips::VImage>> nativeImages;
 
     void resizeVectors();
 
@@ -430,6 +462,8 @@ public slots:
     void importImages(const std::list<ImageInfo>& files, int mipmap, int frame);
     void copyImage(int fromMipmap, int fromFrame, int toMipmap, int toFrame);
     void setPreview(const QPixmap preview, int mipmap, int frame);
+    void setEdgeProjections(std::shared_ptr<const EdgeProjections> projections, int mipmap, int frame);
+    void setNativeImage(vips::VImage image, int mipmap, int frame);
     void setImage(vips::VImage image, std::string file, int mipmap, int frame);
     void setDimensions(int mipmaps, int frames);
     void setMipmapCount(int mipmaps);
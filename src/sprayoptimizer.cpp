@@ -0,0 +1,442 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "sprayoptimizer.h"
+#include "imagedecoder.h"
+#include "imagehelper.h"
+#include "vtflayout.h"
+
+#include <algorithm>
+#include <climits>
+#include <condition_variable>
+#include <exception>
+#include <thread>
+#include <type_traits>
+
+namespace {
+
+// Formats which store the same pixels, only in another order or with unused bits.
+// Candidates differing only by formats of the same class look the same.
+int getQualityClass(SpraymakerModel::ImageFormat format)
+{
+    switch(format)
+    {
+    case SpraymakerModel::ImageFormat::RGBA8888:
+    case SpraymakerModel::ImageFormat::BGRA8888:
+    case SpraymakerModel::ImageFormat::ABGR8888:
+        return (int)SpraymakerModel::ImageFormat::RGBA8888;
+    case SpraymakerModel::ImageFormat::RGB888:
+    case SpraymakerModel::ImageFormat::BGR888:
+    case SpraymakerModel::ImageFormat::BGRX8888:
+        return (int)SpraymakerModel::ImageFormat::RGB888;
+    case SpraymakerModel::ImageFormat::RGB565:
+    case SpraymakerModel::ImageFormat::BGR565:
+        return (int)SpraymakerModel::ImageFormat::BGR565;
+    case SpraymakerModel::ImageFormat::RGB888_BLUESCREEN:
+    case SpraymakerModel::ImageFormat::BGR888_BLUESCREEN:
+        return (int)SpraymakerModel::ImageFormat::BGR888_BLUESCREEN;
+    default:
+        return (int)format;
+    }
+}
+
+// Nothing at the same resolution can look better
+bool isLossless(SpraymakerModel::ImageFormat format)
+{ return getQualityClass(format) == (int)SpraymakerModel::ImageFormat::RGBA8888; }
+
+// How the encoder treats the format's alpha, so the reference is cropped the same way
+ImageHelper::PixelAlphaMode getPixelAlphaMode(SpraymakerModel::ImageFormat format)
+{
+    if (ImageHelper::hasMultiBitAlpha(format))
+        return ImageHelper::PixelAlphaMode::FULL;
+    return ImageHelper::PixelAlphaMode::THRESHOLD;
+}
+
+} // namespace
+
+SprayOptimizer::SprayOptimizer(SprayEncoder::Parameters parameters, Options options, SpraymakerModel& model)
+    : parameters(parameters)
+    , options(options)
+    , cancelled(false)
+{
+    findCandidates(model);
+    pruneCandidates();
+}
+
+const std::vector<SprayOptimizer::Candidate>& SprayOptimizer::getCandidates() const
+{ return candidates; }
+
+void SprayOptimizer::cancel()
+{
+    cancelled = true;
+
+    std::scoped_lock lock(encodersMutex);
+    for(auto encoder : encoders)
+        encoder->cancel();
+}
+
+bool SprayOptimizer::isCancelled() const
+{ return cancelled; }
+
+void SprayOptimizer::findCandidates(SpraymakerModel& model)
+{
+    const auto reference = model.mapFormat(SpraymakerModel::ImageFormat::RGBA8888);
+    referenceCrnFormat = reference.crnFormat;
+    referenceVtfFormat = reference.vtfFormat;
+
+    // The thumbnail depends on the resolution, so leave room for the largest one
+    const size_t overhead = VtfLayout::getMaxImageOffset(parameters.vtfVersion, parameters.vtfCrc);
+    if (parameters.images.empty() || parameters.frames <= 0
+        || options.maxFileSize <= overhead)
+        return;
+
+    const uint size = std::min<size_t>(options.maxFileSize - overhead, UINT_MAX);
+
+    for(const auto format : options.formats)
+    {
+        const auto formats = model.mapFormat(format);
+        if (formats.crnFormat == crnlib::pixel_format::PIXEL_FMT_INVALID
+            || ImageDecoder::canDecode(format) == false)
+            continue;
+
+        int lastFrames = 0;
+        for(int frameStride = 1; frameStride <= std::max(1, options.maxFrameStride); frameStride++)
+        {
+            // Strides keeping as many frames as a smaller one would only drop different frames
+            const int frames = (parameters.frames + frameStride - 1) / frameStride;
+            if (frames == lastFrames)
+                continue;
+            lastFrames = frames;
+
+            for(const int mipmapCount : options.mipmapCounts)
+            {
+                uint width = 0;
+                uint height = 0;
+                uint mipmaps = std::max(0, mipmapCount);
+
+                ImageHelper::getAutomaticResolution(format, width, height, mipmaps, frames, size);
+                if (width == 0 || height == 0)
+                    continue;
+
+                if (mipmaps == 0)
+                    mipmaps = ImageHelper::getMaxMipmaps(width, height);
+                mipmaps = std::min(mipmaps, ImageHelper::getMaxMipmaps(width, height));
+
+                Candidate candidate{
+                    .format      = format,
+                    .crnFormat   = formats.crnFormat,
+                    .vtfFormat   = formats.vtfFormat,
+                    .width       = (int)width,
+                    .height      = (int)height,
+                    .mipmaps     = (int)mipmaps,
+                    .frames      = frames,
+                    .frameStride = frameStride,
+                    .fileSize    = VtfLayout(parameters.vtfVersion, parameters.vtfCrc, width, height).getImageOffset()
+                                 + ImageHelper::getImageDataSize(format, width, height, mipmaps, frames),
+                };
+
+                if (candidate.fileSize <= options.maxFileSize)
+                    candidates.push_back(candidate);
+            }
+        }
+    }
+}
+
+void SprayOptimizer::pruneCandidates()
+{
+    // b makes a pointless to try when it has at least a's resolution, mipmaps and frames,
+    // and can't look worse at that resolution
+    auto dominates = [](const Candidate& b, const Candidate& a){
+        return b.frameStride == a.frameStride
+            && b.mipmaps >= a.mipmaps
+            && b.width   >= a.width
+            && b.height  >= a.height
+            && (getQualityClass(b.format) == getQualityClass(a.format) || isLossless(b.format));
+    };
+
+    std::vector<Candidate> kept;
+    for(size_t i = 0; i < candidates.size(); i++)
+    {
+        bool dominated = false;
+        for(size_t j = 0; j < candidates.size() && dominated == false; j++)
+        {
+            if (i == j || dominates(candidates[j], candidates[i]) == false)
+                continue;
+
+            // Of two that dominate each other, keep the first
+            dominated = dominates(candidates[i], candidates[j]) == false || j < i;
+        }
+
+        if (dominated == false)
+            kept.push_back(candidates[i]);
+    }
+
+    candidates = std::move(kept);
+}
+
+SprayOptimizer::Result SprayOptimizer::optimize(ProgressCallback progressCallback)
+{
+    const int candidateCount = candidates.size();
+
+    // Every candidate is compared at about the largest candidate's resolution
+    referenceSize = 0;
+    for(const auto& candidate : candidates)
+        referenceSize = std::max({referenceSize, candidate.width, candidate.height});
+
+    // Trial encodes are small, so run several at once with the cores split between them
+    const int threads = parameters.threads > 0 ? parameters.threads
+                                               : std::max(1U, std::thread::hardware_concurrency());
+    const int workers = std::clamp(threads, 1, std::max(1, candidateCount));
+    const int threadsPerCandidate = std::max(1, threads / workers);
+
+    std::vector<bool> scored(candidateCount, false);
+    std::atomic<int> nextCandidate = 0;
+    std::atomic<int> candidatesFinished = 0;
+    std::atomic<bool> failed = false;
+    std::exception_ptr error;
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    int running = workers;
+
+    auto worker = [&](){
+        for(int index = nextCandidate++;
+            index < candidateCount && failed == false && cancelled == false;
+            index = nextCandidate++)
+        {
+            try
+            {
+                if (scoreCandidate(candidates[index], threadsPerCandidate))
+                {
+                    std::scoped_lock lock(mutex);
+                    scored[index] = true;
+                }
+                candidatesFinished++;
+            }
+            catch (...)
+            {
+                std::scoped_lock lock(mutex);
+                if (failed.exchange(true) == false)
+                    error = std::current_exception();
+            }
+        }
+
+        std::scoped_lock lock(mutex);
+        running--;
+        finished.notify_all();
+    };
+
+    {
+        std::vector<std::jthread> threadPool;
+        for(int i = 0; i < workers; i++)
+            threadPool.emplace_back(worker);
+
+        // Report progress from the calling thread while the workers run
+        std::unique_lock lock(mutex);
+        while(running > 0)
+        {
+            finished.wait_for(lock, std::chrono::milliseconds(50));
+            lock.unlock();
+            progressCallback(candidatesFinished, candidateCount);
+            lock.lock();
+        }
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+
+    progressCallback(candidatesFinished, candidateCount);
+
+    Result result;
+    result.cancelled = cancelled;
+
+    for(int index = 0; index < candidateCount; index++)
+    {
+        if (scored[index])
+            result.candidates.push_back(candidates[index]);
+    }
+
+    std::stable_sort(result.candidates.begin(), result.candidates.end(), isBetter);
+
+    return result;
+}
+
+SprayEncoder::Parameters SprayOptimizer::getParameters(const Candidate& candidate) const
+{
+    auto candidateParameters = parameters;
+    candidateParameters.format    = candidate.format;
+    candidateParameters.crnFormat = candidate.crnFormat;
+    candidateParameters.vtfFormat = candidate.vtfFormat;
+    candidateParameters.width     = candidate.width;
+    candidateParameters.height    = candidate.height;
+    candidateParameters.mipmaps   = candidate.mipmaps;
+    candidateParameters.frames    = candidate.frames;
+
+    // Mipmaps the spray didn't have are filled with its top mipmap's frames,
+    // like MipmapPropagationMode::FILL
+    auto selectFrames = [&](const auto& mipmapRows){
+        std::decay_t<decltype(mipmapRows)> rows(candidate.mipmaps);
+        if (mipmapRows.empty())
+            return rows;
+
+        for(int mipmap = 0; mipmap < candidate.mipmaps; mipmap++)
+        {
+            const auto& source = mipmapRows[(size_t)mipmap < mipmapRows.size() ? mipmap : 0];
+            for(int frame = 0; frame < candidate.frames; frame++)
+            {
+                const size_t sourceFrame = (size_t)frame * candidate.frameStride;
+                if (sourceFrame < source.size())
+                    rows[mipmap].push_back(source[sourceFrame]);
+            }
+        }
+        return rows;
+    };
+
+    candidateParameters.images = selectFrames(parameters.images);
+    candidateParameters.edgeProjections = selectFrames(parameters.edgeProjections);
+    candidateParameters.nativeImages = selectFrames(parameters.nativeImages);
+
+    return candidateParameters;
+}
+
+bool SprayOptimizer::scoreCandidate(Candidate& candidate, int threads)
+{
+    // ========== Encode the candidate ==========
+    auto candidateParameters = getParameters(candidate);
+    candidateParameters.threads = threads;
+    candidateParameters.cacheSizeLimit = 0; // Left to the final encode
+    candidateParameters.computeMetrics = false; // Scored against the reference instead
+
+    SprayEncoder encoder(candidateParameters);
+    std::vector<uchar> data;
+    if (encode(encoder, data) == false)
+        return false;
+    // ========== / Encode the candidate ==========
+
+    // ========== Render the reference ==========
+    // Integer scale of the candidate's resolution, so both are padded to the same aspect
+    // ratio and the candidate's pixels land on whole reference pixels
+    const int scale = std::max(1, (referenceSize + std::max(candidate.width, candidate.height) - 1)
+                                  / std::max(candidate.width, candidate.height));
+    const int referenceWidth = candidate.width * scale;
+    const int referenceHeight = candidate.height * scale;
+
+    // Every source frame, at the top mipmap, uncompressed and cropped like the candidate
+    auto referenceParameters = parameters;
+    referenceParameters.format         = SpraymakerModel::ImageFormat::RGBA8888;
+    referenceParameters.crnFormat      = referenceCrnFormat;
+    referenceParameters.vtfFormat      = referenceVtfFormat;
+    referenceParameters.width          = referenceWidth;
+    referenceParameters.height         = referenceHeight;
+    referenceParameters.mipmaps        = 1;
+    referenceParameters.pixelAlphaMode = getPixelAlphaMode(candidate.format);
+    referenceParameters.mipmapFilter   = SpraymakerModel::MipmapFilter::SOURCE;
+    referenceParameters.threads        = threads;
+    referenceParameters.computeMetrics = false;
+    referenceParameters.vtfVersion     = VtfLayout::minMinorVersion; // Only the pixels are compared
+    referenceParameters.vtfCrc         = false;
+    referenceParameters.cacheDirectory.clear();
+    referenceParameters.images.resize(1);
+    if (referenceParameters.edgeProjections.empty() == false)
+        referenceParameters.edgeProjections.resize(1);
+
+    SprayEncoder referenceEncoder(referenceParameters);
+    std::vector<uchar> referenceData;
+    if (encode(referenceEncoder, referenceData) == false)
+        return false;
+    // ========== / Render the reference ==========
+
+    // ========== Compare ==========
+    std::vector<uchar> decoded((size_t)candidate.width * candidate.height * 4);
+    std::vector<uchar> upscaled((size_t)referenceWidth * referenceHeight * 4);
+
+    std::vector<const SprayEncoder::Cell*> topCells(candidate.frames);
+    for(const auto& cell : encoder.getCells())
+    {
+        if (cell.mipmap == 0)
+            topCells[cell.frame] = &cell;
+    }
+
+    std::vector<const SprayEncoder::Cell*> referenceCells(parameters.frames);
+    for(const auto& cell : referenceEncoder.getCells())
+        referenceCells[cell.frame] = &cell;
+
+    candidate.errors = ImageMetrics::Errors();
+
+    for(int frame = 0; frame < candidate.frames && cancelled == false; frame++)
+    {
+        const auto cell = topCells[frame];
+        if (ImageDecoder::decodeParallel(candidate.format, data.data() + cell->offset,
+                                         cell->width, cell->height, decoded.data(), threads) == false)
+            return false;
+
+        // Filtered like the game draws it, premultiplied so transparent pixels don't bleed
+        auto img = vips::VImage::new_from_memory(decoded.data(), decoded.size(),
+                                                 cell->width, cell->height, 4, VIPS_FORMAT_UCHAR);
+        img = img.premultiply()
+                  .resize(scale, vips::VImage::option()->set("kernel", VIPS_KERNEL_LINEAR))
+                  .unpremultiply()
+                  .cast(VIPS_FORMAT_UCHAR);
+        img.write(vips::VImage::new_from_memory(upscaled.data(), upscaled.size(),
+                                                referenceWidth, referenceHeight, 4, VIPS_FORMAT_UCHAR));
+
+        // Skipped frames are scored against the frame shown in their place
+        const int firstSourceFrame = frame * candidate.frameStride;
+        const int lastSourceFrame = std::min(firstSourceFrame + candidate.frameStride, parameters.frames);
+        for(int sourceFrame = firstSourceFrame; sourceFrame < lastSourceFrame; sourceFrame++)
+        {
+            candidate.errors += ImageMetrics::compare(referenceData.data() + referenceCells[sourceFrame]->offset,
+                                                      upscaled.data(), referenceWidth, referenceHeight);
+        }
+    }
+    // ========== / Compare ==========
+
+    return cancelled == false;
+}
+
+bool SprayOptimizer::encode(SprayEncoder& encoder, std::vector<uchar>& data)
+{
+    {
+        std::scoped_lock lock(encodersMutex);
+        if (cancelled)
+            return false;
+        encoders.insert(&encoder);
+    }
+
+    data.resize(encoder.getFileSize());
+
+    SprayEncoder::Result result;
+    try
+    {
+        result = encoder.encode(data.data(), [](int, int){});
+    }
+    catch (...)
+    {
+        std::scoped_lock lock(encodersMutex);
+        encoders.erase(&encoder);
+        throw;
+    }
+
+    std::scoped_lock lock(encodersMutex);
+    encoders.erase(&encoder);
+    return result.cancelled == false;
+}
+
+bool SprayOptimizer::isBetter(const Candidate& a, const Candidate& b)
+{
+    const double psnrA = a.errors.getPsnr();
+    const double psnrB = b.errors.getPsnr();
+    if (psnrA != psnrB)
+        return psnrA > psnrB;
+
+    // Equally good: prefer mipmaps and smooth animation, then the smaller file
+    if (a.mipmaps != b.mipmaps)
+        return a.mipmaps > b.mipmaps;
+    if (a.frames != b.frames)
+        return a.frames > b.frames;
+    return a.fileSize < b.fileSize;
+}
@@ -0,0 +1,107 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPRAYOPTIMIZER_H
+#define SPRAYOPTIMIZER_H
+
+#include "imagemetrics.h"
+#include "sprayencoder.h"
+#include "spraymakermodel.h"
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <vector>
+
+// ========== SprayOptimizer ==========
+
+// Finds the best looking spray fitting a file size limit.
+// Every (format, resolution, mipmaps, frames) that fits is found analytically and the
+// candidates which can't win are dropped. The rest are trial encoded in parallel, decoded,
+// and compared against a render of the source at a higher resolution.
+class SprayOptimizer
+{
+public:
+    struct Options
+    {
+        std::vector<SpraymakerModel::ImageFormat> formats;
+        size_t maxFileSize = 512*1024;
+
+        // 0 uses as many as the resolution allows
+        std::vector<int> mipmapCounts = {1};
+
+        // Also tries keeping only every 2nd, 3rd, ... frame, trading smoothness for resolution
+        int maxFrameStride = 1;
+    };
+
+    struct Candidate
+    {
+        SpraymakerModel::ImageFormat format = SpraymakerModel::ImageFormat::INVALID;
+        crnlib::pixel_format crnFormat = crnlib::pixel_format::PIXEL_FMT_INVALID;
+        VTF_IMAGE_FORMAT vtfFormat = VTF_IMAGE_FORMAT::NONE;
+
+        int width = 0;
+        int height = 0;
+        int mipmaps = 0;
+        int frames = 0;
+        int frameStride = 1;
+        size_t fileSize = 0;
+
+        // Top mipmap of every source frame against the reference, set by the trial encode
+        ImageMetrics::Errors errors;
+    };
+
+    struct Result
+    {
+        bool cancelled = false;
+        // Trial encoded candidates, best first
+        std::vector<Candidate> candidates;
+    };
+
+    // Called on the thread which called optimize()
+    using ProgressCallback = std::function<void(int candidatesFinished, int candidates)>;
+
+    // parameters is the spray as it would be encoded, its format and size are replaced
+    SprayOptimizer(SprayEncoder::Parameters parameters, Options options, SpraymakerModel& model);
+
+    // The candidates left after pruning, before anything is encoded
+    const std::vector<Candidate>& getCandidates() const;
+
+    Result optimize(ProgressCallback progressCallback);
+
+    // parameters with the candidate's format, resolution, mipmaps and frames
+    SprayEncoder::Parameters getParameters(const Candidate& candidate) const;
+
+    // Thread-safe. Cancels the trial encodes in progress.
+    void cancel();
+    bool isCancelled() const;
+
+private:
+    SprayEncoder::Parameters parameters;
+    Options options;
+    std::vector<Candidate> candidates;
+
+    // The reference is uncompressed, at about this size
+    crnlib::pixel_format referenceCrnFormat = crnlib::pixel_format::PIXEL_FMT_INVALID;
+    VTF_IMAGE_FORMAT referenceVtfFormat = VTF_IMAGE_FORMAT::NONE;
+    int referenceSize = 0;
+
+    std::atomic<bool> cancelled;
+    std::mutex encodersMutex;
+    std::set<SprayEncoder*> encoders;
+
+    void findCandidates(SpraymakerModel& model);
+    void pruneCandidates();
+    // False if cancelled
+    bool scoreCandidate(Candidate& candidate, int threads);
+    bool encode(SprayEncoder& encoder, std::vector<uchar>& data);
+
+    static bool isBetter(const Candidate& a, const Candidate& b);
+};
+
+#endif // SPRAYOPTIMIZER_H
@@ -0,0 +1,51 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "stagetimer.h"
+
+#include <QtGlobal>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+StageTimer::StageTimer()
+{ restart(); }
+
+void StageTimer::restart()
+{
+    wallStart = std::chrono::steady_clock::now();
+    cpuStart = getThreadCpuSeconds();
+}
+
+double StageTimer::getWallSeconds() const
+{ return std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count(); }
+
+double StageTimer::getCpuSeconds() const
+{ return getThreadCpuSeconds() - cpuStart; }
+
+double StageTimer::getThreadCpuSeconds()
+{
+#ifdef Q_OS_WIN
+    FILETIME creation, exit, kernel, user;
+    if (GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user) == 0)
+        return 0;
+
+    // 100 ns ticks
+    auto ticks = [](const FILETIME& time){
+        return ((quint64)time.dwHighDateTime << 32 | time.dwLowDateTime) * 1e-7;
+    };
+    return ticks(kernel) + ticks(user);
+#else
+    timespec time;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0)
+        return 0;
+    return time.tv_sec + time.tv_nsec * 1e-9;
+#endif
+}
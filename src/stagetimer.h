@@ -0,0 +1,34 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STAGETIMER_H
+#define STAGETIMER_H
+
+#include <chrono>
+
+// ========== StageTimer ==========
+
+// Wall clock and CPU time of the calling thread since the timer was started.
+// The CPU time doesn't include helper threads the work is handed to, like crnlib's.
+class StageTimer
+{
+public:
+    StageTimer();
+
+    void restart();
+
+    double getWallSeconds() const;
+    double getCpuSeconds() const;
+
+    static double getThreadCpuSeconds();
+
+private:
+    std::chrono::steady_clock::time_point wallStart;
+    double cpuStart;
+};
+
+#endif // STAGETIMER_H
@@ -98,7 +98,7 @@ constexpr enum VTF_FLAGS operator ~(const enum VTF_FLAGS selfValue)
 { return (enum VTF_FLAGS)(~uint32_t(selfValue)); }
 
 #pragma pack(push,1)
-// Only VTF version 7.1 is relevant for our purposes
+// Version 7.1, what Spraymaker writes by default
 struct VTF_HEADER_71
 {
     char              signature[4];
@@ -120,6 +120,48 @@ struct VTF_HEADER_71
     uint8_t           lowResImageHeight;
     uint8_t           padding2;
 };
+
+// Versions 7.2 to 7.5. 7.2 adds depth, 7.3 adds resourceCount VTF_RESOURCE entries
+// straight after the header, which say where the thumbnail and image data are.
+struct VTF_HEADER_73
+{
+    char              signature[4];
+    uint32_t          version[2];
+    uint32_t          headerSize; // Including the resource entries
+    uint16_t          width;
+    uint16_t          height;
+    VTF_FLAGS         flags;
+    uint16_t          frames;
+    uint16_t          firstFrame;
+    uint8_t           padding0[4];
+    float             reflectivity[3];
+    uint8_t           padding1[4];
+    float             bumpmapScale;
+    VTF_IMAGE_FORMAT  highResImageFormat;
+    uint8_t           mipmapCount;
+    VTF_IMAGE_FORMAT  lowResImageFormat;
+    uint8_t           lowResImageWidth;
+    uint8_t           lowResImageHeight;
+    uint16_t          depth;
+    uint8_t           padding2[3];
+    uint32_t          resourceCount;
+    uint8_t           padding3[8];
+};
+
+struct VTF_RESOURCE
+{
+    uint8_t           type[3];
+    uint8_t           flags;
+    uint32_t          data; // Offset of the resource's data, or the data itself with NO_DATA_CHUNK
+};
 #pragma pack(pop)
 
+// VTF_RESOURCE::flags
+constexpr uint8_t VTF_RESOURCE_NO_DATA_CHUNK = 0x02;
+
+// VTF_RESOURCE::type
+constexpr uint8_t VTF_RESOURCE_LOW_RES_IMAGE[3]  = {0x01, 0x00, 0x00};
+constexpr uint8_t VTF_RESOURCE_HIGH_RES_IMAGE[3] = {0x30, 0x00, 0x00};
+constexpr uint8_t VTF_RESOURCE_CRC[3]            = {'C', 'R', 'C'};
+
 #endif // VTF_DEFS_H
@@ -0,0 +1,109 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "vtflayout.h"
+#include "imagehelper.h"
+
+#include <algorithm>
+#include <array>
+
+VtfLayout::VtfLayout(int minorVersion, bool crc, int width, int height)
+    : minorVersion(std::clamp(minorVersion, minMinorVersion, maxMinorVersion))
+    , crc(crc && this->minorVersion >= 3)
+{
+    if (this->minorVersion == 1)
+    {
+        headerSize = sizeof(VTF_HEADER_71);
+        return;
+    }
+
+    // Halve the same way mipmaps are until it fits, so the thumbnail can be made from one
+    thumbnailWidth = std::max(1, width);
+    thumbnailHeight = std::max(1, height);
+    while(thumbnailWidth > maxThumbnailSize || thumbnailHeight > maxThumbnailSize)
+    {
+        thumbnailWidth = std::max(1, thumbnailWidth / 2);
+        thumbnailHeight = std::max(1, thumbnailHeight / 2);
+    }
+    thumbnailSize = ImageHelper::getImageDataSize(SpraymakerModel::ImageFormat::DXT1,
+                                                  thumbnailWidth, thumbnailHeight, 1, 1);
+
+    // 7.2 has no resources, the thumbnail and image data simply follow the header
+    headerSize = sizeof(VTF_HEADER_73);
+    if (this->minorVersion >= 3)
+        headerSize += getResources(0).size() * sizeof(VTF_RESOURCE);
+}
+
+int VtfLayout::getMinorVersion() const
+{ return minorVersion; }
+
+bool VtfLayout::hasCrc() const
+{ return crc; }
+
+size_t VtfLayout::getHeaderSize() const
+{ return headerSize; }
+
+size_t VtfLayout::getImageOffset() const
+{ return headerSize + thumbnailSize; }
+
+int VtfLayout::getThumbnailWidth() const
+{ return thumbnailWidth; }
+
+int VtfLayout::getThumbnailHeight() const
+{ return thumbnailHeight; }
+
+size_t VtfLayout::getThumbnailOffset() const
+{ return headerSize; }
+
+size_t VtfLayout::getThumbnailSize() const
+{ return thumbnailSize; }
+
+std::vector<VTF_RESOURCE> VtfLayout::getResources(uint32_t crcValue) const
+{
+    std::vector<VTF_RESOURCE> resources;
+    if (minorVersion < 3)
+        return resources;
+
+    auto add = [&](const uint8_t (&type)[3], uint8_t flags, uint32_t data){
+        resources.push_back(VTF_RESOURCE{
+            .type  = {type[0], type[1], type[2]},
+            .flags = flags,
+            .data  = data,
+        });
+    };
+
+    // Sorted by type, which is how Valve's tools write them
+    add(VTF_RESOURCE_LOW_RES_IMAGE, 0, (uint32_t)getThumbnailOffset());
+    add(VTF_RESOURCE_HIGH_RES_IMAGE, 0, (uint32_t)getImageOffset());
+    if (crc)
+        add(VTF_RESOURCE_CRC, VTF_RESOURCE_NO_DATA_CHUNK, crcValue);
+
+    return resources;
+}
+
+size_t VtfLayout::getMaxImageOffset(int minorVersion, bool crc)
+{ return VtfLayout(minorVersion, crc, maxThumbnailSize, maxThumbnailSize).getImageOffset(); }
+
+uint32_t VtfLayout::crc32(const uchar* data, size_t size, uint32_t crc)
+{
+    static constexpr auto table = [](){
+        std::array<uint32_t, 256> table;
+        for(uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t value = i;
+            for(int bit = 0; bit < 8; bit++)
+                value = value & 1 ? (value >> 1) ^ 0xedb88320 : value >> 1;
+            table[i] = value;
+        }
+        return table;
+    }();
+
+    crc = ~crc;
+    for(size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
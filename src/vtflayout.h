@@ -0,0 +1,64 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef VTFLAYOUT_H
+#define VTFLAYOUT_H
+
+#include "vtf_defs.h"
+
+#include <QtGlobal>
+
+#include <vector>
+
+// ========== VtfLayout ==========
+
+// Where everything before the high-res image data goes in a VTF file of one version:
+// header, resource directory and the DXT1 low-res thumbnail.
+// 7.1 is written like Spraymaker always has, without a thumbnail.
+class VtfLayout
+{
+public:
+    VtfLayout(int minorVersion, bool crc, int width, int height);
+
+    int getMinorVersion() const;
+    bool hasCrc() const;
+
+    // Header and resource entries
+    size_t getHeaderSize() const;
+    // First byte of the high-res image data, everything before it is overhead
+    size_t getImageOffset() const;
+
+    // 0x0 without a thumbnail
+    int getThumbnailWidth() const;
+    int getThumbnailHeight() const;
+    size_t getThumbnailOffset() const;
+    size_t getThumbnailSize() const;
+
+    // The resource entries for the header, crcValue is only used by the CRC resource
+    std::vector<VTF_RESOURCE> getResources(uint32_t crcValue) const;
+
+    // Largest getImageOffset() of any resolution, for picking a resolution which fits a file size
+    static size_t getMaxImageOffset(int minorVersion, bool crc);
+
+    // CRC-32 as used by zlib and PNG
+    static uint32_t crc32(const uchar* data, size_t size, uint32_t crc = 0);
+
+    static constexpr int minMinorVersion = 1;
+    static constexpr int maxMinorVersion = 5;
+    // The thumbnail is the largest mipmap size fitting in this, like Valve's tools
+    static constexpr int maxThumbnailSize = 16;
+
+private:
+    int minorVersion;
+    bool crc;
+    size_t headerSize;
+    int thumbnailWidth = 0;
+    int thumbnailHeight = 0;
+    size_t thumbnailSize = 0;
+};
+
+#endif // VTFLAYOUT_H
@@ -0,0 +1,381 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "vtfreader.h"
+#include "imagedecoder.h"
+#include "imagehelper.h"
+#include "spraymakerexception.h"
+#include "vtflayout.h"
+
+#include <QObject>
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// ========== Lazy images ==========
+// A VipsImage whose pixels are generated by decoding rows of one (mipmap, frame) when they're
+// read. It owns one of these, and with it a reference to the reader.
+struct LazyFrame
+{
+    std::shared_ptr<const VtfReader> reader;
+    int mipmap;
+    int frame;
+};
+
+// Every thread libvips generates the image on gets its own rows to decode into
+void* startRows(VipsImage*, void*, void*)
+{ return new std::vector<uchar>(); }
+
+int stopRows(void* seq, void*, void*)
+{
+    delete (std::vector<uchar>*)seq;
+    return 0;
+}
+
+int generateRows(VipsRegion* out, void* seq, void* a, void*, gboolean*)
+{
+    const auto* lazy = (const LazyFrame*)a;
+    auto& rows = *(std::vector<uchar>*)seq;
+    const VipsRect& rect = out->valid;
+
+    // Whole rows are decoded, every DXT block row holds all of its columns anyway
+    const int width = lazy->reader->getView(lazy->mipmap, lazy->frame).width;
+    rows.resize((size_t)width * rect.height * 4);
+    if (lazy->reader->decodeRows(lazy->mipmap, lazy->frame, rect.top, rect.height, rows.data()) == false)
+    {
+        vips_error("VtfReader", "%s", QObject::tr("Failed to decode the image data.").toUtf8().constData());
+        return -1;
+    }
+
+    for(int y = 0; y < rect.height; y++)
+    {
+        std::memcpy(VIPS_REGION_ADDR(out, rect.left, rect.top + y),
+                    rows.data() + ((size_t)y * width + rect.left) * 4,
+                    (size_t)rect.width * 4);
+    }
+
+    return 0;
+}
+
+void freeLazyFrame(VipsImage*, void* lazy)
+{ delete (LazyFrame*)lazy; }
+// ========== / Lazy images ==========
+
+} // namespace
+
+VtfReader::VtfReader(QString filePath)
+    : file(filePath)
+{
+    if (file.open(QIODevice::ReadOnly) == false)
+        throw SpraymakerException(QObject::tr("Failed to open %1").arg(filePath), file.errorString());
+
+    fileSize = file.size();
+    mapped = file.map(0, fileSize);
+
+    if (mapped == nullptr)
+    {
+        fallbackBuffer = std::make_unique<uchar[]>(fileSize);
+        if (file.read((char*)fallbackBuffer.get(), fileSize) != (qint64)fileSize)
+            throw SpraymakerException(QObject::tr("Failed to read %1").arg(filePath), file.errorString());
+        mapped = fallbackBuffer.get();
+    }
+
+    parseHeader();
+}
+
+VtfReader::~VtfReader()
+{
+    if (fallbackBuffer == nullptr && mapped != nullptr)
+        file.unmap((uchar*)mapped);
+}
+
+int VtfReader::getMinorVersion() const
+{ return minorVersion; }
+
+int VtfReader::getWidth() const
+{ return width; }
+
+int VtfReader::getHeight() const
+{ return height; }
+
+int VtfReader::getMipmaps() const
+{ return mipmaps; }
+
+int VtfReader::getFrames() const
+{ return frames; }
+
+VTF_FLAGS VtfReader::getFlags() const
+{ return flags; }
+
+VTF_IMAGE_FORMAT VtfReader::getVtfFormat() const
+{ return vtfFormat; }
+
+SpraymakerModel::ImageFormat VtfReader::getFormat() const
+{ return format; }
+
+const VtfReader::View& VtfReader::getView(int mipmap, int frame) const
+{ return views.at(mipmap * frames + frame); }
+
+bool VtfReader::canDecode() const
+{ return ImageDecoder::canDecode(format); }
+
+vips::VImage VtfReader::getImage(int mipmap, int frame) const
+{
+    if (canDecode() == false)
+        throw SpraymakerException(QObject::tr("%1 can't be decoded, its format isn't supported.").arg(file.fileName()));
+
+    const auto& view = getView(mipmap, frame);
+
+    VipsImage* image = vips_image_new();
+    vips_image_init_fields(image, view.width, view.height, 4, VIPS_FORMAT_UCHAR, VIPS_CODING_NONE,
+                           VIPS_INTERPRETATION_sRGB, 1.0, 1.0);
+
+    // Freed with the image, also when setting it up fails below
+    auto* lazy = new LazyFrame{shared_from_this(), mipmap, frame};
+    g_signal_connect(image, "postclose", G_CALLBACK(freeLazyFrame), lazy);
+
+    if (vips_image_pipelinev(image, VIPS_DEMAND_STYLE_THINSTRIP, nullptr) != 0
+        || vips_image_generate(image, startRows, generateRows, stopRows, lazy, nullptr) != 0)
+    {
+        g_object_unref(image);
+        throw vips::VError();
+    }
+
+    return vips::VImage(image);
+}
+
+bool VtfReader::decodeRows(int mipmap, int frame, int top, int count, uchar* rgba) const
+{
+    const auto& view = getView(mipmap, frame);
+    if (top < 0 || count < 0 || top + count > view.height)
+        return false;
+
+    if (ImageHelper::isDxt(format) == false)
+    {
+        const size_t rowSize = getDataSize(format, view.width, 1);
+        return ImageDecoder::decode(format, view.data + top * rowSize, view.width, count, rgba);
+    }
+
+    // Block rows which are only partly wanted are decoded on the side
+    const size_t blockRowSize = getDataSize(format, view.width, 4);
+    const size_t pixelRowSize = (size_t)view.width * 4;
+    std::vector<uchar> partial;
+
+    for(int y = top; y < top + count;)
+    {
+        const int blockTop = y & ~3;
+        const int rows = std::min(4, view.height - blockTop);
+        const int skip = y - blockTop;
+        const int take = std::min(rows - skip, top + count - y);
+        const uchar* blocks = view.data + (blockTop / 4) * blockRowSize;
+        uchar* out = rgba + (y - top) * pixelRowSize;
+
+        if (skip == 0 && take == rows)
+        {
+            if (ImageDecoder::decode(format, blocks, view.width, rows, out) == false)
+                return false;
+        }
+        else
+        {
+            partial.resize(pixelRowSize * 4);
+            if (ImageDecoder::decode(format, blocks, view.width, rows, partial.data()) == false)
+                return false;
+            std::memcpy(out, partial.data() + skip * pixelRowSize, take * pixelRowSize);
+        }
+
+        y += take;
+    }
+
+    return true;
+}
+
+bool VtfReader::isVtfFile(QString filePath)
+{
+    QFile file(filePath);
+    if (file.open(QIODevice::ReadOnly) == false)
+        return false;
+
+    char signature[4];
+    return file.read(signature, 4) == 4 && std::memcmp(signature, "VTF", 4) == 0;
+}
+
+void VtfReader::parseHeader()
+{
+    auto invalid = [=, this](QString reason){
+        return SpraymakerException(QObject::tr("%1 isn't a valid VTF file.").arg(file.fileName()), reason);
+    };
+    auto unsupported = [=, this](QString reason){
+        return SpraymakerException(QObject::tr("%1 isn't supported.").arg(file.fileName()), reason);
+    };
+
+    // Unaligned within the mapping, so the header structures are copied out
+    VTF_HEADER_71 header;
+    if (fileSize < sizeof(header))
+        throw invalid("File is smaller than a VTF header");
+    std::memcpy(&header, mapped, sizeof(header));
+
+    if (std::memcmp(header.signature, "VTF", 4) != 0)
+        throw invalid("Missing VTF signature");
+    if (header.version[0] != 7 || header.version[1] > VtfLayout::maxMinorVersion)
+        throw unsupported(QString("VTF version %1.%2").arg(header.version[0]).arg(header.version[1]));
+    if (header.headerSize < sizeof(VTF_HEADER_71) || header.headerSize > fileSize)
+        throw invalid(QString("Header size %1").arg(header.headerSize));
+
+    minorVersion = header.version[1];
+    width = header.width;
+    height = header.height;
+    mipmaps = header.mipmapCount;
+    frames = std::max<int>(1, header.frames);
+    flags = header.flags;
+    vtfFormat = header.highResImageFormat;
+    format = mapFormat(vtfFormat, flags);
+
+    if (minorVersion >= 2)
+    {
+        VTF_HEADER_73 header73;
+        if (header.headerSize < sizeof(header73))
+            throw invalid(QString("Header size %1").arg(header.headerSize));
+        std::memcpy(&header73, mapped, sizeof(header73));
+
+        if (header73.depth > 1)
+            throw unsupported(QString("Volume texture, depth %1").arg(header73.depth));
+    }
+
+    if ((flags & VTF_FLAGS::ENVMAP) != VTF_FLAGS::NONE)
+        throw unsupported("Cubemap");
+    if (width == 0 || height == 0)
+        throw invalid(QString("Size %1x%2").arg(width).arg(height));
+    if (width > (int)crn_limits::cCRNMaxLevelResolution || height > (int)crn_limits::cCRNMaxLevelResolution)
+        throw unsupported(QString("Size %1x%2").arg(width).arg(height));
+    if (mipmaps < 1 || mipmaps > (int)ImageHelper::getMaxMipmaps(width, height))
+        throw invalid(QString("%1 mipmaps at %2x%3").arg(mipmaps).arg(width).arg(height));
+    if (format == SpraymakerModel::ImageFormat::INVALID
+        || ImageHelper::getImageDataSize(format, 1, 1, 1, 1) == 0)
+        throw unsupported(QString("Image format %1").arg((uint32_t)vtfFormat));
+
+    // Mipmaps are stored smallest to largest, the same as SprayEncoder lays them out
+    size_t offset = findImageOffset(header);
+    views.resize((size_t)mipmaps * frames);
+    for(int mipmap = mipmaps - 1; mipmap >= 0; mipmap--)
+    {
+        const int mipWidth  = std::max(1, width  >> mipmap);
+        const int mipHeight = std::max(1, height >> mipmap);
+        const size_t size = getDataSize(format, mipWidth, mipHeight);
+
+        for(int frame = 0; frame < frames; frame++)
+        {
+            if (offset > fileSize || size > fileSize - offset)
+                throw invalid(QString("Image data ends at %1, past the end of the file").arg(offset + size));
+
+            views[mipmap * frames + frame] = View{
+                .mipmap = mipmap,
+                .frame  = frame,
+                .width  = mipWidth,
+                .height = mipHeight,
+                .data   = mapped + offset,
+                .size   = size,
+            };
+            offset += size;
+        }
+    }
+}
+
+size_t VtfReader::findImageOffset(const VTF_HEADER_71& header) const
+{
+    // 7.3 and up say where it is in the resource directory
+    if (minorVersion >= 3)
+    {
+        VTF_HEADER_73 header73;
+        std::memcpy(&header73, mapped, sizeof(header73));
+
+        const size_t count = header73.resourceCount;
+        if (count > (fileSize - sizeof(header73)) / sizeof(VTF_RESOURCE))
+            throw SpraymakerException(QObject::tr("%1 isn't a valid VTF file.").arg(file.fileName()),
+                                      QString("%1 resources").arg(count));
+
+        for(size_t i = 0; i < count; i++)
+        {
+            VTF_RESOURCE resource;
+            std::memcpy(&resource, mapped + sizeof(header73) + i * sizeof(resource), sizeof(resource));
+            if (std::memcmp(resource.type, VTF_RESOURCE_HIGH_RES_IMAGE, 3) == 0)
+                return resource.data;
+        }
+
+        throw SpraymakerException(QObject::tr("%1 isn't a valid VTF file.").arg(file.fileName()),
+                                  "No high-res image resource");
+    }
+
+    // Before that, it follows the header and the thumbnail
+    size_t offset = header.headerSize;
+    if (header.lowResImageFormat != VTF_IMAGE_FORMAT::NONE
+        && header.lowResImageWidth > 0 && header.lowResImageHeight > 0)
+    {
+        const auto lowResFormat = mapFormat(header.lowResImageFormat, VTF_FLAGS::NONE);
+        if (lowResFormat == SpraymakerModel::ImageFormat::INVALID)
+            throw SpraymakerException(QObject::tr("%1 isn't supported.").arg(file.fileName()),
+                                      QString("Thumbnail format %1").arg((uint32_t)header.lowResImageFormat));
+
+        offset += ImageHelper::getImageDataSize(lowResFormat, header.lowResImageWidth,
+                                                header.lowResImageHeight, 1, 1);
+    }
+    return offset;
+}
+
+size_t VtfReader::getDataSize(SpraymakerModel::ImageFormat format, int width, int height)
+{
+    // ImageHelper::getImageDataSize() is 32-bit, which the header's sizes can overflow.
+    // Only its size of one block or pixel is used.
+    if (ImageHelper::isDxt(format))
+    {
+        const size_t blocks = (size_t)((width + 3) / 4) * ((height + 3) / 4);
+        return blocks * ImageHelper::getImageDataSize(format, 4, 4, 1, 1);
+    }
+    return (size_t)width * height * ImageHelper::getImageDataSize(format, 1, 1, 1, 1);
+}
+
+SpraymakerModel::ImageFormat VtfReader::mapFormat(VTF_IMAGE_FORMAT vtfFormat, VTF_FLAGS flags)
+{
+    using ImageFormat = SpraymakerModel::ImageFormat;
+
+    switch(vtfFormat)
+    {
+    case VTF_IMAGE_FORMAT::DXT1:
+        return (flags & VTF_FLAGS::ONEBITALPHA) != VTF_FLAGS::NONE ? ImageFormat::DXT1A : ImageFormat::DXT1;
+    case VTF_IMAGE_FORMAT::DXT1_ONEBITALPHA:  return ImageFormat::DXT1A;
+    case VTF_IMAGE_FORMAT::DXT3:              return ImageFormat::DXT3;
+    case VTF_IMAGE_FORMAT::DXT5:              return ImageFormat::DXT5;
+    case VTF_IMAGE_FORMAT::A8:                return ImageFormat::A8;
+    case VTF_IMAGE_FORMAT::I8:                return ImageFormat::I8;
+    case VTF_IMAGE_FORMAT::P8:                return ImageFormat::P8;
+    case VTF_IMAGE_FORMAT::IA88:              return ImageFormat::IA88;
+    case VTF_IMAGE_FORMAT::BGR565:            return ImageFormat::BGR565;
+    case VTF_IMAGE_FORMAT::BGR888:            return ImageFormat::BGR888;
+    case VTF_IMAGE_FORMAT::BGR888_BLUESCREEN: return ImageFormat::BGR888_BLUESCREEN;
+    case VTF_IMAGE_FORMAT::BGRA4444:          return ImageFormat::BGRA4444;
+    case VTF_IMAGE_FORMAT::BGRA5551:          return ImageFormat::BGRA5551;
+    case VTF_IMAGE_FORMAT::BGRA8888:          return ImageFormat::BGRA8888;
+    case VTF_IMAGE_FORMAT::BGRX5551:          return ImageFormat::BGRX5551;
+    case VTF_IMAGE_FORMAT::BGRX8888:          return ImageFormat::BGRX8888;
+    case VTF_IMAGE_FORMAT::RGB565:            return ImageFormat::RGB565;
+    case VTF_IMAGE_FORMAT::RGB888:            return ImageFormat::RGB888;
+    case VTF_IMAGE_FORMAT::RGB888_BLUESCREEN: return ImageFormat::RGB888_BLUESCREEN;
+    case VTF_IMAGE_FORMAT::RGBA8888:          return ImageFormat::RGBA8888;
+    case VTF_IMAGE_FORMAT::ABGR8888:          return ImageFormat::ABGR8888;
+    case VTF_IMAGE_FORMAT::ARGB8888:          return ImageFormat::ARGB8888;
+    case VTF_IMAGE_FORMAT::RGBA16161616:      return ImageFormat::RGBA16161616;
+    case VTF_IMAGE_FORMAT::RGBA16161616F:     return ImageFormat::RGBA16161616F;
+    case VTF_IMAGE_FORMAT::UV88:              return ImageFormat::UV88;
+    case VTF_IMAGE_FORMAT::UVLX8888:          return ImageFormat::UVLX8888;
+    case VTF_IMAGE_FORMAT::UVWQ8888:          return ImageFormat::UVWQ8888;
+    case VTF_IMAGE_FORMAT::R32F:              return ImageFormat::R32F;
+    case VTF_IMAGE_FORMAT::RGB323232F:        return ImageFormat::RGB323232F;
+    case VTF_IMAGE_FORMAT::RGBA32323232F:     return ImageFormat::RGBA32323232F;
+    default:                                  return ImageFormat::INVALID;
+    }
+}
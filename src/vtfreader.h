@@ -0,0 +1,104 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef VTFREADER_H
+#define VTFREADER_H
+
+#include "spraymakermodel.h"
+#include "vtf_defs.h"
+
+#include <QFile>
+#include <QString>
+
+#include <memory>
+#include <vector>
+
+// glib, used by libvips, has its own signals
+#pragma push_macro("signals")
+#undef signals
+#include <vips/vips8>
+#pragma pop_macro("signals")
+
+// ========== VtfReader ==========
+
+// Existing VTF file mapped into memory, versions 7.0 to 7.5.
+// Nothing is decoded up front, every (mipmap, frame) is a view of its bytes within the mapping
+// until getImage() is asked for, and those images only decode the rows libvips asks them for.
+// Cubemaps and volume textures aren't supported, sprays are neither.
+class VtfReader : public std::enable_shared_from_this<VtfReader>
+{
+public:
+    // The data of one (mipmap, frame), straight from the file
+    struct View
+    {
+        int mipmap;
+        int frame;
+        int width;
+        int height;
+        const uchar* data;
+        size_t size;
+    };
+
+    explicit VtfReader(QString filePath);
+    ~VtfReader();
+
+    VtfReader(const VtfReader&) = delete;
+    VtfReader& operator=(const VtfReader&) = delete;
+
+    int getMinorVersion() const;
+    int getWidth() const;
+    int getHeight() const;
+    int getMipmaps() const;
+    int getFrames() const;
+    VTF_FLAGS getFlags() const;
+    VTF_IMAGE_FORMAT getVtfFormat() const;
+    // DXT1 with the 1-bit alpha flag is DXT1A, like it's written
+    SpraymakerModel::ImageFormat getFormat() const;
+
+    const View& getView(int mipmap, int frame) const;
+
+    // False for formats ImageDecoder can't decode, getImage() throws for those
+    bool canDecode() const;
+    // RGBA8888 VImage of a (mipmap, frame), decoded on demand from the mapping.
+    // The reader has to be owned by a std::shared_ptr, every image keeps it alive.
+    vips::VImage getImage(int mipmap, int frame) const;
+
+    // width x count pixels of RGBA8888, starting at row top
+    bool decodeRows(int mipmap, int frame, int top, int count, uchar* rgba) const;
+
+    // Only checks the signature, so other loaders get a go at everything else
+    static bool isVtfFile(QString filePath);
+
+private:
+    QFile file;
+    const uchar* mapped = nullptr;
+    size_t fileSize = 0;
+
+    int minorVersion = 0;
+    int width = 0;
+    int height = 0;
+    int mipmaps = 0;
+    int frames = 0;
+    VTF_FLAGS flags = VTF_FLAGS::NONE;
+    VTF_IMAGE_FORMAT vtfFormat = VTF_IMAGE_FORMAT::NONE;
+    SpraymakerModel::ImageFormat format = SpraymakerModel::ImageFormat::INVALID;
+
+    // views[mipmap * frames + frame]
+    std::vector<View> views;
+
+    // Used when the file system can't map files
+    std::unique_ptr<uchar[]> fallbackBuffer;
+
+    void parseHeader();
+    size_t findImageOffset(const VTF_HEADER_71& header) const;
+
+    // Size of width x height pixels of format, in 64 bits
+    static size_t getDataSize(SpraymakerModel::ImageFormat format, int width, int height);
+    static SpraymakerModel::ImageFormat mapFormat(VTF_IMAGE_FORMAT vtfFormat, VTF_FLAGS flags);
+};
+
+#endif // VTFREADER_H
@@ -0,0 +1,87 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "vtfwriter.h"
+#include "spraymakerexception.h"
+
+#include <QObject>
+
+VtfWriter::VtfWriter(QString filePath, size_t fileSize)
+    : filePath(filePath)
+    , file(filePath + ".part")
+    , fileSize(fileSize)
+{
+    if (file.open(QIODevice::ReadWrite | QIODevice::Truncate) == false)
+        throw SpraymakerException(QObject::tr("Failed to open %1").arg(file.fileName()),
+                                  file.errorString());
+
+    if (file.resize(fileSize) == false)
+    {
+        file.remove();
+        throw SpraymakerException(QObject::tr("Failed to write %1").arg(file.fileName()),
+                                  file.errorString());
+    }
+
+    mapped = file.map(0, fileSize);
+
+    if (mapped == nullptr)
+    {
+        fallbackBuffer = std::make_unique<uchar[]>(fileSize);
+        mapped = fallbackBuffer.get();
+    }
+}
+
+VtfWriter::~VtfWriter()
+{
+    if (committed)
+        return;
+
+    if (fallbackBuffer == nullptr)
+        file.unmap(mapped);
+
+    file.remove();
+}
+
+uchar* VtfWriter::data() const
+{ return mapped; }
+
+size_t VtfWriter::size() const
+{ return fileSize; }
+
+void VtfWriter::commit()
+{
+    bool status = true;
+
+    if (fallbackBuffer)
+    {
+        status &= file.seek(0);
+        status &= file.write((const char*)fallbackBuffer.get(), fileSize) == (qint64)fileSize;
+    }
+    else
+    {
+        status &= file.unmap(mapped);
+    }
+
+    mapped = nullptr;
+    fallbackBuffer.reset();
+    file.close();
+
+    if (QFile::exists(filePath))
+        status &= QFile::remove(filePath);
+
+    if (status)
+        status = file.rename(filePath);
+
+    committed = true;
+
+    if (status == false)
+    {
+        file.remove();
+        throw SpraymakerException(QObject::tr("Failed to write %1").arg(filePath),
+                                  file.errorString());
+    }
+}
@@ -0,0 +1,48 @@
+/*
+ * This file is part of Spraymaker.
+ * Spraymaker is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ * Spraymaker is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License along with Spraymaker. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef VTFWRITER_H
+#define VTFWRITER_H
+
+#include <QFile>
+#include <QString>
+
+#include <memory>
+
+// ========== VtfWriter ==========
+
+// Output file sized up front and mapped into memory, so encode jobs can write
+// their (mipmap, frame) data straight into place.
+// The data goes to a temporary file next to the target, which only replaces the
+// target on commit(). Destroying an uncommitted writer removes it again.
+class VtfWriter
+{
+public:
+    VtfWriter(QString filePath, size_t fileSize);
+    ~VtfWriter();
+
+    VtfWriter(const VtfWriter&) = delete;
+    VtfWriter& operator=(const VtfWriter&) = delete;
+
+    uchar* data() const;
+    size_t size() const;
+
+    void commit();
+
+private:
+    QString filePath;
+    QFile file;
+    size_t fileSize;
+
+    uchar* mapped = nullptr;
+    bool committed = false;
+
+    // Used when the file system can't map files
+    std::unique_ptr<uchar[]> fallbackBuffer;
+};
+
+#endif // VTFWRITER_H